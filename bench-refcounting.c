@@ -0,0 +1,327 @@
+// micro-benchmarks for the refcounting object model, see snek-bench.h for the
+// output format
+//
+// build and run with: make bench
+// SNEK_BENCH_MAX_HEAP=100000 skips the cascade benchmarks on bigger heaps (the
+// default goes up to 10 million objects, which takes most of the run)
+
+#define SNEK_NO_MAIN
+#include "dynamic-values-refcounting.c"
+
+#include "snek-bench.h"
+
+#define OPS 10000
+
+// results are stored here so the compiler cannot drop the calls that made them
+static object_t *volatile sink;
+
+typedef struct BenchContext {
+  object_t *a;
+  object_t *b;
+  object_t *array;
+  // objects made by the measured code, released by the teardown so that
+  // freeing them is not part of the time (unless that is the benchmark)
+  object_t *results[OPS];
+  size_t heap_size; // objects hanging off the root of the cascade benchmarks
+} bench_context_t;
+
+static void release_results(void *ctx) {
+  bench_context_t *c = ctx;
+  for (int i = 0; i < OPS; i++) {
+    refcount_dec(c->results[i]);
+    c->results[i] = NULL;
+  }
+  refcount_dec(c->a);
+  refcount_dec(c->b);
+  refcount_dec(c->array);
+  c->a = c->b = c->array = NULL;
+}
+
+// constructors
+
+static void run_new_integer(void *ctx) {
+  bench_context_t *c = ctx;
+  for (int i = 0; i < OPS; i++) {
+    c->results[i] = new_snek_integer(i);
+  }
+}
+
+static void run_new_float(void *ctx) {
+  bench_context_t *c = ctx;
+  for (int i = 0; i < OPS; i++) {
+    c->results[i] = new_snek_float((float)i);
+  }
+}
+
+static void run_new_string(void *ctx) {
+  bench_context_t *c = ctx;
+  for (int i = 0; i < OPS; i++) {
+    c->results[i] = new_snek_string("short");
+  }
+}
+
+static void run_new_vector3(void *ctx) {
+  bench_context_t *c = ctx;
+  object_t *one = new_snek_integer(1);
+  for (int i = 0; i < OPS; i++) {
+    c->results[i] = new_snek_vector3(one, one, one);
+  }
+}
+
+static void run_new_array(void *ctx) {
+  bench_context_t *c = ctx;
+  for (int i = 0; i < OPS; i++) {
+    c->results[i] = new_snek_array(8);
+  }
+}
+
+static void run_new_int_array(void *ctx) {
+  bench_context_t *c = ctx;
+  for (int i = 0; i < OPS; i++) {
+    c->results[i] = new_snek_int_array(NULL, 64);
+  }
+}
+
+// snek_add, the operands are created by the setup of each benchmark
+
+static void run_add(void *ctx) {
+  bench_context_t *c = ctx;
+  for (int i = 0; i < OPS; i++) {
+    c->results[i] = snek_add(c->a, c->b);
+  }
+}
+
+static void setup_add_int_int(void *ctx) {
+  bench_context_t *c = ctx;
+  c->a = new_snek_integer(1);
+  c->b = new_snek_integer(2);
+}
+
+static void setup_add_int_float(void *ctx) {
+  bench_context_t *c = ctx;
+  c->a = new_snek_integer(1);
+  c->b = new_snek_float(2.5);
+}
+
+static void setup_add_float_float(void *ctx) {
+  bench_context_t *c = ctx;
+  c->a = new_snek_float(1.5);
+  c->b = new_snek_float(2.5);
+}
+
+static void setup_add_short_strings(void *ctx) {
+  bench_context_t *c = ctx;
+  c->a = new_snek_string("hello ");
+  c->b = new_snek_string("world");
+}
+
+static void setup_add_long_strings(void *ctx) {
+  bench_context_t *c = ctx;
+  c->a = new_snek_string("a string that does not fit inline, ");
+  c->b = new_snek_string("and neither does this one");
+}
+
+static void setup_add_vector3(void *ctx) {
+  bench_context_t *c = ctx;
+  object_t *one = new_snek_integer(1);
+  object_t *half = new_snek_float(0.5);
+  c->a = new_snek_vector3(one, one, one);
+  c->b = new_snek_vector3(half, half, half);
+}
+
+static void setup_add_arrays(void *ctx) {
+  bench_context_t *c = ctx;
+  c->a = new_snek_array(8);
+  c->b = new_snek_array(8);
+  for (size_t i = 0; i < 8; i++) {
+    snek_array_set(c->a, i, new_snek_integer((int)i));
+    snek_array_set(c->b, i, new_snek_integer((int)i));
+  }
+}
+
+static void setup_add_int_arrays(void *ctx) {
+  bench_context_t *c = ctx;
+  c->a = new_snek_int_array(NULL, 64);
+  c->b = new_snek_int_array(NULL, 64);
+}
+
+static void setup_add_float_arrays(void *ctx) {
+  bench_context_t *c = ctx;
+  c->a = new_snek_float_array(NULL, 64);
+  c->b = new_snek_float_array(NULL, 64);
+}
+
+static void setup_add_mixed_arrays(void *ctx) {
+  bench_context_t *c = ctx;
+  c->a = new_snek_int_array(NULL, 64);
+  c->b = new_snek_float_array(NULL, 64);
+}
+
+// array access, set also moves the refcount of the old and the new element
+
+static void setup_arrays(void *ctx) {
+  bench_context_t *c = ctx;
+  c->array = new_snek_array(1024);
+  c->a = new_snek_int_array(NULL, 1024);
+  c->b = new_snek_string("element");
+}
+
+static void run_array_set(void *ctx) {
+  bench_context_t *c = ctx;
+  for (int i = 0; i < OPS; i++) {
+    snek_array_set(c->array, (size_t)i % 1024, c->b);
+  }
+}
+
+static void run_array_get(void *ctx) {
+  bench_context_t *c = ctx;
+  for (int i = 0; i < OPS; i++) {
+    sink = snek_array_get(c->array, (size_t)i % 1024);
+  }
+}
+
+static void run_int_array_set(void *ctx) {
+  bench_context_t *c = ctx;
+  object_t *seven = new_snek_integer(7);
+  for (int i = 0; i < OPS; i++) {
+    snek_array_set(c->a, (size_t)i % 1024, seven);
+  }
+}
+
+static void run_int_array_get(void *ctx) {
+  bench_context_t *c = ctx;
+  for (int i = 0; i < OPS; i++) {
+    sink = snek_array_get(c->a, (size_t)i % 1024);
+  }
+}
+
+// refcounting itself
+
+static void setup_one_object(void *ctx) {
+  bench_context_t *c = ctx;
+  c->a = new_snek_string("counted");
+}
+
+static void run_refcount_inc_dec(void *ctx) {
+  bench_context_t *c = ctx;
+  for (int i = 0; i < OPS; i++) {
+    refcount_inc(c->a);
+  }
+  for (int i = 0; i < OPS; i++) {
+    refcount_dec(c->a);
+  }
+}
+
+static void setup_objects(void *ctx) {
+  bench_context_t *c = ctx;
+  for (int i = 0; i < OPS; i++) {
+    c->results[i] = new_snek_string("freed");
+  }
+}
+
+// the last refcount_dec of an object frees it
+static void run_refcount_free(void *ctx) {
+  bench_context_t *c = ctx;
+  for (int i = 0; i < OPS; i++) {
+    refcount_dec(c->results[i]);
+    c->results[i] = NULL;
+  }
+}
+
+// releasing a synthetic heap: 'heap_size' objects (a mix of short strings,
+// vectors and small arrays) owned by one big array, dropping the array frees
+// all of them one after the other. It is what a collection of the same heap
+// costs the tracing model (see vm_collect_garbage in bench-tracing.c)
+
+static void setup_heap(void *ctx) {
+  bench_context_t *c = ctx;
+  object_t *one = new_snek_integer(1);
+  c->array = new_snek_array(c->heap_size);
+  for (size_t i = 0; i + 1 < c->heap_size; i++) {
+    object_t *obj;
+    switch (i % 3) {
+    case 0:
+      obj = new_snek_string("short");
+      break;
+    case 1:
+      obj = new_snek_vector3(one, one, one);
+      break;
+    default:
+      obj = new_snek_array(0);
+      break;
+    }
+    snek_array_set(c->array, i, obj);
+    refcount_dec(obj); // the array holds the only reference now
+  }
+}
+
+static void run_release_heap(void *ctx) {
+  bench_context_t *c = ctx;
+  refcount_dec(c->array);
+  c->array = NULL;
+}
+
+static void bench(const char *name, void (*setup)(void *),
+                  void (*run)(void *)) {
+  static bench_context_t context;
+  memset(&context, 0, sizeof(context));
+  snek_bench_run("refcounting", (snek_bench_t){.name = name,
+                                               .ops = OPS,
+                                               .setup = setup,
+                                               .run = run,
+                                               .teardown = release_results,
+                                               .ctx = &context});
+}
+
+int main() {
+  bench("new_snek_integer", NULL, run_new_integer);
+  bench("new_snek_float", NULL, run_new_float);
+  bench("new_snek_string/short", NULL, run_new_string);
+  bench("new_snek_vector3", NULL, run_new_vector3);
+  bench("new_snek_array/8", NULL, run_new_array);
+  bench("new_snek_int_array/64", NULL, run_new_int_array);
+
+  bench("snek_add/int+int", setup_add_int_int, run_add);
+  bench("snek_add/int+float", setup_add_int_float, run_add);
+  bench("snek_add/float+float", setup_add_float_float, run_add);
+  bench("snek_add/string+string/short", setup_add_short_strings, run_add);
+  bench("snek_add/string+string/long", setup_add_long_strings, run_add);
+  bench("snek_add/vector3+vector3", setup_add_vector3, run_add);
+  bench("snek_add/array+array/8", setup_add_arrays, run_add);
+  bench("snek_add/int_array+int_array/64", setup_add_int_arrays, run_add);
+  bench("snek_add/float_array+float_array/64", setup_add_float_arrays,
+        run_add);
+  bench("snek_add/int_array+float_array/64", setup_add_mixed_arrays, run_add);
+
+  bench("snek_array_set", setup_arrays, run_array_set);
+  bench("snek_array_get", setup_arrays, run_array_get);
+  bench("snek_array_set/int_array", setup_arrays, run_int_array_set);
+  bench("snek_array_get/int_array", setup_arrays, run_int_array_get);
+
+  bench("refcount_inc+refcount_dec", setup_one_object, run_refcount_inc_dec);
+  bench("refcount_free", setup_objects, run_refcount_free);
+
+  // one release per repetition, reported per object in the heap
+  static bench_context_t heap;
+  char name[64];
+  size_t max_heap = 10000000;
+  if (getenv("SNEK_BENCH_MAX_HEAP") != NULL) {
+    max_heap = (size_t)atol(getenv("SNEK_BENCH_MAX_HEAP"));
+  }
+  for (size_t size = 1000; size <= max_heap; size *= 10) {
+    memset(&heap, 0, sizeof(heap));
+    heap.heap_size = size;
+    snprintf(name, sizeof(name), "refcount_free/cascade/%zu", size);
+    // the biggest heaps take a while to build, so they are repeated less
+    size_t reps = size >= 1000000 ? 5 : 0;
+    snek_bench_run("refcounting", (snek_bench_t){.name = name,
+                                                 .ops = size,
+                                                 .setup = setup_heap,
+                                                 .run = run_release_heap,
+                                                 .teardown = release_results,
+                                                 .ctx = &heap,
+                                                 .reps = reps});
+  }
+
+  return 0;
+}
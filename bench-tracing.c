@@ -0,0 +1,557 @@
+// micro-benchmarks for the tracing (mark and sweep) object model, see
+// snek-bench.h for the output format
+//
+// build and run with: make bench
+// SNEK_BENCH_MAX_HEAP=100000 skips the gc benchmarks on bigger heaps (the
+// default goes up to 10 million objects, which takes most of the run)
+
+#define SNEK_NO_MAIN
+#include "dynamic-values-tracing.c"
+
+#include "snek-bench.h"
+
+#define OPS 10000
+
+// results are stored here so the compiler cannot drop the calls that made them
+static object_t *volatile sink;
+
+typedef struct BenchContext {
+  vm_t *vm;
+  object_t *a;
+  object_t *b;
+  object_t *array;
+  stack_t *stack;
+  size_t heap_size; // objects in the synthetic heap of the gc benchmarks
+  bool live;        // whether the synthetic heap is reachable from a frame
+  size_t threads;   // marking threads of the gc benchmarks (0 means 1)
+  sweep_mode_t sweep_mode;
+  size_t sweep_threads;
+  const char *chars;
+} bench_context_t;
+
+// every repetition gets a fresh vm, so the slab never fills up between
+// repetitions and vm_free() is not part of the measured time
+static void fresh_vm(void *ctx) {
+  bench_context_t *c = ctx;
+  c->vm = vm_new();
+}
+
+// the same with automatic collection, a small minimum trigger makes the
+// collections happen within one repetition
+static void paced_vm(void *ctx) {
+  bench_context_t *c = ctx;
+  c->vm = vm_new();
+  vm_set_gc_pacing(c->vm, 100, 64 * 1024);
+}
+
+// the same with the benchmark thread attached as a mutator, it allocates from
+// its TLAB (detached again by detached_free_vm)
+static void attached_vm(void *ctx) {
+  bench_context_t *c = ctx;
+  c->vm = vm_new();
+  vm_attach_mutator(c->vm);
+}
+
+static void free_vm(void *ctx) {
+  bench_context_t *c = ctx;
+  vm_free(c->vm);
+  c->vm = NULL;
+}
+
+static void detached_free_vm(void *ctx) {
+  bench_context_t *c = ctx;
+  vm_detach_mutator(c->vm);
+  free_vm(ctx);
+}
+
+// constructors
+
+static void run_new_integer(void *ctx) {
+  bench_context_t *c = ctx;
+  for (int i = 0; i < OPS; i++) {
+    sink = new_snek_integer(c->vm, i);
+  }
+}
+
+static void run_new_float(void *ctx) {
+  bench_context_t *c = ctx;
+  for (int i = 0; i < OPS; i++) {
+    sink = new_snek_float(c->vm, (float)i);
+  }
+}
+
+static void run_new_string(void *ctx) {
+  bench_context_t *c = ctx;
+  for (int i = 0; i < OPS; i++) {
+    sink = new_snek_string(c->vm, c->chars);
+  }
+}
+
+static void run_new_vector3(void *ctx) {
+  bench_context_t *c = ctx;
+  object_t *one = new_snek_integer(c->vm, 1);
+  for (int i = 0; i < OPS; i++) {
+    sink = new_snek_vector3(c->vm, one, one, one);
+  }
+}
+
+static void run_new_array(void *ctx) {
+  bench_context_t *c = ctx;
+  for (int i = 0; i < OPS; i++) {
+    sink = new_snek_array(c->vm, 8);
+  }
+}
+
+static void run_new_int_array(void *ctx) {
+  bench_context_t *c = ctx;
+  for (int i = 0; i < OPS; i++) {
+    sink = new_snek_int_array(c->vm, NULL, 64);
+  }
+}
+
+// snek_add, the operands are created by the setup of each benchmark
+
+static void run_add(void *ctx) {
+  bench_context_t *c = ctx;
+  for (int i = 0; i < OPS; i++) {
+    sink = snek_add(c->vm, c->a, c->b);
+  }
+}
+
+static void setup_add_int_int(void *ctx) {
+  bench_context_t *c = ctx;
+  fresh_vm(c);
+  c->a = new_snek_integer(c->vm, 1);
+  c->b = new_snek_integer(c->vm, 2);
+}
+
+static void setup_add_int_float(void *ctx) {
+  bench_context_t *c = ctx;
+  fresh_vm(c);
+  c->a = new_snek_integer(c->vm, 1);
+  c->b = new_snek_float(c->vm, 2.5);
+}
+
+static void setup_add_float_float(void *ctx) {
+  bench_context_t *c = ctx;
+  fresh_vm(c);
+  c->a = new_snek_float(c->vm, 1.5);
+  c->b = new_snek_float(c->vm, 2.5);
+}
+
+static void setup_add_short_strings(void *ctx) {
+  bench_context_t *c = ctx;
+  fresh_vm(c);
+  c->a = new_snek_string(c->vm, "hello ");
+  c->b = new_snek_string(c->vm, "world");
+}
+
+static void setup_add_long_strings(void *ctx) {
+  bench_context_t *c = ctx;
+  fresh_vm(c);
+  c->a = new_snek_string(c->vm, "a string that does not fit inline, ");
+  c->b = new_snek_string(c->vm, "and neither does this one");
+}
+
+static void setup_add_vector3(void *ctx) {
+  bench_context_t *c = ctx;
+  fresh_vm(c);
+  object_t *one = new_snek_integer(c->vm, 1);
+  object_t *half = new_snek_float(c->vm, 0.5);
+  c->a = new_snek_vector3(c->vm, one, one, one);
+  c->b = new_snek_vector3(c->vm, half, half, half);
+}
+
+static void setup_add_arrays(void *ctx) {
+  bench_context_t *c = ctx;
+  fresh_vm(c);
+  c->a = new_snek_array(c->vm, 8);
+  c->b = new_snek_array(c->vm, 8);
+  for (size_t i = 0; i < 8; i++) {
+    snek_array_set(c->a, i, new_snek_integer(c->vm, (int)i));
+    snek_array_set(c->b, i, new_snek_integer(c->vm, (int)i));
+  }
+}
+
+static void setup_add_int_arrays(void *ctx) {
+  bench_context_t *c = ctx;
+  fresh_vm(c);
+  c->a = new_snek_int_array(c->vm, NULL, 64);
+  c->b = new_snek_int_array(c->vm, NULL, 64);
+}
+
+static void setup_add_float_arrays(void *ctx) {
+  bench_context_t *c = ctx;
+  fresh_vm(c);
+  c->a = new_snek_float_array(c->vm, NULL, 64);
+  c->b = new_snek_float_array(c->vm, NULL, 64);
+}
+
+static void setup_add_mixed_arrays(void *ctx) {
+  bench_context_t *c = ctx;
+  fresh_vm(c);
+  c->a = new_snek_int_array(c->vm, NULL, 64);
+  c->b = new_snek_float_array(c->vm, NULL, 64);
+}
+
+// array access
+
+static void setup_arrays(void *ctx) {
+  bench_context_t *c = ctx;
+  fresh_vm(c);
+  c->array = new_snek_array(c->vm, 1024);
+  c->a = new_snek_int_array(c->vm, NULL, 1024);
+  c->b = new_snek_integer(c->vm, 7);
+}
+
+static void run_array_set(void *ctx) {
+  bench_context_t *c = ctx;
+  for (int i = 0; i < OPS; i++) {
+    snek_array_set(c->array, (size_t)i % 1024, c->b);
+  }
+}
+
+static void run_array_get(void *ctx) {
+  bench_context_t *c = ctx;
+  for (int i = 0; i < OPS; i++) {
+    sink = snek_array_get(c->array, (size_t)i % 1024);
+  }
+}
+
+static void run_int_array_set(void *ctx) {
+  bench_context_t *c = ctx;
+  for (int i = 0; i < OPS; i++) {
+    snek_array_set(c->a, (size_t)i % 1024, c->b);
+  }
+}
+
+static void run_int_array_get(void *ctx) {
+  bench_context_t *c = ctx;
+  for (int i = 0; i < OPS; i++) {
+    sink = snek_array_get(c->a, (size_t)i % 1024);
+  }
+}
+
+// stack
+
+static void setup_stack(void *ctx) {
+  bench_context_t *c = ctx;
+  c->stack = stack_new(8);
+}
+
+static void teardown_stack(void *ctx) {
+  bench_context_t *c = ctx;
+  stack_free(c->stack);
+}
+
+static void run_stack_push_pop(void *ctx) {
+  bench_context_t *c = ctx;
+  for (int i = 0; i < OPS; i++) {
+    stack_push(c->stack, c);
+  }
+  for (int i = 0; i < OPS; i++) {
+    stack_pop(c->stack);
+  }
+}
+
+// a call: the frame of the callee is created, holds an argument and is popped
+// again, the frames come from the free list of the VM after the first call
+static void run_frame_push_pop(void *ctx) {
+  bench_context_t *c = ctx;
+  object_t *one = new_snek_integer(c->vm, 1);
+  for (int i = 0; i < OPS; i++) {
+    frame_reference_object(vm_new_frame(c->vm), one);
+    vm_frame_pop(c->vm);
+  }
+}
+
+// rooting a temporary in a frame, the frame is emptied again before it spills
+static void run_snek_root(void *ctx) {
+  bench_context_t *c = ctx;
+  frame_t *frame = vm_new_frame(c->vm);
+  object_t *one = new_snek_integer(c->vm, 1);
+  for (int i = 0; i < OPS; i++) {
+    SNEK_ROOT(frame, one);
+    frame_drop_references(frame, 0);
+  }
+}
+
+// garbage collection on a synthetic heap: 'heap_size' objects (a mix of short
+// strings, vectors and small arrays) that are either all reachable from a
+// frame through one big array (live) or all unreachable (garbage)
+
+static void setup_heap(void *ctx) {
+  bench_context_t *c = ctx;
+  fresh_vm(c);
+  vm_set_mark_threads(c->vm, c->threads);
+  vm_set_sweep_mode(c->vm, c->sweep_mode, c->sweep_threads);
+  object_t *one = new_snek_integer(c->vm, 1);
+  object_t *root = new_snek_array(c->vm, c->heap_size);
+  for (size_t i = 0; i + 1 < c->heap_size; i++) {
+    object_t *obj;
+    switch (i % 3) {
+    case 0:
+      obj = new_snek_string(c->vm, "short");
+      break;
+    case 1:
+      obj = new_snek_vector3(c->vm, one, one, one);
+      break;
+    default:
+      obj = new_snek_array(c->vm, 0);
+      break;
+    }
+    snek_array_set(root, i, obj);
+  }
+
+  if (c->live) {
+    frame_reference_object(vm_new_frame(c->vm), root);
+  }
+}
+
+static void run_collect(void *ctx) {
+  bench_context_t *c = ctx;
+  vm_collect_garbage(c->vm);
+}
+
+// with SWEEP_LAZY the collection above only marks, the sweep is paid by the
+// allocations after it: allocate until it is over
+static void run_collect_then_allocate(void *ctx) {
+  bench_context_t *c = ctx;
+  vm_collect_garbage(c->vm);
+  while (c->vm->gc_phase == GC_SWEEPING) {
+    sink = new_snek_string(c->vm, "short");
+  }
+}
+
+// a fragmented heap: 'heap_size' rows (an array with a long string) were
+// allocated but only one in 50 is still in the table, and the table is read
+// row by row. 'live' compacts the heap before the rows are read
+#define ROW_SURVIVAL 50
+
+static void setup_fragmented(void *ctx) {
+  bench_context_t *c = ctx;
+  fresh_vm(c);
+  // the table moves when the heap is compacted, the handle follows it
+  snek_handle_t *table = vm_new_handle(c->vm, new_snek_array(c->vm, 0));
+  for (size_t i = 0; i < c->heap_size; i++) {
+    object_t *row = new_snek_array(c->vm, 1);
+    snek_array_set(row, 0, new_snek_string(c->vm, "a row that is long enough "
+                                                  "to have its own buffer"));
+    if (i % ROW_SURVIVAL == 0) {
+      snek_array_push(table->obj, row);
+    }
+  }
+  vm_collect_garbage(c->vm);
+  if (c->live) {
+    vm_compact(c->vm);
+  }
+  c->array = table->obj;
+}
+
+static void run_read_rows(void *ctx) {
+  bench_context_t *c = ctx;
+  size_t length = 0;
+  for (int rep = 0; rep < 10; rep++) {
+    for (size_t i = 0; i < c->array->data.v_array.size; i++) {
+      object_t *row = snek_array_get(c->array, i);
+      length += (size_t)snek_len(snek_array_get(row, 0));
+    }
+  }
+  sink = (object_t *)length;
+}
+
+static void run_compact(void *ctx) {
+  bench_context_t *c = ctx;
+  vm_compact(c->vm);
+}
+
+// the live synthetic heap becomes the old generation, on top of it come
+// YOUNG_OBJECTS temporaries of which one in 10 is still referenced by a frame
+#define YOUNG_OBJECTS 10000
+
+static void setup_generations(void *ctx) {
+  bench_context_t *c = ctx;
+  c->live = true;
+  setup_heap(c);
+  vm_set_generational(c->vm, true, 2);
+  frame_t *frame = vm_new_frame(c->vm);
+  for (int i = 0; i < YOUNG_OBJECTS; i++) {
+    object_t *obj = new_snek_string(c->vm, "young");
+    if (i % 10 == 0) {
+      frame_reference_object(frame, obj);
+    }
+  }
+}
+
+static void run_collect_young(void *ctx) {
+  bench_context_t *c = ctx;
+  vm_collect_young(c->vm);
+}
+
+static void bench(const char *name, void (*setup)(void *),
+                  void (*run)(void *), void (*teardown)(void *)) {
+  static bench_context_t context;
+  memset(&context, 0, sizeof(context));
+  context.chars = "short";
+  snek_bench_run("tracing", (snek_bench_t){.name = name,
+                                           .ops = OPS,
+                                           .setup = setup,
+                                           .run = run,
+                                           .teardown = teardown,
+                                           .ctx = &context});
+}
+
+int main() {
+  bench("new_snek_integer", fresh_vm, run_new_integer, free_vm);
+  bench("new_snek_float", fresh_vm, run_new_float, free_vm);
+  bench("new_snek_string/short", fresh_vm, run_new_string, free_vm);
+  bench("new_snek_string/short/paced", paced_vm, run_new_string, free_vm);
+  bench("new_snek_vector3", fresh_vm, run_new_vector3, free_vm);
+  bench("new_snek_array/8", fresh_vm, run_new_array, free_vm);
+  bench("new_snek_array/8/mutator", attached_vm, run_new_array,
+        detached_free_vm);
+  bench("new_snek_int_array/64", fresh_vm, run_new_int_array, free_vm);
+
+  bench("snek_add/int+int", setup_add_int_int, run_add, free_vm);
+  bench("snek_add/int+float", setup_add_int_float, run_add, free_vm);
+  bench("snek_add/float+float", setup_add_float_float, run_add, free_vm);
+  bench("snek_add/string+string/short", setup_add_short_strings, run_add,
+        free_vm);
+  bench("snek_add/string+string/long", setup_add_long_strings, run_add,
+        free_vm);
+  bench("snek_add/vector3+vector3", setup_add_vector3, run_add, free_vm);
+  bench("snek_add/array+array/8", setup_add_arrays, run_add, free_vm);
+  bench("snek_add/int_array+int_array/64", setup_add_int_arrays, run_add,
+        free_vm);
+  bench("snek_add/float_array+float_array/64", setup_add_float_arrays, run_add,
+        free_vm);
+  bench("snek_add/int_array+float_array/64", setup_add_mixed_arrays, run_add,
+        free_vm);
+
+  bench("snek_array_set", setup_arrays, run_array_set, free_vm);
+  bench("snek_array_get", setup_arrays, run_array_get, free_vm);
+  bench("snek_array_set/int_array", setup_arrays, run_int_array_set, free_vm);
+  bench("snek_array_get/int_array", setup_arrays, run_int_array_get, free_vm);
+
+  bench("stack_push+stack_pop", setup_stack, run_stack_push_pop,
+        teardown_stack);
+  bench("vm_new_frame+vm_frame_pop", fresh_vm, run_frame_push_pop, free_vm);
+  bench("SNEK_ROOT", fresh_vm, run_snek_root, free_vm);
+
+  // one collection per repetition, reported per object in the heap
+  static bench_context_t heap;
+  char name[64];
+  // SNEK_BENCH_MAX_HEAP stops the heap sizes early, e.g. for a quick run
+  size_t max_heap = 10000000;
+  if (getenv("SNEK_BENCH_MAX_HEAP") != NULL) {
+    max_heap = (size_t)atol(getenv("SNEK_BENCH_MAX_HEAP"));
+  }
+  for (size_t size = 1000; size <= max_heap; size *= 10) {
+    for (int live = 0; live <= 1; live++) {
+      heap = (bench_context_t){.heap_size = size, .live = live};
+      snprintf(name, sizeof(name), "vm_collect_garbage/%s/%zu",
+               live ? "live" : "garbage", size);
+      // the biggest heaps take a while to build, so they are repeated less
+      size_t reps = size >= 1000000 ? 5 : 0;
+      snek_bench_run("tracing", (snek_bench_t){.name = name,
+                                               .ops = size,
+                                               .setup = setup_heap,
+                                               .run = run_collect,
+                                               .teardown = free_vm,
+                                               .ctx = &heap,
+                                               .reps = reps});
+    }
+
+    // the same live heap marked by several threads
+    for (size_t threads = 2; threads <= 8 && size >= 100000; threads *= 2) {
+      heap = (bench_context_t){
+          .heap_size = size, .live = true, .threads = threads};
+      snprintf(name, sizeof(name), "vm_collect_garbage/live/%zu/threads%zu",
+               size, threads);
+      snek_bench_run("tracing", (snek_bench_t){.name = name,
+                                               .ops = size,
+                                               .setup = setup_heap,
+                                               .run = run_collect,
+                                               .teardown = free_vm,
+                                               .ctx = &heap,
+                                               .reps = size >= 1000000 ? 5
+                                                                       : 0});
+    }
+
+    // the garbage heap swept in other ways: the pause of a lazy collection,
+    // the lazy collection together with the allocations that finish its
+    // sweep, and several sweeping threads
+    heap = (bench_context_t){.heap_size = size, .sweep_mode = SWEEP_LAZY};
+    snprintf(name, sizeof(name), "vm_collect_garbage/garbage/%zu/lazy", size);
+    snek_bench_run("tracing", (snek_bench_t){.name = name,
+                                             .ops = size,
+                                             .setup = setup_heap,
+                                             .run = run_collect,
+                                             .teardown = free_vm,
+                                             .ctx = &heap,
+                                             .reps = size >= 1000000 ? 5 : 0});
+    snprintf(name, sizeof(name), "vm_collect_garbage/garbage/%zu/lazy+alloc",
+             size);
+    snek_bench_run("tracing", (snek_bench_t){.name = name,
+                                             .ops = size,
+                                             .setup = setup_heap,
+                                             .run = run_collect_then_allocate,
+                                             .teardown = free_vm,
+                                             .ctx = &heap,
+                                             .reps = size >= 1000000 ? 5 : 0});
+    for (size_t threads = 2; threads <= 8 && size >= 100000; threads *= 2) {
+      heap = (bench_context_t){.heap_size = size,
+                               .sweep_mode = SWEEP_PARALLEL,
+                               .sweep_threads = threads};
+      snprintf(name, sizeof(name),
+               "vm_collect_garbage/garbage/%zu/sweep_threads%zu", size,
+               threads);
+      snek_bench_run("tracing", (snek_bench_t){.name = name,
+                                               .ops = size,
+                                               .setup = setup_heap,
+                                               .run = run_collect,
+                                               .teardown = free_vm,
+                                               .ctx = &heap,
+                                               .reps = size >= 1000000 ? 5
+                                                                       : 0});
+    }
+
+    // reading the survivors of a fragmented heap, before and after compaction,
+    // and the compaction itself (per row that was allocated)
+    for (int compacted = 0; compacted <= 1; compacted++) {
+      heap = (bench_context_t){.heap_size = size, .live = compacted};
+      snprintf(name, sizeof(name), "read_rows/%s/%zu",
+               compacted ? "compacted" : "fragmented", size);
+      snek_bench_run("tracing",
+                     (snek_bench_t){.name = name,
+                                    .ops = 10 * (size / ROW_SURVIVAL),
+                                    .setup = setup_fragmented,
+                                    .run = run_read_rows,
+                                    .teardown = free_vm,
+                                    .ctx = &heap,
+                                    .reps = size >= 1000000 ? 5 : 0});
+    }
+    heap = (bench_context_t){.heap_size = size};
+    snprintf(name, sizeof(name), "vm_compact/fragmented/%zu", size);
+    snek_bench_run("tracing", (snek_bench_t){.name = name,
+                                             .ops = size,
+                                             .setup = setup_fragmented,
+                                             .run = run_compact,
+                                             .teardown = free_vm,
+                                             .ctx = &heap,
+                                             .reps = size >= 1000000 ? 5 : 0});
+
+    // a minor collection costs the same no matter how big the old heap is
+    heap = (bench_context_t){.heap_size = size};
+    snprintf(name, sizeof(name), "vm_collect_young/old/%zu", size);
+    snek_bench_run("tracing", (snek_bench_t){.name = name,
+                                             .ops = YOUNG_OBJECTS,
+                                             .setup = setup_generations,
+                                             .run = run_collect_young,
+                                             .teardown = free_vm,
+                                             .ctx = &heap,
+                                             .reps = size >= 1000000 ? 5 : 0});
+  }
+
+  return 0;
+}
@@ -1,48 +1,88 @@
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "snek-simd.h"
+
 // Lab tests implementing a tagged runtime object system — the skeleton of a
 // dynamic language / interpreter value model, similar to how Python, Lisp, Lua,
 // or a toy VM represents values.
 // - object_t is a boxed value with a kind tag (INTEGER, FLOAT, STRING, etc.)
-// - All primitive and composite types are heap-allocated objects
-// - VECTOR3 is a product type — fixed tuple of 3 objects
+// - INTEGER and FLOAT are immediates packed into the pointer itself, all other
+//   types are heap-allocated objects
+// - VECTOR3 is a product type — fixed tuple of 3 numbers stored inline
 // - ARRAY is a dynamically sized growable list of object pointers
+// - the element wise math on typed arrays runs on the SIMD kernels of
+//   snek-simd.h
 // - All the new_snek_* functions are constructors in a managed heap
 // - We are manually handling reference semantics + lifetime + dynamic typing
 // - We are doing runtime type tagging + union dispatch
 
 typedef struct Object object_t;
 
+// the 3 components are stored in the object itself, either 3 ints or 3 floats
+// (as soon as one of them is a float all of them are), so a vector holds no
+// references and adding 2 of them is a single allocation
 typedef struct Vector {
-  object_t *x;
-  object_t *y;
-  object_t *z;
+  bool is_float;
+  union {
+    int32_t ints[3];
+    float floats[3];
+  };
 } vector_t;
 
 typedef struct Array {
   size_t size;         // number of elements in array
+  size_t capacity;     // number of elements that fit before we have to grow
   object_t **elements; // actual elements inside the array are pointers to other
                        // objects
 } array_t;
 
+// strings up to this many bytes are stored inside the object itself, only
+// longer strings need a second allocation for their characters
+#define SNEK_SMALL_STRING_MAX 22
+
+typedef struct String {
+  // number of bytes in the string (not counting the '\0'), cached so we never
+  // have to strlen() a snek string, it also tells us which layout is used
+  size_t length;
+  union {
+    char *heap_chars; // characters of a long string, in their own allocation
+    char inline_chars[SNEK_SMALL_STRING_MAX + 1]; // short string + '\0'
+  };
+} string_t;
+
+// ARRAY of numbers without the boxes, the numbers are stored one after the
+// other in a single buffer, 4 bytes each
+typedef struct TypedArray {
+  size_t size; // number of numbers in the array
+  union {
+    int32_t *ints; // INT_ARRAY
+    float *floats; // FLOAT_ARRAY
+  };
+} typed_array_t;
+
 typedef enum ObjectKind {
   INTEGER,
   FLOAT,
   STRING,
   VECTOR3,
   ARRAY,
+  INT_ARRAY,
+  FLOAT_ARRAY,
 } object_kind_t;
 
 typedef union ObjectData {
   int v_int;
   float v_float;
-  char *v_string;
-  vector_t v_vector3; // 3 point integer
+  string_t v_string;
+  vector_t v_vector3; // 3 point int or float
   array_t v_array;    // dynamic size array
+  // INT_ARRAY and FLOAT_ARRAY
+  typed_array_t v_typed_array;
 } object_data_t;
 
 typedef struct Object {
@@ -54,37 +94,135 @@ typedef struct Object {
 
   object_kind_t kind; // the kind of the object
   object_data_t data; // type of data to be stored in object
+  bool is_interned;   // STRING only, this is the copy held by the intern table
 } object_t;
 
+// immediate values
+// INTEGER and FLOAT values are never allocated, instead the value is packed
+// into the object_t * itself. Real objects are always at least 8 byte aligned,
+// so the low bits of their address are 0 and we can use them as a tag that
+// tells us the pointer is not a pointer at all. The 32 bit value sits in the
+// upper half of the (64 bit) pointer
+#define SNEK_TAG_MASK 0x3
+#define SNEK_TAG_INTEGER 0x1
+#define SNEK_TAG_FLOAT 0x2
+
+_Static_assert(sizeof(uintptr_t) == 8,
+               "immediate values need 64 bit pointers to fit a 32 bit value");
+
+// string interning
+// when interning is turned on every distinct string exists only once, the
+// table maps the characters of a string to its one canonical STRING object.
+// Strings are immutable so the same object can be handed out to everyone who
+// asks for those characters, and 2 interned strings are equal only if they
+// are the same pointer
+typedef struct InternEntry {
+  uint64_t hash;    // hash of the characters, kept to avoid rehashing
+  object_t *string; // canonical STRING object, NULL for an empty slot
+} intern_entry_t;
+
+typedef struct InternTable {
+  size_t count;    // number of strings in the table
+  size_t capacity; // number of slots, always a power of 2 (or 0)
+  intern_entry_t *entries;
+} intern_table_t;
+
+// the refcounting model has no VM to keep the table in so it is global, the
+// table does not own a reference to its strings, a string is removed from it
+// when its refcount drops to 0
+intern_table_t interned_strings = {.count = 0, .capacity = 0, .entries = NULL};
+bool intern_strings = false; // new strings go through the table when enabled
+
+// heap accounting
+// the bytes of the live objects per kind: the object itself and the buffer it
+// owns (the characters of a long string, the elements of an array, the numbers
+// of a typed array), see snek_object_size(). They are counted when an object
+// is created or grows and when it is freed, so they are exact at any time.
+// Immediates don't live on the heap and are not counted
+#define SNEK_KINDS (FLOAT_ARRAY + 1)
+
+typedef struct HeapStats {
+  size_t objects[SNEK_KINDS];
+  size_t bytes[SNEK_KINDS];
+  size_t live_bytes; // all kinds together
+  size_t peak_bytes; // the most live_bytes there ever were
+} heap_stats_t;
+
+// global for the same reason as the intern table
+heap_stats_t heap_stats = {.live_bytes = 0, .peak_bytes = 0};
+
 object_t *new_snek_integer(int value);
 object_t *new_snek_float(float value);
 object_t *new_snek_string(
     const char *value); // we make this a const char * to make it clear we do
                         // not intend to modify the input
 object_t *new_snek_vector3(object_t *x, object_t *y, object_t *z);
+object_t *snek_vector3_get(object_t *obj, size_t axis);
+bool snek_vector3_add_into(object_t *out, object_t *a, object_t *b);
 object_t *new_snek_array(size_t size);
+object_t *new_snek_int_array(const int32_t *values, size_t size);
+object_t *new_snek_float_array(const float *values, size_t size);
+object_t *_new_snek_typed_array(object_kind_t kind, size_t size);
 bool snek_array_set(object_t *obj, size_t index, object_t *value);
 object_t *snek_array_get(object_t *obj, size_t index);
+bool snek_array_reserve(object_t *obj, size_t capacity);
+bool snek_array_push(object_t *obj, object_t *value);
+bool snek_array_grow_for(object_t *obj, size_t extra);
+bool snek_array_extend(object_t *obj, object_t *other);
 int snek_len(object_t *obj);
+bool snek_is_immediate(object_t *obj);
+object_kind_t snek_kind(object_t *obj);
+int snek_int_value(object_t *obj);
+float snek_float_value(object_t *obj);
+char *snek_string_chars(object_t *obj);
+bool snek_string_is_inline(object_t *obj);
+object_t *_new_snek_string_buffer(size_t length);
+void snek_set_string_interning(bool enabled);
+uint64_t intern_hash(uint64_t hash, const char *chars, size_t length);
+object_t *intern_table_find(intern_table_t *table, uint64_t hash,
+                            const char *a, size_t a_length, const char *b,
+                            size_t b_length);
+bool intern_table_grow(intern_table_t *table);
+bool intern_table_insert(intern_table_t *table, uint64_t hash,
+                         object_t *string);
+void intern_table_remove(intern_table_t *table, object_t *string);
+void intern_table_free(intern_table_t *table);
+bool snek_string_equals(object_t *a, object_t *b);
 object_t *snek_add(object_t *a, object_t *b);
+object_t *snek_sub(object_t *a, object_t *b);
+object_t *snek_mul(object_t *a, object_t *b);
+bool snek_is_typed_array(object_t *obj);
+object_t *snek_typed_array_binary(snek_simd_op_t op, object_t *a, object_t *b);
+object_t *snek_scale(object_t *array, object_t *factor);
+object_t *snek_sum(object_t *array);
+object_t *snek_dot(object_t *a, object_t *b);
 object_t *new_snek_object();
+size_t snek_object_size(object_t *obj);
+void heap_stats_add(object_t *obj, size_t old_size);
+void heap_stats_remove(object_t *obj);
+const heap_stats_t *snek_heap_stats(void);
 
 void refcount_inc(object_t *obj);
 void refcount_dec(object_t *obj);
 void refcount_free(object_t *obj);
 
+// the benchmarks (bench-*.c) include this file for its functions and bring
+// their own main
+#ifndef SNEK_NO_MAIN
 int main() {
   // int
   object_t *int_object = new_snek_integer(42);
-  printf("%d\n", int_object->data.v_int);
+  printf("%d\n", snek_int_value(int_object));
 
   // float
   object_t *float_object = new_snek_float(3.14);
-  printf("%.2f\n", float_object->data.v_float);
+  printf("%.2f\n", snek_float_value(float_object));
 
   // string
   object_t *string_object = new_snek_string("hello world");
-  printf("%s\n", string_object->data.v_string);
+  printf("%s\n", snek_string_chars(string_object));
+  // "hello world" is short enough to be stored inside the object itself
+  assert(snek_string_is_inline(string_object));
 
   // vector (3 point object)
   object_t *x = new_snek_integer(1);
@@ -95,15 +233,15 @@ int main() {
   // vector_object contains 3 of object_t
   // than each object_t contains a data and a kind field
   // the data field is a union that can have different types
-  printf("x:%d y:%d z:%d\n", vector_object->data.v_vector3.x->data.v_int,
-         vector_object->data.v_vector3.y->data.v_int,
-         vector_object->data.v_vector3.z->data.v_int);
+  printf("x:%d y:%d z:%d\n", snek_int_value(snek_vector3_get(vector_object, 0)),
+         snek_int_value(snek_vector3_get(vector_object, 1)),
+         snek_int_value(snek_vector3_get(vector_object, 2)));
 
   object_t *a = new_snek_integer(1);
   object_t *second_vector = new_snek_vector3(a, a, a);
-  printf("x:%d y:%d z:%d\n", second_vector->data.v_vector3.x->data.v_int,
-         second_vector->data.v_vector3.y->data.v_int,
-         second_vector->data.v_vector3.z->data.v_int);
+  printf("x:%d y:%d z:%d\n", snek_int_value(snek_vector3_get(second_vector, 0)),
+         snek_int_value(snek_vector3_get(second_vector, 1)),
+         snek_int_value(snek_vector3_get(second_vector, 2)));
 
   // arrays
   int test_array_size = 5;
@@ -113,12 +251,13 @@ int main() {
   // set a new value inside the array at index 0
   bool success = snek_array_set(array_object, 0, new_int);
   if (!success) {
-    printf("failed to set %d in array at index %d\n", new_int->data.v_int, 0);
+    printf("failed to set %d in array at index %d\n", snek_int_value(new_int),
+           0);
   }
   // get the value inside the array at index 0
   object_t *value_at_index_0 = snek_array_get(array_object, 0);
   printf("element in array at index %d is %d\n", 0,
-         value_at_index_0->data.v_int);
+         snek_int_value(value_at_index_0));
   // get new integer object
   object_t *new_int_1 = new_snek_integer(15);
   // set the new integer inside the array at index 1
@@ -127,7 +266,7 @@ int main() {
   object_t *value_at_index_1 = snek_array_get(array_object, 1);
   // check what we got at th end
   printf("element in array at index %d is %d\n", 1,
-         value_at_index_1->data.v_int);
+         snek_int_value(value_at_index_1));
 
   // get the length of an oject
   int len_of_int = snek_len(int_object);
@@ -146,27 +285,30 @@ int main() {
   object_t *int_one = new_snek_integer(1);
   object_t *int_three = new_snek_integer(3);
   object_t *int_four = snek_add(int_one, int_three);
-  printf("result of snek_add(int_one, int_three): %d\n", int_four->data.v_int);
+  printf("result of snek_add(int_one, int_three): %d\n",
+         snek_int_value(int_four));
+  // the result of adding 2 numbers is an immediate, nothing was allocated
+  assert(snek_is_immediate(int_four) && snek_kind(int_four) == INTEGER);
 
   // add floats
   object_t *float_one = new_snek_float(1.5);
   object_t *float_three = new_snek_float(3.5);
   object_t *float_five = snek_add(float_one, float_three);
   printf("result of snek_add(float_one, float_three): %.2f\n",
-         float_five->data.v_float);
+         snek_float_value(float_five));
 
   // add strings
   object_t *string_one = new_snek_string("hello");
   object_t *string_two = new_snek_string(", world!");
   object_t *result_string = snek_add(string_one, string_two);
   printf("result of snek_add(string_one, string_two): %s\n",
-         result_string->data.v_string);
+         snek_string_chars(result_string));
   // what if we add the same string twice
   object_t *repeated_string = new_snek_string("hello ");
   object_t *result_after_repeated_string =
       snek_add(repeated_string, repeated_string);
   printf("result of snek_add(repeated_string, repeated_string): %s\n",
-         result_after_repeated_string->data.v_string);
+         snek_string_chars(result_after_repeated_string));
 
   // add vectors
   object_t *vector_int_one = new_snek_integer(1);
@@ -175,13 +317,14 @@ int main() {
   object_t *vector3_one =
       new_snek_vector3(vector_int_one, vector_int_three, vectory_int_five);
   object_t *result_vector_add = snek_add(vector3_one, vector3_one);
-  printf("vector3_one has: x: %d, y: %d, z: %d\n", vector_int_one->data.v_int,
-         vector_int_three->data.v_int, vectory_int_five->data.v_int);
+  printf("vector3_one has: x: %d, y: %d, z: %d\n",
+         snek_int_value(vector_int_one), snek_int_value(vector_int_three),
+         snek_int_value(vectory_int_five));
   printf("result of repeated snek_add(vector3_one, vector3_one - x: %d y: %d "
          "z: %d\n",
-         result_vector_add->data.v_vector3.x->data.v_int,
-         result_vector_add->data.v_vector3.y->data.v_int,
-         result_vector_add->data.v_vector3.z->data.v_int);
+         snek_int_value(snek_vector3_get(result_vector_add, 0)),
+         snek_int_value(snek_vector3_get(result_vector_add, 1)),
+         snek_int_value(snek_vector3_get(result_vector_add, 2)));
 
   // add arrays
   // array of 2 integers
@@ -205,8 +348,119 @@ int main() {
          "the array to see that "
          "it is larger than both the 2 and 3 sized ones that were merged "
          "together, also second element is an int, fourth is a string\n ",
-         result_array_add->data.v_array.elements[1]->data.v_int,
-         result_array_add->data.v_array.elements[3]->data.v_string);
+         snek_int_value(result_array_add->data.v_array.elements[1]),
+         snek_string_chars(result_array_add->data.v_array.elements[3]));
+
+  // growable arrays
+  // elements are appended in place, the array owns a reference to each one
+  object_t *list = new_snek_array(0);
+  object_t *item = new_snek_string("item");
+  for (int i = 0; i < 100; i++) {
+    assert(snek_array_push(list, item));
+  }
+  assert(item->refcount == 101);
+  assert(snek_array_extend(list, list));
+  assert(snek_len(list) == 200 && item->refcount == 201);
+  refcount_dec(list);
+  assert(item->refcount == 1);
+  refcount_dec(item);
+
+  // typed arrays
+  // numbers stored back to back without boxes, added element by element
+  int32_t some_ints[4] = {1, 2, 3, 4};
+  float some_floats[4] = {0.5f, 0.5f, 0.5f, 0.5f};
+  object_t *int_array = new_snek_int_array(some_ints, 4);
+  object_t *float_array = new_snek_float_array(some_floats, 4);
+  object_t *typed_sum = snek_add(int_array, float_array);
+  assert(snek_kind(typed_sum) == FLOAT_ARRAY && snek_len(typed_sum) == 4);
+  assert(snek_float_value(snek_array_get(typed_sum, 3)) == 4.5f);
+  refcount_dec(int_array);
+  refcount_dec(float_array);
+  refcount_dec(typed_sum);
+
+  // simd kernels
+  // sub/mul/scale build a new typed array, sum and dot return an immediate
+  int32_t nine_ones[9] = {1, 1, 1, 1, 1, 1, 1, 1, 1};
+  object_t *ones = new_snek_int_array(nine_ones, 9);
+  object_t *twos = snek_scale(ones, new_snek_integer(2));
+  object_t *minus_ones = snek_sub(ones, twos);
+  assert(snek_int_value(snek_sum(minus_ones)) == -9);
+  assert(snek_int_value(snek_dot(twos, twos)) == 36);
+  object_t *zeros = new_snek_float_array(NULL, 9);
+  object_t *products = snek_mul(ones, zeros);
+  assert(snek_kind(products) == FLOAT_ARRAY);
+  assert(snek_float_value(snek_sum(products)) == 0.0f);
+  assert(snek_sum(NULL) == NULL && snek_dot(NULL, NULL) == NULL);
+  assert(snek_sub(ones, NULL) == NULL && snek_scale(ones, NULL) == NULL);
+  refcount_dec(ones);
+  refcount_dec(twos);
+  refcount_dec(minus_ones);
+  refcount_dec(zeros);
+  refcount_dec(products);
+
+  // inline vectors
+  // the components live inside the vector, adding into an existing vector
+  // allocates nothing
+  object_t *zero = new_snek_integer(0);
+  object_t *position = new_snek_vector3(zero, zero, zero);
+  object_t *velocity = new_snek_vector3(
+      new_snek_float(0.5), new_snek_integer(1), new_snek_integer(-2));
+  for (int i = 0; i < 10; i++) {
+    assert(snek_vector3_add_into(position, position, velocity));
+  }
+  assert(snek_float_value(snek_vector3_get(position, 0)) == 5.0f);
+  assert(snek_float_value(snek_vector3_get(position, 2)) == -20.0f);
+  object_t *label = new_snek_string("not a number");
+  assert(new_snek_vector3(label, label, label) == NULL);
+  assert(new_snek_vector3(NULL, NULL, NULL) == NULL);
+  assert(label->refcount == 1);
+  refcount_dec(label);
+  refcount_dec(position);
+  refcount_dec(velocity);
+
+  // string interning
+  // equal strings share one object, each user still owns a reference to it
+  snek_set_string_interning(true);
+  object_t *tag_one = new_snek_string("tag");
+  object_t *tag_two = new_snek_string("tag");
+  object_t *ta = new_snek_string("ta");
+  object_t *g = new_snek_string("g");
+  object_t *tag_three = snek_add(ta, g);
+  assert(tag_one == tag_two && tag_two == tag_three);
+  assert(tag_one->refcount == 3);
+  assert(interned_strings.count == 3);
+  refcount_dec(tag_one);
+  refcount_dec(tag_two);
+  refcount_dec(tag_three);
+  refcount_dec(ta);
+  refcount_dec(g);
+  // the last references are gone so the table let go of the strings as well
+  assert(interned_strings.count == 0);
+  snek_set_string_interning(false);
+
+  // heap accounting
+  // every object is counted in bytes per kind together with its buffer, a
+  // long string is much bigger than a vector
+  const heap_stats_t *stats = snek_heap_stats();
+  size_t live_before = stats->live_bytes;
+  size_t strings_before = stats->bytes[STRING];
+  object_t *long_string = new_snek_string("a string that does not fit inline");
+  assert(stats->bytes[STRING] - strings_before == sizeof(object_t) + 34);
+  object_t *pushed = new_snek_array(0);
+  assert(snek_array_push(pushed, long_string)); // grows to 4 elements
+  object_t *hundred_ints = new_snek_int_array(NULL, 100);
+  object_t *unit = new_snek_vector3(zero, zero, new_snek_integer(1));
+  object_t *two_units = snek_add(unit, unit);
+  size_t accounted = 5 * sizeof(object_t) + 34 + 4 * sizeof(object_t *) + 400;
+  assert(stats->live_bytes - live_before == accounted);
+  assert(stats->peak_bytes >= stats->live_bytes);
+  refcount_dec(long_string);
+  refcount_dec(pushed); // the string goes with it
+  refcount_dec(hundred_ints);
+  refcount_dec(unit);
+  refcount_dec(two_units);
+  assert(stats->live_bytes == live_before);
+  assert(stats->bytes[STRING] == strings_before);
 
   // refcounting GC
   object_t *test_refcount_ojb = new_snek_object();
@@ -215,12 +469,14 @@ int main() {
   // NOTE: these intentionally still use free() instead of the refcounting
   // garbage collection as they were added while learning the behaviour of
   // malloc and free, leaving them just as a visual
-  free(int_object);
-  free(float_object);
+  // int_object and float_object are immediate values, there is nothing on the
+  // heap to free for them
 
   // strings
-  if (string_object->data.v_string != NULL) {
-    free(string_object->data.v_string);
+  // short strings keep their characters inside the object, there is only a
+  // second allocation to free for long ones
+  if (!snek_string_is_inline(string_object)) {
+    free(string_object->data.v_string.heap_chars);
   }
   free(string_object);
 
@@ -257,42 +513,270 @@ int main() {
 
   return 0;
 }
+#endif // SNEK_NO_MAIN
 
 object_t *new_snek_integer(int value) {
-  // allocate memory on the heap for the object
-  object_t *obj = malloc(sizeof(object_t));
-  if (obj == NULL) {
-    return NULL;
+  // integers are immediate values, nothing is allocated on the heap, the value
+  // and the INTEGER tag are packed into the pointer itself
+  uintptr_t bits = (uintptr_t)(uint32_t)value;
+  return (object_t *)((bits << 32) | SNEK_TAG_INTEGER);
+}
+
+object_t *new_snek_float(float value) {
+  // floats are immediate values too, we copy the bits of the float into an
+  // integer (memcpy is the well defined way to do that in C) and tag them
+  uint32_t float_bits;
+  memcpy(&float_bits, &value, sizeof(float_bits));
+  uintptr_t bits = (uintptr_t)float_bits;
+  return (object_t *)((bits << 32) | SNEK_TAG_FLOAT);
+}
+
+bool snek_is_immediate(object_t *obj) {
+  // real objects are aligned so their low bits are never set
+  return ((uintptr_t)obj & SNEK_TAG_MASK) != 0;
+}
+
+// the kind of any value, immediate or not, always use this instead of reading
+// obj->kind directly because immediates can't be dereferenced
+object_kind_t snek_kind(object_t *obj) {
+  switch ((uintptr_t)obj & SNEK_TAG_MASK) {
+  case SNEK_TAG_INTEGER:
+    return INTEGER;
+  case SNEK_TAG_FLOAT:
+    return FLOAT;
+  default:
+    return obj->kind;
   }
+}
 
-  obj->kind = INTEGER;
-  obj->data.v_int = value;
+int snek_int_value(object_t *obj) {
+  if (snek_is_immediate(obj)) {
+    return (int)(uint32_t)((uintptr_t)obj >> 32);
+  }
+  // a boxed integer, e.g. a zeroed object from new_snek_object()
+  return obj->data.v_int;
+}
 
-  // refcount GC
-  obj->refcount = 1;
+float snek_float_value(object_t *obj) {
+  if (snek_is_immediate(obj)) {
+    uint32_t float_bits = (uint32_t)((uintptr_t)obj >> 32);
+    float value;
+    memcpy(&value, &float_bits, sizeof(value));
+    return value;
+  }
+  return obj->data.v_float;
+}
 
-  return obj;
+// the characters of a STRING no matter which of the 2 layouts it uses
+char *snek_string_chars(object_t *obj) {
+  if (snek_string_is_inline(obj)) {
+    return obj->data.v_string.inline_chars;
+  }
+  return obj->data.v_string.heap_chars;
 }
 
-object_t *new_snek_float(float value) {
-  // allocate memory on the heap for the object
-  object_t *obj = malloc(sizeof(object_t));
-  if (obj == NULL) {
+bool snek_string_is_inline(object_t *obj) {
+  return obj->data.v_string.length <= SNEK_SMALL_STRING_MAX;
+}
+
+// FNV-1a, simple and good enough for short keys. It works on one byte at a
+// time so hashing 'a' and continuing with 'b' gives the same hash as hashing
+// the concatenation of both, snek_add relies on that
+#define INTERN_HASH_SEED 14695981039346656037ULL
+#define INTERN_HASH_PRIME 1099511628211ULL
+
+uint64_t intern_hash(uint64_t hash, const char *chars, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char)chars[i];
+    hash *= INTERN_HASH_PRIME;
+  }
+  return hash;
+}
+
+// look for an interned string whose characters are 'a' followed by 'b' ('b'
+// can be empty), this way snek_add can check for its result without building
+// it first
+object_t *intern_table_find(intern_table_t *table, uint64_t hash,
+                            const char *a, size_t a_length, const char *b,
+                            size_t b_length) {
+  if (table->count == 0) {
     return NULL;
   }
 
-  obj->kind = FLOAT;
-  obj->data.v_float = value;
+  size_t mask = table->capacity - 1;
+  // linear probing, walk from the home slot until we hit an empty one
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    intern_entry_t *entry = &table->entries[i];
+    if (entry->string == NULL) {
+      return NULL;
+    }
+
+    object_t *string = entry->string;
+    if (entry->hash == hash &&
+        string->data.v_string.length == a_length + b_length) {
+      char *chars = snek_string_chars(string);
+      if (memcmp(chars, a, a_length) == 0 &&
+          memcmp(chars + a_length, b, b_length) == 0) {
+        return string;
+      }
+    }
+  }
+}
+
+bool intern_table_grow(intern_table_t *table) {
+  size_t new_capacity = table->capacity == 0 ? 64 : table->capacity * 2;
+  intern_entry_t *new_entries = calloc(new_capacity, sizeof(intern_entry_t));
+  if (new_entries == NULL) {
+    return false;
+  }
 
-  // refcount GC
-  obj->refcount = 1;
+  // put every string back at its place in the bigger table, the hashes are
+  // kept in the entries so we don't have to touch the characters
+  size_t mask = new_capacity - 1;
+  for (size_t i = 0; i < table->capacity; i++) {
+    intern_entry_t entry = table->entries[i];
+    if (entry.string == NULL) {
+      continue;
+    }
+    size_t slot = entry.hash & mask;
+    while (new_entries[slot].string != NULL) {
+      slot = (slot + 1) & mask;
+    }
+    new_entries[slot] = entry;
+  }
 
-  return obj;
+  free(table->entries);
+  table->entries = new_entries;
+  table->capacity = new_capacity;
+  return true;
+}
+
+// add a string that is not in the table yet
+bool intern_table_insert(intern_table_t *table, uint64_t hash,
+                         object_t *string) {
+  // keep the table at most 3/4 full so the probe sequences stay short
+  if ((table->count + 1) * 4 > table->capacity * 3) {
+    if (!intern_table_grow(table)) {
+      return false;
+    }
+  }
+
+  size_t mask = table->capacity - 1;
+  size_t slot = hash & mask;
+  while (table->entries[slot].string != NULL) {
+    slot = (slot + 1) & mask;
+  }
+  table->entries[slot] = (intern_entry_t){.hash = hash, .string = string};
+  table->count++;
+  string->is_interned = true;
+
+  return true;
+}
+
+// remove a string that is about to be freed
+void intern_table_remove(intern_table_t *table, object_t *string) {
+  if (table->count == 0) {
+    return;
+  }
+
+  uint64_t hash = intern_hash(INTERN_HASH_SEED, snek_string_chars(string),
+                              string->data.v_string.length);
+  size_t mask = table->capacity - 1;
+  size_t slot = hash & mask;
+  while (table->entries[slot].string != string) {
+    if (table->entries[slot].string == NULL) {
+      return; // not in the table
+    }
+    slot = (slot + 1) & mask;
+  }
+
+  // backward shift deletion: move the entries after the hole back into it
+  // when that gets them closer to their home slot, so lookups never have to
+  // skip over deleted entries
+  size_t hole = slot;
+  for (size_t next = (hole + 1) & mask; table->entries[next].string != NULL;
+       next = (next + 1) & mask) {
+    size_t home = table->entries[next].hash & mask;
+    // distance from home to next vs from home to the hole (wrapping around)
+    if (((next - home) & mask) >= ((next - hole) & mask)) {
+      table->entries[hole] = table->entries[next];
+      hole = next;
+    }
+  }
+  table->entries[hole] = (intern_entry_t){.hash = 0, .string = NULL};
+  table->count--;
+  string->is_interned = false;
+}
+
+void intern_table_free(intern_table_t *table) {
+  free(table->entries);
+  *table = (intern_table_t){.count = 0, .capacity = 0, .entries = NULL};
+}
+
+// compare 2 strings, interned strings are the only copy of their characters so
+// for them comparing the pointers is enough
+bool snek_string_equals(object_t *a, object_t *b) {
+  if (a == b) {
+    return true;
+  }
+  if (a == NULL || b == NULL || snek_kind(a) != STRING ||
+      snek_kind(b) != STRING) {
+    return false;
+  }
+  if (a->is_interned && b->is_interned) {
+    return false;
+  }
+
+  size_t length = a->data.v_string.length;
+  return length == b->data.v_string.length &&
+         memcmp(snek_string_chars(a), snek_string_chars(b), length) == 0;
+}
+
+void snek_set_string_interning(bool enabled) {
+  // strings that were interned before stay in the table until they are freed,
+  // turning it off only means new strings don't look there anymore
+  intern_strings = enabled;
 }
 
 // we make this a const char * to make it clear we do not intend to modify the
 // input
 object_t *new_snek_string(const char *value) {
+  // strlen() once here, after this the length travels with the string
+  size_t length = strlen(value);
+
+  // with interning turned on hand out the canonical copy if there is one
+  uint64_t hash = 0;
+  if (intern_strings) {
+    hash = intern_hash(INTERN_HASH_SEED, value, length);
+    object_t *interned =
+        intern_table_find(&interned_strings, hash, value, length, "", 0);
+    if (interned != NULL) {
+      refcount_inc(interned); // the caller gets its own reference
+      return interned;
+    }
+  }
+
+  object_t *obj = _new_snek_string_buffer(length);
+  if (obj == NULL) {
+    return NULL;
+  }
+
+  // copy value into the string (+1 to also copy the '\0')
+  memcpy(snek_string_chars(obj), value, length + 1);
+
+  // this is the first copy of these characters, it becomes the canonical one
+  // (if the table can't grow the string simply stays a regular string)
+  if (intern_strings) {
+    intern_table_insert(&interned_strings, hash, obj);
+  }
+
+  return obj;
+}
+
+// create a STRING with room for 'length' bytes (and the '\0') but without
+// any characters yet, the caller fills them in, this lets snek_add build a
+// string in place instead of going through a temporary buffer
+object_t *_new_snek_string_buffer(size_t length) {
   // allocate memory on the heap for the object
   object_t *obj = malloc(sizeof(object_t));
   if (obj == NULL) {
@@ -302,29 +786,43 @@ object_t *new_snek_string(const char *value) {
   obj->kind =
       STRING; // set type before allocating string data so we can
               // correctly clean this object even if the next malloc fails.
-
-  // allocate a second set of memory on the heap that will actually store the
-  // value of the string (char * / array of char)
-  obj->data.v_string = malloc(strlen(value) + 1);
-  if (obj->data.v_string == NULL) {
-    // we free the object here to make sure we don't leak memory if the
-    // secondary heap allocation for the actual string contents fails
-    free(obj);
-    return NULL;
+  obj->data.v_string.length = length;
+  obj->is_interned = false; // malloc doesn't zero it, see intern_table_insert
+
+  // short strings fit inside the object, only long ones need a second set of
+  // memory on the heap that will actually store the value of the string
+  if (!snek_string_is_inline(obj)) {
+    obj->data.v_string.heap_chars = malloc(length + 1);
+    if (obj->data.v_string.heap_chars == NULL) {
+      // we free the object here to make sure we don't leak memory if the
+      // secondary heap allocation for the actual string contents fails
+      free(obj);
+      return NULL;
+    }
   }
-  // copy value into newly allocated char * object (also copies the '\0')
-  strcpy(obj->data.v_string, value);
 
   // refcount GC
   obj->refcount = 1;
+  heap_stats_add(obj, 0);
 
   return obj;
 }
 
 // a collection type object (similar to python's tuple that contains 3 elements)
+// the components have to be numbers, they are copied into the vector so no
+// reference to them is kept
 object_t *new_snek_vector3(object_t *x, object_t *y, object_t *z) {
-  if (x == NULL || y == NULL || z == NULL) {
-    return NULL;
+  object_t *components[3] = {x, y, z};
+  bool is_float = false;
+  for (size_t i = 0; i < 3; i++) {
+    if (components[i] == NULL) {
+      return NULL;
+    }
+    object_kind_t kind = snek_kind(components[i]);
+    if (kind != INTEGER && kind != FLOAT) {
+      return NULL;
+    }
+    is_float = is_float || kind == FLOAT;
   }
 
   // allocate space on heap of the object
@@ -335,26 +833,65 @@ object_t *new_snek_vector3(object_t *x, object_t *y, object_t *z) {
 
   obj->kind = VECTOR3;
 
-  // increment refcount of each of the 3 objects for garbage collection
-  refcount_inc(x);
-  refcount_inc(y);
-  refcount_inc(z);
-
-  // assign each object inside the fields of the vector struct
-  obj->data.v_vector3.x = x;
-  obj->data.v_vector3.y = y;
-  obj->data.v_vector3.z = z;
-
-  // can also be represented with a compound literal instead of assigning each
-  // value individually
-  // obj->data.v_vector3 = (vector_t){.x = x, .y = y, .z = z};
+  // copy each number into the vector, ints are converted when one of the
+  // other components is a float
+  obj->data.v_vector3.is_float = is_float;
+  for (size_t i = 0; i < 3; i++) {
+    if (!is_float) {
+      obj->data.v_vector3.ints[i] = snek_int_value(components[i]);
+    } else if (snek_kind(components[i]) == FLOAT) {
+      obj->data.v_vector3.floats[i] = snek_float_value(components[i]);
+    } else {
+      obj->data.v_vector3.floats[i] = (float)snek_int_value(components[i]);
+    }
+  }
 
   // refcount for GC
   obj->refcount = 1;
+  heap_stats_add(obj, 0);
 
   return obj;
 }
 
+// component 'axis' (0 = x, 1 = y, 2 = z) of a vector, handed out as an
+// immediate so there is no reference to release
+object_t *snek_vector3_get(object_t *obj, size_t axis) {
+  if (obj == NULL || snek_kind(obj) != VECTOR3 || axis >= 3) {
+    return NULL;
+  }
+
+  if (obj->data.v_vector3.is_float) {
+    return new_snek_float(obj->data.v_vector3.floats[axis]);
+  }
+  return new_snek_integer(obj->data.v_vector3.ints[axis]);
+}
+
+// out = a + b for 3 vectors that already exist, nothing is allocated and no
+// refcount changes. out can be a or b itself
+bool snek_vector3_add_into(object_t *out, object_t *a, object_t *b) {
+  if (out == NULL || a == NULL || b == NULL || snek_kind(out) != VECTOR3 ||
+      snek_kind(a) != VECTOR3 || snek_kind(b) != VECTOR3) {
+    return false;
+  }
+
+  vector_t *x = &a->data.v_vector3;
+  vector_t *y = &b->data.v_vector3;
+  // the sum is built on the side in case out is one of the inputs
+  vector_t sum = {.is_float = x->is_float || y->is_float};
+  for (size_t i = 0; i < 3; i++) {
+    if (!sum.is_float) {
+      sum.ints[i] = x->ints[i] + y->ints[i];
+      continue;
+    }
+    float x_i = x->is_float ? x->floats[i] : (float)x->ints[i];
+    float y_i = y->is_float ? y->floats[i] : (float)y->ints[i];
+    sum.floats[i] = x_i + y_i;
+  }
+
+  out->data.v_vector3 = sum;
+  return true;
+}
+
 object_t *new_snek_array(size_t size) {
   // allocate space on heap for the object
   object_t *obj = malloc(sizeof(object_t));
@@ -372,15 +909,64 @@ object_t *new_snek_array(size_t size) {
   }
 
   obj->kind = ARRAY;
-  obj->data.v_array = (array_t){.size = size, .elements = array_of_pointers};
+  obj->data.v_array = (array_t){
+      .size = size, .capacity = size, .elements = array_of_pointers};
   // instead of using a compounding literal we can also break it down into
   // separate rows :
   //
   // obj->data.v_array.size = size;
+  // obj->data.v_array.capacity = size;
   // obj->data.v_array.elements = array_of_pointers;
 
   // refcount for GC
   obj->refcount = 1;
+  heap_stats_add(obj, 0);
+
+  return obj;
+}
+
+// an array of 'size' ints copied in one go from 'values', or all zeroes if
+// 'values' is NULL
+object_t *new_snek_int_array(const int32_t *values, size_t size) {
+  object_t *obj = _new_snek_typed_array(INT_ARRAY, size);
+  if (obj != NULL && values != NULL) {
+    memcpy(obj->data.v_typed_array.ints, values, size * sizeof(int32_t));
+  }
+  return obj;
+}
+
+// same as new_snek_int_array() but for floats
+object_t *new_snek_float_array(const float *values, size_t size) {
+  object_t *obj = _new_snek_typed_array(FLOAT_ARRAY, size);
+  if (obj != NULL && values != NULL) {
+    memcpy(obj->data.v_typed_array.floats, values, size * sizeof(float));
+  }
+  return obj;
+}
+
+// create a zeroed INT_ARRAY or FLOAT_ARRAY of 'size' numbers
+object_t *_new_snek_typed_array(object_kind_t kind, size_t size) {
+  // allocate space on heap for the object
+  object_t *obj = malloc(sizeof(object_t));
+  if (obj == NULL) {
+    return NULL;
+  }
+
+  // int32_t and float are both 4 bytes so one buffer size works for both,
+  // calloc gives us zeroes (which is also 0.0f for floats)
+  void *numbers = calloc(size, sizeof(int32_t));
+  if (numbers == NULL) {
+    free(obj);
+    return NULL;
+  }
+
+  obj->kind = kind;
+  obj->data.v_typed_array.size = size;
+  obj->data.v_typed_array.ints = numbers; // same pointer for floats
+
+  // refcount for GC
+  obj->refcount = 1;
+  heap_stats_add(obj, 0);
 
   return obj;
 }
@@ -391,7 +977,29 @@ bool snek_array_set(object_t *obj, size_t index, object_t *value) {
     return false;
   }
 
-  if (obj->kind != ARRAY) {
+  object_kind_t kind = snek_kind(obj);
+  if (kind == INT_ARRAY || kind == FLOAT_ARRAY) {
+    // typed arrays store the number itself, not the (immediate) object
+    if (index >= obj->data.v_typed_array.size) {
+      return false;
+    }
+    object_kind_t value_kind = snek_kind(value);
+    if (kind == INT_ARRAY && value_kind == INTEGER) {
+      obj->data.v_typed_array.ints[index] = snek_int_value(value);
+      return true;
+    }
+    if (kind == FLOAT_ARRAY && value_kind == FLOAT) {
+      obj->data.v_typed_array.floats[index] = snek_float_value(value);
+      return true;
+    }
+    if (kind == FLOAT_ARRAY && value_kind == INTEGER) {
+      obj->data.v_typed_array.floats[index] = (float)snek_int_value(value);
+      return true;
+    }
+    return false; // a float doesn't fit in an INT_ARRAY, nor does a string
+  }
+
+  if (kind != ARRAY) {
     return false;
   }
 
@@ -422,7 +1030,19 @@ object_t *snek_array_get(object_t *obj, size_t index) {
     return NULL;
   }
 
-  if (obj->kind != ARRAY) {
+  object_kind_t kind = snek_kind(obj);
+  if (kind == INT_ARRAY || kind == FLOAT_ARRAY) {
+    if (index >= obj->data.v_typed_array.size) {
+      return NULL;
+    }
+    // the number is handed out as an immediate so nothing is allocated
+    if (kind == INT_ARRAY) {
+      return new_snek_integer(obj->data.v_typed_array.ints[index]);
+    }
+    return new_snek_float(obj->data.v_typed_array.floats[index]);
+  }
+
+  if (kind != ARRAY) {
     return NULL;
   }
 
@@ -436,22 +1056,105 @@ object_t *snek_array_get(object_t *obj, size_t index) {
   return obj->data.v_array.elements[index];
 }
 
+// make room for at least 'capacity' elements without changing the size
+bool snek_array_reserve(object_t *obj, size_t capacity) {
+  if (obj == NULL || snek_kind(obj) != ARRAY) {
+    return false;
+  }
+
+  if (capacity <= obj->data.v_array.capacity) {
+    return true; // already big enough
+  }
+
+  object_t **elements =
+      realloc(obj->data.v_array.elements, capacity * sizeof(object_t *));
+  if (elements == NULL) {
+    return false; // the old elements are still there and untouched
+  }
+
+  size_t old_size = snek_object_size(obj);
+  obj->data.v_array.elements = elements;
+  obj->data.v_array.capacity = capacity;
+  heap_stats_add(obj, old_size);
+  return true;
+}
+
+// grow the capacity geometrically so that adding N elements one at a time
+// only reallocates log(N) times, i.e. amortized O(1) per element
+bool snek_array_grow_for(object_t *obj, size_t extra) {
+  size_t needed = obj->data.v_array.size + extra;
+  if (needed <= obj->data.v_array.capacity) {
+    return true;
+  }
+
+  size_t new_capacity =
+      obj->data.v_array.capacity < 4 ? 4 : obj->data.v_array.capacity * 2;
+  if (new_capacity < needed) {
+    new_capacity = needed;
+  }
+  return snek_array_reserve(obj, new_capacity);
+}
+
+// append one element at the end of the array, in place
+bool snek_array_push(object_t *obj, object_t *value) {
+  if (obj == NULL || value == NULL || snek_kind(obj) != ARRAY) {
+    return false;
+  }
+
+  if (!snek_array_grow_for(obj, 1)) {
+    return false;
+  }
+
+  // the array holds a reference to the new element
+  refcount_inc(value);
+
+  obj->data.v_array.elements[obj->data.v_array.size] = value;
+  obj->data.v_array.size++;
+  return true;
+}
+
+// append all elements of 'other' at the end of the array, in place
+bool snek_array_extend(object_t *obj, object_t *other) {
+  if (obj == NULL || other == NULL || snek_kind(obj) != ARRAY ||
+      snek_kind(other) != ARRAY) {
+    return false;
+  }
+
+  // read the size of 'other' before growing, it may be the same array
+  size_t other_size = other->data.v_array.size;
+  if (!snek_array_grow_for(obj, other_size)) {
+    return false;
+  }
+
+  object_t **destination = obj->data.v_array.elements + obj->data.v_array.size;
+  memcpy(destination, other->data.v_array.elements,
+         other_size * sizeof(object_t *));
+  for (size_t i = 0; i < other_size; i++) {
+    refcount_inc(destination[i]); // the array holds one more reference to each
+  }
+  obj->data.v_array.size += other_size;
+  return true;
+}
+
 int snek_len(object_t *obj) {
   if (obj == NULL) {
     return -1;
   }
 
-  switch (obj->kind) {
+  switch (snek_kind(obj)) {
   case INTEGER:
     return 1;
   case FLOAT:
     return 1;
   case STRING:
-    return strlen(obj->data.v_string);
+    return obj->data.v_string.length;
   case VECTOR3:
     return 3;
   case ARRAY:
     return obj->data.v_array.size;
+  case INT_ARRAY:
+  case FLOAT_ARRAY:
+    return obj->data.v_typed_array.size;
   default:
     fprintf(stderr, "invalid object type");
     return -1;
@@ -465,18 +1168,22 @@ object_t *snek_add(object_t *a, object_t *b) {
     return NULL;
   }
 
-  switch (a->kind) {
+  // kinds are looked up once, a and b may be immediates
+  object_kind_t a_kind = snek_kind(a);
+  object_kind_t b_kind = snek_kind(b);
+
+  switch (a_kind) {
   case INTEGER:
-    if (b->kind == INTEGER) {
-      return new_snek_integer(a->data.v_int + b->data.v_int);
+    if (b_kind == INTEGER) {
+      return new_snek_integer(snek_int_value(a) + snek_int_value(b));
     }
 
     // int + float = float
-    if (b->kind == FLOAT) {
+    if (b_kind == FLOAT) {
       // typecasting 'а' to a float here is optional since it will get promoted
       // to a float automatically, but I add it for visual clarity of what
       // happens
-      return new_snek_float((float)a->data.v_int + b->data.v_float);
+      return new_snek_float((float)snek_int_value(a) + snek_float_value(b));
     }
 
     return NULL; // if netither int nor float return because invalid operation
@@ -484,132 +1191,275 @@ object_t *snek_add(object_t *a, object_t *b) {
 
   case FLOAT:
     // float + int = float
-    if (b->kind == INTEGER) {
+    if (b_kind == INTEGER) {
       // typecasting 'b' to a float here is optional since it will get promoted
       // to a float automatically, but I add it for visual clarity of what
       // happens
-      return new_snek_float(a->data.v_float + (float)b->data.v_int);
+      return new_snek_float(snek_float_value(a) + (float)snek_int_value(b));
     }
 
-    if (b->kind == FLOAT) {
-      return new_snek_float(a->data.v_float + b->data.v_float);
+    if (b_kind == FLOAT) {
+      return new_snek_float(snek_float_value(a) + snek_float_value(b));
     }
 
     return NULL; // if netither int nor float return because invalid operation
                  // we can add only integers and floats together
 
   case STRING:
-    if (b->kind != STRING) {
+    if (b_kind != STRING) {
       return NULL; // only a string can be added to another string
     }
 
-    // Calculate the length of the new string by combining the length of the two
-    // strings (properly handling the null terminator)
+    // the lengths of both strings are cached so there is nothing to count,
+    // we create the result with exactly enough room and copy each input into
+    // it once, no temporary buffer and no second copy
     //
     // type should be size_t not int because we can hit issues with very large
-    // strings and size_t is what strlen() returns as a valid size
-    size_t len_of_combined_str =
-        strlen(a->data.v_string) + strlen(b->data.v_string) + 1; // +1 for '\0'
-
-    // Allocate memory for a new temporary string using calloc (to make sure it
-    // is also initialized)
-    char *temp_string = calloc(len_of_combined_str, sizeof(char));
-    if (temp_string == NULL) {
-      fprintf(stderr, "failed to allocate space for temp string");
-      return NULL;
+    // strings and size_t is the type of a valid size
+    size_t len_of_a = a->data.v_string.length;
+    size_t len_of_b = b->data.v_string.length;
+
+    // when interning, check if the result already exists before building it,
+    // the hash of the 2 parts is the same as the hash of the combined string
+    uint64_t hash = 0;
+    if (intern_strings) {
+      hash = intern_hash(INTERN_HASH_SEED, snek_string_chars(a), len_of_a);
+      hash = intern_hash(hash, snek_string_chars(b), len_of_b);
+      object_t *interned =
+          intern_table_find(&interned_strings, hash, snek_string_chars(a),
+                            len_of_a, snek_string_chars(b), len_of_b);
+      if (interned != NULL) {
+        refcount_inc(interned);
+        return interned;
+      }
     }
 
-    // combine data from both arrays to a new one
-    //  we use strcpy the first time to just copy the first full aray into the
-    //  new one
-    //  than we use strcat to only append the contents of 'b' on top of
-    //  what was already added from 'a'
-    strcpy(temp_string, a->data.v_string);
-    strcat(temp_string, b->data.v_string);
+    object_t *combined_string = _new_snek_string_buffer(len_of_a + len_of_b);
+    if (combined_string == NULL) {
+      fprintf(stderr, "failed to allocate space for combined string");
+      return NULL;
+    }
 
-    // Create a new_snek_string and pass in the temporary string.
-    object_t *combined_string = new_snek_string(temp_string);
+    char *combined_chars = snek_string_chars(combined_string);
+    memcpy(combined_chars, snek_string_chars(a), len_of_a);
+    // and the contents of 'b' right after what was already added from 'a'
+    memcpy(combined_chars + len_of_a, snek_string_chars(b), len_of_b);
+    combined_chars[len_of_a + len_of_b] = '\0';
 
-    // Free the memory for the temporary string and return the new string
-    // object.
-    free(temp_string);
+    if (intern_strings) {
+      intern_table_insert(&interned_strings, hash, combined_string);
+    }
 
     return combined_string;
 
   case VECTOR3:
-    if (b->kind != VECTOR3) {
+    if (b_kind != VECTOR3) {
       return NULL;
     }
 
-    // Recursively call snek_add for each of the x, y, and z fields. For
-    // example, a vector [1,2,3]+[4,5,6] should result in a new vector [5,7,9].
-    object_t *result_of_x = snek_add(a->data.v_vector3.x, b->data.v_vector3.x);
-    if (!result_of_x) {
-      return NULL; // handle the case where recursive add may fail
-    }
-    object_t *result_of_y = snek_add(a->data.v_vector3.y, b->data.v_vector3.y);
-    if (!result_of_y) {
-      free(result_of_x); // if the second add fails for any reason we need to
-                         // free the memory that was allocated by the first add
-                         // otherwise we will leak it
-
-      return NULL; // handle the case where recursive add may fail
-    }
-    object_t *result_of_z = snek_add(a->data.v_vector3.z, b->data.v_vector3.z);
-    if (!result_of_z) {
-      // and in this case we have aleady allocated 2 obejcts, so we need to free
-      // both if the third allocation fails, so that we do not leak memory
-      free(result_of_x);
-      free(result_of_y);
-
-      return NULL; // handle the case where recursive add may fail
+    // the components are added directly into the new vector, e.g.
+    // [1,2,3]+[4,5,6] results in a new vector [5,7,9], the only allocation is
+    // the result itself so a failure leaves nothing behind to free
+    object_t *new_vector = malloc(sizeof(object_t));
+    if (new_vector == NULL) {
+      return NULL;
     }
-    object_t *new_vector =
-        new_snek_vector3(result_of_x, result_of_y, result_of_z);
+    new_vector->kind = VECTOR3;
+    new_vector->refcount = 1;
+    snek_vector3_add_into(new_vector, a, b);
+    heap_stats_add(new_vector, 0);
     return new_vector;
 
   case ARRAY:
-    if (b->kind != ARRAY) {
+    if (b_kind != ARRAY) {
       return NULL;
     }
 
-    // Create a new_snek_array with the combined length of the two arrays.
+    // Create a new_snek_array with the combined length of the two arrays, it
+    // is created at its final size so it never has to grow.
     size_t len_of_combined_array = a->data.v_array.size + b->data.v_array.size;
     object_t *new_combined_array = new_snek_array(len_of_combined_array);
-
-    // populate elements from array 'a' into the new array
-    for (size_t i = 0; i < a->data.v_array.size; i++) {
-      object_t *current_value_at_index_i = snek_array_get(a, i);
-      bool succes =
-          snek_array_set(new_combined_array, i, current_value_at_index_i);
-      if (!succes) {
-        fprintf(stderr, "failed to set value in array 'a' at index %zu", i);
-      }
+    if (new_combined_array == NULL) {
+      return NULL;
     }
-    // offset is used to see how many elements have been addded so far from
-    // array 'a' and continue at the next free index, if we don't do this we
-    // sould start from i = 0 which will start overwriting the elements that
-    // have already been populated by 'a'
-
-    // populate elements from array 'b' into the new array
-    size_t offset = a->data.v_array.size;
-    for (size_t i = 0; i < b->data.v_array.size; i++) {
-      object_t *current_value_at_index_i = snek_array_get(b, i);
-      bool succes = snek_array_set(new_combined_array, offset + i,
-                                   current_value_at_index_i);
-      if (!succes) {
-        fprintf(stderr, "failed to set value in array 'b' at index %zu", i);
-      }
+
+    // copy the elements of 'a' and than the ones of 'b' right after them,
+    // one block copy per array instead of a get/set per element
+    object_t **combined_elements = new_combined_array->data.v_array.elements;
+    memcpy(combined_elements, a->data.v_array.elements,
+           a->data.v_array.size * sizeof(object_t *));
+    memcpy(combined_elements + a->data.v_array.size, b->data.v_array.elements,
+           b->data.v_array.size * sizeof(object_t *));
+    // the new array holds one more reference to each of the elements
+    for (size_t i = 0; i < len_of_combined_array; i++) {
+      refcount_inc(combined_elements[i]);
     }
 
     return new_combined_array;
 
+  case INT_ARRAY:
+  case FLOAT_ARRAY:
+    // adding 2 typed arrays adds them element by element (like numpy does)
+    return snek_typed_array_binary(SNEK_SIMD_ADD, a, b);
+
   default:
     fprintf(stderr, "invalid operation");
     return NULL;
   }
 }
 
+// element wise a - b of 2 typed arrays of the same size, see
+// snek_typed_array_binary
+object_t *snek_sub(object_t *a, object_t *b) {
+  return snek_typed_array_binary(SNEK_SIMD_SUB, a, b);
+}
+
+// element wise a * b of 2 typed arrays of the same size, see
+// snek_typed_array_binary
+object_t *snek_mul(object_t *a, object_t *b) {
+  return snek_typed_array_binary(SNEK_SIMD_MUL, a, b);
+}
+
+bool snek_is_typed_array(object_t *obj) {
+  if (obj == NULL) {
+    return false;
+  }
+
+  object_kind_t kind = snek_kind(obj);
+  return kind == INT_ARRAY || kind == FLOAT_ARRAY;
+}
+
+// element wise a op b of 2 typed arrays of the same size, int op int stays an
+// INT_ARRAY, as soon as one of them holds floats the result is a FLOAT_ARRAY.
+// The loops themselves are the kernels of snek-simd.h, the int side of a mixed
+// operation is first converted into the result buffer and then combined with
+// the float side in place
+object_t *snek_typed_array_binary(snek_simd_op_t op, object_t *a,
+                                  object_t *b) {
+  if (!snek_is_typed_array(a) || !snek_is_typed_array(b) ||
+      a->data.v_typed_array.size != b->data.v_typed_array.size) {
+    return NULL;
+  }
+
+  object_kind_t a_kind = snek_kind(a);
+  object_kind_t b_kind = snek_kind(b);
+  size_t size = a->data.v_typed_array.size;
+  object_kind_t result_kind =
+      (a_kind == INT_ARRAY && b_kind == INT_ARRAY) ? INT_ARRAY : FLOAT_ARRAY;
+  object_t *result = _new_snek_typed_array(result_kind, size);
+  if (result == NULL) {
+    return NULL;
+  }
+
+  const snek_kernels_t *kernels = snek_kernels();
+  typed_array_t *x = &a->data.v_typed_array;
+  typed_array_t *y = &b->data.v_typed_array;
+  typed_array_t *out = &result->data.v_typed_array;
+  if (result_kind == INT_ARRAY) {
+    kernels->i32_binary(op, x->ints, y->ints, out->ints, size);
+  } else if (a_kind == FLOAT_ARRAY && b_kind == FLOAT_ARRAY) {
+    kernels->f32_binary(op, x->floats, y->floats, out->floats, size);
+  } else if (a_kind == INT_ARRAY) {
+    kernels->i32_to_f32(x->ints, out->floats, size);
+    kernels->f32_binary(op, out->floats, y->floats, out->floats, size);
+  } else {
+    kernels->i32_to_f32(y->ints, out->floats, size);
+    kernels->f32_binary(op, x->floats, out->floats, out->floats, size);
+  }
+
+  return result;
+}
+
+// every element of a typed array times a number, an INT_ARRAY scaled by an
+// INTEGER stays an INT_ARRAY, anything else gives a FLOAT_ARRAY
+object_t *snek_scale(object_t *array, object_t *factor) {
+  if (factor == NULL) {
+    return NULL;
+  }
+
+  object_kind_t factor_kind = snek_kind(factor);
+  if (!snek_is_typed_array(array) ||
+      (factor_kind != INTEGER && factor_kind != FLOAT)) {
+    return NULL;
+  }
+
+  size_t size = array->data.v_typed_array.size;
+  bool ints_only = snek_kind(array) == INT_ARRAY && factor_kind == INTEGER;
+  object_t *result =
+      _new_snek_typed_array(ints_only ? INT_ARRAY : FLOAT_ARRAY, size);
+  if (result == NULL) {
+    return NULL;
+  }
+
+  const snek_kernels_t *kernels = snek_kernels();
+  typed_array_t *x = &array->data.v_typed_array;
+  typed_array_t *out = &result->data.v_typed_array;
+  if (ints_only) {
+    kernels->i32_scale(x->ints, snek_int_value(factor), out->ints, size);
+    return result;
+  }
+
+  float f = factor_kind == INTEGER ? (float)snek_int_value(factor)
+                                   : snek_float_value(factor);
+  if (snek_kind(array) == INT_ARRAY) {
+    kernels->i32_to_f32(x->ints, out->floats, size);
+    kernels->f32_scale(out->floats, f, out->floats, size);
+  } else {
+    kernels->f32_scale(x->floats, f, out->floats, size);
+  }
+
+  return result;
+}
+
+// the sum of all elements of a typed array, an INTEGER for an INT_ARRAY (it
+// wraps around on overflow) and a FLOAT for a FLOAT_ARRAY. Both are immediates
+// so nothing is allocated
+object_t *snek_sum(object_t *array) {
+  if (!snek_is_typed_array(array)) {
+    return NULL;
+  }
+
+  typed_array_t *x = &array->data.v_typed_array;
+  if (snek_kind(array) == INT_ARRAY) {
+    return new_snek_integer(snek_kernels()->i32_sum(x->ints, x->size));
+  }
+  return new_snek_float(snek_kernels()->f32_sum(x->floats, x->size));
+}
+
+// the dot product of 2 typed arrays of the same size, an INTEGER for 2
+// INT_ARRAYs and a FLOAT otherwise. A mixed dot product converts the ints into
+// a temporary buffer first, it is freed before returning
+object_t *snek_dot(object_t *a, object_t *b) {
+  if (!snek_is_typed_array(a) || !snek_is_typed_array(b) ||
+      a->data.v_typed_array.size != b->data.v_typed_array.size) {
+    return NULL;
+  }
+
+  const snek_kernels_t *kernels = snek_kernels();
+  typed_array_t *x = &a->data.v_typed_array;
+  typed_array_t *y = &b->data.v_typed_array;
+  size_t size = x->size;
+  if (snek_kind(a) == INT_ARRAY && snek_kind(b) == INT_ARRAY) {
+    return new_snek_integer(kernels->i32_dot(x->ints, y->ints, size));
+  }
+  if (snek_kind(a) == FLOAT_ARRAY && snek_kind(b) == FLOAT_ARRAY) {
+    return new_snek_float(kernels->f32_dot(x->floats, y->floats, size));
+  }
+
+  // the dot product is symmetric, so only which side holds the ints matters
+  typed_array_t *ints = snek_kind(a) == INT_ARRAY ? x : y;
+  typed_array_t *floats = snek_kind(a) == INT_ARRAY ? y : x;
+  float *converted = malloc((size > 0 ? size : 1) * sizeof(float));
+  if (converted == NULL) {
+    return NULL;
+  }
+  kernels->i32_to_f32(ints->ints, converted, size);
+  float dot = kernels->f32_dot(converted, floats->floats, size);
+  free(converted);
+
+  return new_snek_float(dot);
+}
+
 object_t *new_snek_object() {
   object_t *new_obj = calloc(sizeof(object_t), 1);
   if (new_obj == NULL) {
@@ -618,18 +1468,20 @@ object_t *new_snek_object() {
 
   // incremenet refcount for garbage collection
   new_obj->refcount = 1;
+  heap_stats_add(new_obj, 0);
   return new_obj;
 }
 
 void refcount_inc(object_t *obj) {
-  if (obj == NULL) {
+  // immediates are copied around by value so they don't need a refcount
+  if (obj == NULL || snek_is_immediate(obj)) {
     return;
   }
   obj->refcount++;
 }
 
 void refcount_dec(object_t *obj) {
-  if (obj == NULL) {
+  if (obj == NULL || snek_is_immediate(obj)) {
     return;
   }
   obj->refcount--;
@@ -640,7 +1492,7 @@ void refcount_dec(object_t *obj) {
 }
 
 void refcount_free(object_t *obj) {
-  if (obj == NULL) {
+  if (obj == NULL || snek_is_immediate(obj)) {
     return;
   }
 
@@ -654,28 +1506,33 @@ void refcount_free(object_t *obj) {
   // for string we have to also make sure that we first free the data inside
   // and only than can we free the obj
   case STRING:
-    free(obj->data.v_string);
+    // the intern table must not hand out a string that no longer exists
+    if (obj->is_interned) {
+      intern_table_remove(&interned_strings, obj);
+    }
+    // short strings are stored inside the object, nothing else to free
+    if (!snek_string_is_inline(obj)) {
+      free(obj->data.v_string.heap_chars);
+    }
     break;
-  // the vector3 object_t contains other object_t's (snek integers)
-  // here we jsut decrement them and if their refcount hits 0, the refcount(dec)
-  // function will call refcount_free() with object->kind integer for each,
-  // which will in turn free them
+  // the components of a vector are stored inline, they hold no references
   case VECTOR3:
-    refcount_dec(obj->data.v_vector3.x);
-    refcount_dec(obj->data.v_vector3.y);
-    refcount_dec(obj->data.v_vector3.z);
     break;
   case ARRAY:
     for (int i = 0; i < obj->data.v_array.size; i++) {
-      // similarly to the vector3 approach, we do a refcount decrement of the
-      // element that is inside the array, if the refcount of that particular
-      // element reaches 0, the refcount_dec() function will take care of
-      // freeing it from memory
+      // we do a refcount decrement of the element that is inside the array,
+      // if the refcount of that particular element reaches 0, the
+      // refcount_dec() function will take care of freeing it from memory
       refcount_dec(obj->data.v_array.elements[i]);
     }
     // free the array itself
     free(obj->data.v_array.elements);
     break;
+  // typed arrays hold plain numbers, only their buffer has to be freed
+  case INT_ARRAY:
+  case FLOAT_ARRAY:
+    free(obj->data.v_typed_array.ints);
+    break;
   default:
     fprintf(stderr, "invalid object type during refcount_free()");
     return;
@@ -684,6 +1541,55 @@ void refcount_free(object_t *obj) {
   // moved outside the switch statements so that we don't have to duplicate
   // free() of the parent container on each of the cases above since at the end
   // no matter what type it is, the parent/container object will be freed
+  heap_stats_remove(obj);
   free(obj);
   return;
 }
+
+// the bytes of the heap that belong to 'obj', the object and its buffer
+size_t snek_object_size(object_t *obj) {
+  size_t size = sizeof(object_t);
+  switch (obj->kind) {
+  case STRING:
+    if (!snek_string_is_inline(obj)) {
+      size += obj->data.v_string.length + 1;
+    }
+    break;
+  case ARRAY:
+    size += obj->data.v_array.capacity * sizeof(object_t *);
+    break;
+  case INT_ARRAY:
+  case FLOAT_ARRAY:
+    size += obj->data.v_typed_array.size * sizeof(int32_t);
+    break;
+  default:
+    break;
+  }
+  return size;
+}
+
+// count a new object ('old_size' 0) or one that grew from 'old_size' bytes
+void heap_stats_add(object_t *obj, size_t old_size) {
+  size_t size = snek_object_size(obj);
+  if (old_size == 0) {
+    heap_stats.objects[obj->kind]++;
+  }
+  heap_stats.bytes[obj->kind] += size - old_size;
+  heap_stats.live_bytes += size - old_size;
+  if (heap_stats.live_bytes > heap_stats.peak_bytes) {
+    heap_stats.peak_bytes = heap_stats.live_bytes;
+  }
+}
+
+// 'obj' is about to be freed
+void heap_stats_remove(object_t *obj) {
+  size_t size = snek_object_size(obj);
+  heap_stats.objects[obj->kind]--;
+  heap_stats.bytes[obj->kind] -= size;
+  heap_stats.live_bytes -= size;
+}
+
+// the live and peak bytes of the heap, per kind and in total
+const heap_stats_t *snek_heap_stats(void) {
+  return &heap_stats;
+}
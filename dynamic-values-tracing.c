@@ -1,16 +1,26 @@
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include "snek-simd.h"
 
 // Lab tests implementing a tagged runtime object system — the skeleton of a
 // dynamic language / interpreter value model, similar to how Python, Lisp, Lua,
 // or a toy VM represents values.
 // - object_t is a boxed value with a kind tag (INTEGER, FLOAT, STRING, etc.)
-// - All primitive and composite types are heap-allocated objects
-// - VECTOR3 is a product type — fixed tuple of 3 objects
+// - INTEGER and FLOAT are immediates packed into the pointer itself, all other
+//   types are heap-allocated objects
+// - VECTOR3 is a product type — fixed tuple of 3 numbers stored inline
 // - ARRAY is a dynamically sized growable list of object pointers
+// - the element wise math on typed arrays runs on the SIMD kernels of
+//   snek-simd.h
+// - in generational mode vm_collect_young() only collects the new objects
 // - All the new_snek_* functions are constructors in a managed heap
 // - We are manually handling reference semantics + lifetime + dynamic typing
 // - We are doing runtime type tagging + union dispatch
@@ -21,62 +31,557 @@ typedef struct Stack {
   void **data;
 } stack_t;
 
-typedef struct VirtualMachine {
-  stack_t *frames;
-  stack_t *objects;
-} vm_t;
+typedef struct Object object_t;
+
+// the first references of a frame are stored in the frame itself, only a
+// frame with more of them moves them to a buffer on the heap
+#define FRAME_INLINE_REFERENCES 8
 
 typedef struct StackFrame {
-  stack_t *references;
+  object_t **references; // inline_references, or the buffer once it spilled
+  size_t count;
+  size_t capacity;
+  object_t *inline_references[FRAME_INLINE_REFERENCES];
+  // popped frames wait in a free list of the VM for the next vm_new_frame()
+  struct StackFrame *next_free;
 } frame_t;
 
-typedef struct Object object_t;
-
+// root 'obj' in 'frame' until the frame is popped (or frame_drop_references()
+// drops it), as long as the frame has room it is a store into the next slot:
+//   size_t scope = frame->count;
+//   SNEK_ROOT(frame, tmp);
+//   ...
+//   frame_drop_references(frame, scope);
+#define SNEK_ROOT(frame, obj)                                                  \
+  ((frame)->count < (frame)->capacity                                          \
+       ? (void)((frame)->references[(frame)->count++] = (obj))                 \
+       : (void)frame_reference_object((frame), (obj)))
+
+// the 3 components are stored in the object itself, either 3 ints or 3 floats
+// (as soon as one of them is a float all of them are), this way a vector never
+// points to other objects and adding 2 of them is a single allocation
 typedef struct Vector {
-  object_t *x;
-  object_t *y;
-  object_t *z;
+  bool is_float;
+  union {
+    int32_t ints[3];
+    float floats[3];
+  };
 } vector_t;
 
 typedef struct Array {
   size_t size;         // number of elements in array
+  size_t capacity;     // number of elements that fit before we have to grow
   object_t **elements; // actual elements inside the array are pointers to other
                        // objects
 } array_t;
 
+// strings up to this many bytes are stored inside the object itself, only
+// longer strings need a second allocation for their characters
+#define SNEK_SMALL_STRING_MAX 22
+
+typedef struct String {
+  // number of bytes in the string (not counting the '\0'), cached so we never
+  // have to strlen() a snek string, it also tells us which layout is used
+  size_t length;
+  union {
+    char *heap_chars; // characters of a long string, in their own allocation
+    char inline_chars[SNEK_SMALL_STRING_MAX + 1]; // short string + '\0'
+  };
+} string_t;
+
+// ARRAY of numbers without the boxes, the numbers are stored one after the
+// other in a single buffer, 4 bytes each
+typedef struct TypedArray {
+  size_t size; // number of numbers in the array
+  union {
+    int32_t *ints; // INT_ARRAY
+    float *floats; // FLOAT_ARRAY
+  };
+} typed_array_t;
+
+// a table whose entries keep their value alive only as long as the key is
+// alive (an ephemeron), see new_snek_ephemeron_table(). The keys are hashed
+// by their address
+typedef struct EphemeronEntry {
+  object_t *key; // NULL for an empty slot
+  object_t *value;
+} ephemeron_entry_t;
+
+typedef struct EphemeronTable {
+  size_t count;    // number of entries in the table
+  size_t capacity; // number of slots, always a power of 2 (or 0)
+  ephemeron_entry_t *entries;
+  // vm_compact() moved keys and couldn't rebuild the table, lookups walk
+  // every slot until the next change rebuilds it
+  bool needs_rehash;
+} ephemeron_table_t;
+
 typedef enum ObjectKind {
   INTEGER,
   FLOAT,
   STRING,
   VECTOR3,
   ARRAY,
+  INT_ARRAY,
+  FLOAT_ARRAY,
+  WEAKREF,
+  EPHEMERON_TABLE,
 } object_kind_t;
 
 typedef union ObjectData {
   int v_int;
   float v_float;
-  char *v_string;
-  vector_t v_vector3; // 3 point integer
+  string_t v_string;
+  vector_t v_vector3; // 3 point int or float
   array_t v_array;    // dynamic size array
+  // INT_ARRAY and FLOAT_ARRAY
+  typed_array_t v_typed_array;
+  // WEAKREF, the referent or NULL once the collector found it dead
+  object_t *v_weakref;
+  ephemeron_table_t v_ephemerons; // EPHEMERON_TABLE
+  // new address of an object that vm_compact() moved (see is_forwarded)
+  struct Object *forward;
 } object_data_t;
 
 typedef struct Object {
   object_kind_t kind; // the kind of the object
   object_data_t data; // type of data to be stored in object
-  bool is_marked;     // mark and sweep GC of objects
+  bool is_interned;   // STRING only, this is the copy held by the intern table
+  // generational GC, see vm_set_generational()
+  uint8_t age;        // minor collections survived while young
+  bool is_old;        // promoted, only a full collection can free it
+  bool is_remembered; // old object in the remembered set of its VM
+  // compaction, see vm_compact()
+  bool is_pinned;    // its address escaped to C code, it is never moved
+  bool is_forwarded; // left behind by vm_compact(), data.forward is the copy
 } object_t;
 
-object_t *new_snek_integer(int value);
-object_t *new_snek_float(float value);
+// immediate values
+// INTEGER and FLOAT values are never allocated, instead the value is packed
+// into the object_t * itself. Real objects are always at least 8 byte aligned,
+// so the low bits of their address are 0 and we can use them as a tag that
+// tells us the pointer is not a pointer at all. The 32 bit value sits in the
+// upper half of the (64 bit) pointer
+#define SNEK_TAG_MASK 0x3
+#define SNEK_TAG_INTEGER 0x1
+#define SNEK_TAG_FLOAT 0x2
+
+_Static_assert(sizeof(uintptr_t) == 8,
+               "immediate values need 64 bit pointers to fit a 32 bit value");
+
+// slab allocator for objects
+// every object_t has the same size, so instead of calling malloc/free for each
+// one of them we carve them out of big pages owned by the VM. A page is
+// aligned to its own size which means we can find the page of any object just
+// by masking the low bits of its address
+#define SLAB_PAGE_SIZE (64 * 1024)
+#define SLAB_PAGE_MAX_OBJECTS (SLAB_PAGE_SIZE / sizeof(object_t))
+#define SLAB_PAGE_BITMAP_WORDS ((SLAB_PAGE_MAX_OBJECTS + 63) / 64)
+
+// a slot that was handed back to the page, while it is free we reuse its memory
+// to link it to the next free slot so the free list does not cost anything
+typedef struct FreeSlot {
+  struct FreeSlot *next;
+} free_slot_t;
+
+typedef struct SlabPage {
+  struct SlabPage *next;  // next page owned by the same heap
+  // VM the page belongs to, lets the write barrier find the remembered set
+  struct VirtualMachine *vm;
+  free_slot_t *free_list; // slots reclaimed by sweep(), reused first
+  size_t capacity;        // number of object slots that fit in this page
+  size_t bump;            // index of the next never used slot
+  size_t live;            // number of slots that currently hold an object
+  bool swept;             // the running incremental sweep is done with it
+  // the mutator that allocates from this page (its TLAB), NULL for none
+  struct Mutator *owner;
+  uint64_t allocated[SLAB_PAGE_BITMAP_WORDS]; // one bit per slot in use
+  // mark bits of the garbage collector, one per slot. They are kept out of the
+  // objects so that marking doesn't write to the objects themselves and
+  // clearing the marks of a page is a single memset() once it is swept
+  uint64_t marked[SLAB_PAGE_BITMAP_WORDS];
+  object_t slots[];                           // the objects themselves
+} slab_page_t;
+
+typedef struct Heap {
+  // VM that owns the heap, every new page is given a pointer to it
+  struct VirtualMachine *vm;
+  slab_page_t *pages;   // every page owned by the heap, newest first
+  slab_page_t *current; // page we are currently allocating from
+  size_t page_count;
+  size_t object_count; // live objects across all pages
+} heap_t;
+
+// string interning
+// when interning is turned on every distinct string exists only once, the
+// table maps the characters of a string to its one canonical STRING object.
+// Strings are immutable so the same object can be handed out to everyone who
+// asks for those characters, and 2 interned strings are equal only if they
+// are the same pointer
+typedef struct InternEntry {
+  uint64_t hash;    // hash of the characters, kept to avoid rehashing
+  object_t *string; // canonical STRING object, NULL for an empty slot
+} intern_entry_t;
+
+typedef struct InternTable {
+  size_t count;    // number of strings in the table
+  size_t capacity; // number of slots, always a power of 2 (or 0)
+  intern_entry_t *entries;
+} intern_table_t;
+
+// roots besides the frames
+// a collection calls a gc_visit_t once for every root it finds. Code that keeps
+// objects outside of the frames either registers the address of each variable
+// (vm_add_global()), asks the VM for a handle (vm_new_handle()) or plugs in a
+// function that visits all of its objects itself (vm_add_roots())
+typedef void (*gc_visit_t)(void *visit_ctx, object_t *obj);
+typedef void (*gc_roots_t)(void *ctx, gc_visit_t visit, void *visit_ctx);
+
+typedef struct RootSource {
+  gc_roots_t enumerate;
+  void *ctx; // handed to 'enumerate' as is
+} root_source_t;
+
+// an object held by C code, 'obj' can be read and changed freely
+typedef struct Handle {
+  object_t *obj;
+  size_t index; // position in vm->handles, lets vm_free_handle() find it
+} snek_handle_t;
+
+// weak references and finalizers
+// WEAKREF and EPHEMERON_TABLE objects are not traced through. Once marking is
+// done gc_process_weak() decides what they keep alive, clears what died and
+// queues the finalizers (vm_register_finalizer()) of the objects that died.
+// Queued finalizers run when the program calls vm_run_finalizers()
+typedef void (*snek_finalizer_t)(struct VirtualMachine *vm, object_t *obj,
+                                 void *ctx);
+
+typedef struct Finalizer {
+  object_t *obj;
+  snek_finalizer_t finalize;
+  void *ctx; // handed to 'finalize' as is
+} finalizer_t;
+
+// heap accounting
+// the bytes of the objects in the heap per kind: the slot of the object and
+// the buffers it owns, see snek_object_size(). They are counted when an object
+// is created or grows and when the collector frees it, so they are exact at
+// any time (garbage counts until it is swept). Immediates don't live in the
+// heap and are not counted
+#define SNEK_KINDS (EPHEMERON_TABLE + 1)
+
+typedef struct HeapStats {
+  size_t objects[SNEK_KINDS];
+  size_t bytes[SNEK_KINDS];
+  size_t live_bytes; // all kinds together
+  size_t peak_bytes; // the most live_bytes there ever were
+} heap_stats_t;
+
+// mutators
+// several threads can share one VM. Each of them attaches itself with
+// vm_attach_mutator() (the first one before it starts the others) and gets:
+// - a TLAB: a page of the heap only this thread allocates from, so the
+//   allocation itself takes no lock. A full TLAB is swapped for another page
+//   under the VM's lock
+// - its own frames, young list and remembered set, and counters of what it
+//   allocated. The collector merges them into the VM while the world is stopped
+// a collection (started by any thread) stops the world first: every other
+// mutator parks at its next safepoint, allocations poll one and long loops
+// that don't allocate call vm_safepoint(). A thread that blocks (e.g. joins
+// another one) wraps that in vm_blocking_begin()/vm_blocking_end(). Objects
+// themselves are not locked, threads that share a mutable object bring their
+// own locking, and like with pacing every object a thread still needs has to
+// be reachable from a root. With more than one thread the collections are
+// stop-the-world only: incremental steps collect all at once and a lazy sweep
+// is done eagerly
+typedef struct Mutator {
+  struct VirtualMachine *vm;
+  slab_page_t *tlab; // NULL until the first allocation (or after a collection)
+  stack_t *frames;
+  frame_t *free_frames; // see vm_frame_pop()
+  stack_t *young;       // see vm->young
+  stack_t *remembered;  // see vm->remembered
+  // added to the VM's counters when the TLAB is swapped or the world stops
+  size_t allocated_bytes;
+  size_t allocated_objects;
+  size_t object_count;
+  heap_stats_t heap_stats; // what it added since, see vm->heap_stats
+} mutator_t;
+
+// the mutator of the calling thread, a thread can be attached to one VM
+static _Thread_local mutator_t *snek_current_mutator = NULL;
+
+// the phases of a collection cycle, an incremental cycle (see
+// vm_collect_garbage_step()) can stop in the middle of marking or sweeping and
+// let the program run before it continues
+typedef enum GcPhase {
+  GC_IDLE,
+  GC_MARKING,
+  GC_SWEEPING,
+} gc_phase_t;
+
+// gc telemetry
+// every collection cycle records what it did in a gc_cycle_stats_t, the VM
+// keeps the last one together with totals and a histogram of all the pauses
+// (see vm_gc_telemetry()). With SNEK_GC_LOG set in the environment (or after
+// vm_set_gc_log()) every cycle also prints one line with its numbers
+typedef enum GcCycleKind {
+  GC_CYCLE_FULL,    // vm_collect_garbage() or an incremental cycle
+  GC_CYCLE_YOUNG,   // vm_collect_young()
+  GC_CYCLE_COMPACT, // vm_compact()
+} gc_cycle_kind_t;
+
+typedef struct GcCycleStats {
+  gc_cycle_kind_t kind;
+  uint64_t start_ns; // CLOCK_MONOTONIC when the cycle started
+  // time spent in each phase while the program was stopped. Mark is graying
+  // the roots, trace is marking what they reach (both are trace for a parallel
+  // mark) and sweep is sweeping, or copying for a compaction. The sweeping a
+  // lazy sweep leaves to the allocations isn't timed
+  uint64_t mark_ns;
+  uint64_t trace_ns;
+  uint64_t sweep_ns;
+  uint64_t pause_ns;     // the program was stopped this long in total
+  uint64_t max_pause_ns; // longest single stop, incremental cycles have many
+  size_t pauses;
+  size_t objects_freed;
+  size_t bytes_freed; // see snek_object_size()
+  size_t survivors;   // objects in the heap when the cycle ended
+  size_t survivor_bytes; // full cycles only, see gc_live_bytes
+  size_t heap_pages;     // pages in the heap when the cycle ended
+  size_t gray_high_water; // most objects that were gray at the same time
+} gc_cycle_stats_t;
+
+// bucket i counts the pauses shorter than 2^i microseconds (and at least
+// 2^(i-1)), the last one also counts everything longer
+#define GC_PAUSE_BUCKETS 32
+
+typedef struct GcTelemetry {
+  size_t cycles;
+  gc_cycle_stats_t last; // the last cycle that ended
+  size_t pauses;
+  uint64_t total_pause_ns;
+  uint64_t max_pause_ns;
+  size_t pause_histogram[GC_PAUSE_BUCKETS];
+} gc_telemetry_t;
+
+// heap dumps
+// vm_heap_dump() writes the objects reachable from the roots to a file that
+// heap-analyzer.c reads. It is written while the heap is walked, the dump
+// never exists in memory. All numbers are in the byte order of the machine:
+// - the header: SNEK_HEAP_DUMP_MAGIC (8 bytes) and the uint64_t version
+// - a root: 'R', the uint64_t id (address) of the object
+// - an object: 'O', the uint64_t id, the uint8_t kind, the uint64_t size (see
+//   snek_object_size()), the uint64_t number of references and their ids
+// - the end: 'E', the uint64_t number of objects in the dump
+// an object comes after the first root or object that references it. Only
+// the strong references are edges, weak references and ephemeron tables
+// don't keep anything alive on their own
+#define SNEK_HEAP_DUMP_MAGIC "SNEKHEAP"
+#define SNEK_HEAP_DUMP_VERSION 1
+#define SNEK_HEAP_DUMP_ROOT 'R'
+#define SNEK_HEAP_DUMP_OBJECT 'O'
+#define SNEK_HEAP_DUMP_END 'E'
+
+typedef struct HeapDump {
+  FILE *out;
+  stack_t *gray; // reached but not written yet
+  size_t objects;
+} heap_dump_t;
+
+// how vm_collect_garbage() sweeps once marking is done, see vm_set_sweep_mode()
+typedef enum SweepMode {
+  SWEEP_EAGER,    // sweep every page before returning
+  SWEEP_LAZY,     // leave it to the allocations that follow
+  SWEEP_PARALLEL, // split the pages between several threads
+} sweep_mode_t;
+
+typedef struct VirtualMachine {
+  stack_t *frames;
+  frame_t *free_frames; // popped frames, see vm_frame_pop()
+  heap_t heap; // every object allocated by the VM lives in one of its pages
+  // interned strings, the table does not keep its strings alive, a string that
+  // is only reachable through it is garbage and is dropped when it is swept
+  intern_table_t strings;
+  bool intern_strings; // new strings go through the table only when enabled
+  // generational mode
+  // most objects die young (e.g. the temporaries of snek_add), so new objects
+  // are kept on their own list and vm_collect_young() only traces and sweeps
+  // those. Objects that survive 'promotion_age' minor collections become old
+  // and are left alone until the next full collection. The write barrier
+  // records every old object that points to a young one in 'remembered', a
+  // minor collection treats them as extra roots
+  bool generational;
+  uint8_t promotion_age;
+  stack_t *young;      // objects allocated since the last full collection
+  stack_t *remembered; // old objects that may point to young ones
+  // incremental collection, the state of the cycle in progress
+  gc_phase_t gc_phase;
+  stack_t *gray;           // marked objects whose children are not marked yet
+  slab_page_t *sweep_page; // page the incremental sweep continues in
+  size_t sweep_slot;       // first slot of sweep_page that is not swept yet
+  // number of threads that mark during a full collection, see
+  // vm_set_mark_threads()
+  size_t mark_threads;
+  sweep_mode_t sweep_mode;
+  size_t sweep_threads; // threads of a SWEEP_PARALLEL sweep
+  // automatic collection, see vm_set_gc_pacing()
+  size_t gc_percent;           // growth allowed before collecting, 0 is off
+  size_t gc_min_trigger;       // never collect before this many bytes
+  size_t gc_trigger;           // bytes to allocate before the next collection
+  size_t gc_allocated_bytes;   // allocated since the last full collection
+  size_t gc_allocated_objects; // allocated since the last full collection
+  size_t gc_live_bytes;        // survivors of the last full collection
+  // roots besides the frames, see gc_visit_roots()
+  stack_t *globals;      // object_t ** of C variables, see vm_add_global()
+  stack_t *handles;      // snek_handle_t *, see vm_new_handle()
+  stack_t *root_sources; // root_source_t *, see vm_add_roots()
+  // weak references, see gc_process_weak()
+  stack_t *weak_objects;       // every WEAKREF and EPHEMERON_TABLE
+  stack_t *finalizers;         // finalizer_t * of objects that are alive
+  stack_t *pending_finalizers; // finalizer_t * of dead objects, they are roots
+  // every 'compact_every'th full collection compacts, see vm_set_compaction()
+  size_t compact_every;
+  size_t full_collections;
+  bool compact_pending; // waits for a collection that may move objects
+  // telemetry, see vm_gc_telemetry()
+  gc_cycle_stats_t gc_cycle; // the cycle in progress
+  bool gc_cycle_open;        // gc_cycle was started and not published yet
+  gc_telemetry_t gc_telemetry;
+  heap_stats_t heap_stats; // see vm_heap_stats()
+  FILE *gc_log; // every cycle prints a line here, NULL for none
+  // mutators, see vm_attach_mutator()
+  bool threaded;     // a mutator was attached, the locks below are used
+  stack_t *mutators; // mutator_t *
+  // protects what the mutators share while they run: handing out pages, the
+  // intern table, the lists of weak objects, finalizers and roots
+  pthread_mutex_t lock;
+  // stopping the world, all of these belong to safepoint_lock
+  pthread_mutex_t safepoint_lock;
+  pthread_cond_t safepoint_cond;
+  size_t mutators_running; // attached and neither parked nor blocking
+  size_t mutators_parked;  // maybe in the middle of a call, see vm_compact()
+  bool stop_requested;     // also read without the lock by vm_safepoint()
+  pthread_t stopper;       // the thread that stopped the world
+  size_t stop_depth;       // a collection can start another one
+} vm_t;
+
+// parallel marking
+// every marking thread (worker) traces from its own private stack without any
+// locking. When it has plenty of work and its shared deque is empty it moves a
+// batch there, idle workers steal from the other end of those deques. Big
+// arrays are traced in chunks so that the elements of one wide array can be
+// spread over all the workers
+#define PARALLEL_MARK_MIN_OBJECTS 4096 // smaller heaps are marked serially
+#define PARALLEL_MARK_CHUNK 256        // array elements traced per task
+#define PARALLEL_MARK_BATCH 64         // tasks moved to the deque at once
+
+// trace the elements of 'obj' starting at 'start' (only arrays have any)
+typedef struct MarkTask {
+  object_t *obj;
+  size_t start;
+} mark_task_t;
+
+typedef struct MarkDeque {
+  pthread_mutex_t lock;
+  mark_task_t *tasks;
+  size_t capacity;
+  size_t head; // thieves take from here (the oldest tasks)
+  size_t tail; // the owner adds and takes here
+  size_t size; // tail - head, read without the lock to find work to steal
+} mark_deque_t;
+
+typedef struct MarkWorker {
+  struct ParallelMark *mark;
+  pthread_t thread;
+  bool running; // thread was started and has to be joined
+  mark_deque_t deque;
+  mark_task_t *local; // private stack, only this worker touches it
+  size_t local_count;
+  size_t local_capacity;
+  size_t local_high_water; // telemetry, the most tasks local ever held
+} mark_worker_t;
+
+typedef struct ParallelMark {
+  mark_worker_t *workers;
+  size_t count;
+  size_t next_root; // worker that gets the next root
+  int busy; // workers that have (or are looking for) work, 0 means done
+} parallel_mark_t;
+
+// automatic collection does not start before this many bytes were allocated
+#define GC_DEFAULT_MIN_TRIGGER (4 * 1024 * 1024)
+
+// lazy sweeping, every allocation sweeps this many slots first until the sweep
+// that the last collection left behind is done
+#define LAZY_SWEEP_BUDGET 64
+// parallel sweeping, heaps with fewer pages are swept on the calling thread
+#define PARALLEL_SWEEP_MIN_PAGES 4
+
+// sweep 'count' pages starting at 'first', the pages of 2 workers never overlap
+typedef struct SweepWorker {
+  vm_t *vm;
+  slab_page_t *first;
+  size_t count;
+  size_t live_bytes; // size of the survivors, see snek_object_size()
+  size_t objects_freed;
+  size_t bytes_freed;
+  heap_stats_t freed; // see vm->heap_stats
+  pthread_t thread;
+  bool running; // thread was started and has to be joined
+} sweep_worker_t;
+
+object_t *new_snek_integer(vm_t *vm, int value);
+object_t *new_snek_float(vm_t *vm, float value);
 object_t *new_snek_string(
+    vm_t *vm,
     const char *value); // we make this a const char * to make it clear we do
                         // not intend to modify the input
-object_t *new_snek_vector3(object_t *x, object_t *y, object_t *z);
-object_t *new_snek_array(size_t size);
+object_t *new_snek_vector3(vm_t *vm, object_t *x, object_t *y, object_t *z);
+object_t *snek_vector3_get(object_t *obj, size_t axis);
+bool snek_vector3_add_into(object_t *out, object_t *a, object_t *b);
+object_t *new_snek_array(vm_t *vm, size_t size);
+object_t *new_snek_int_array(vm_t *vm, const int32_t *values, size_t size);
+object_t *new_snek_float_array(vm_t *vm, const float *values, size_t size);
+object_t *_new_snek_typed_array(vm_t *vm, object_kind_t kind, size_t size);
 bool snek_array_set(object_t *obj, size_t index, object_t *value);
 object_t *snek_array_get(object_t *obj, size_t index);
+bool snek_array_reserve(object_t *obj, size_t capacity);
+bool snek_array_push(object_t *obj, object_t *value);
+bool snek_array_grow_for(object_t *obj, size_t extra);
+bool snek_array_extend(object_t *obj, object_t *other);
 int snek_len(object_t *obj);
-object_t *snek_add(object_t *a, object_t *b);
+bool snek_is_immediate(object_t *obj);
+object_kind_t snek_kind(object_t *obj);
+int snek_int_value(object_t *obj);
+float snek_float_value(object_t *obj);
+char *snek_string_chars(object_t *obj);
+bool snek_string_is_inline(object_t *obj);
+object_t *_new_snek_string_buffer(vm_t *vm, size_t length);
+void vm_set_string_interning(vm_t *vm, bool enabled);
+uint64_t intern_hash(uint64_t hash, const char *chars, size_t length);
+object_t *intern_table_find(intern_table_t *table, uint64_t hash,
+                            const char *a, size_t a_length, const char *b,
+                            size_t b_length);
+bool intern_table_grow(intern_table_t *table);
+bool intern_table_insert(intern_table_t *table, uint64_t hash,
+                         object_t *string);
+void intern_table_remove(intern_table_t *table, object_t *string);
+void intern_table_free(intern_table_t *table);
+void intern_table_remove_unmarked(intern_table_t *table);
+bool snek_string_equals(object_t *a, object_t *b);
+object_t *snek_add(vm_t *vm, object_t *a, object_t *b);
+object_t *snek_sub(vm_t *vm, object_t *a, object_t *b);
+object_t *snek_mul(vm_t *vm, object_t *a, object_t *b);
+bool snek_is_typed_array(object_t *obj);
+object_t *snek_typed_array_binary(vm_t *vm, snek_simd_op_t op, object_t *a,
+                                  object_t *b);
+object_t *snek_scale(vm_t *vm, object_t *array, object_t *factor);
+object_t *snek_sum(vm_t *vm, object_t *array);
+object_t *snek_dot(vm_t *vm, object_t *a, object_t *b);
+object_t *_new_snek_object(vm_t *vm);
+void snek_object_free(vm_t *vm, object_t *obj);
+void snek_object_free_buffers(vm_t *vm, object_t *obj);
 stack_t *stack_new(size_t capacity);
 void stack_free(stack_t *stack);
 void *vm_new();
@@ -84,72 +589,258 @@ void vm_free(vm_t *vm);
 void stack_push(stack_t *stack, void *obj);
 void *stack_pop(stack_t *stack);
 void vm_frame_push(vm_t *vm, frame_t *frame);
+mutator_t *vm_attach_mutator(vm_t *vm);
+void vm_detach_mutator(vm_t *vm);
+mutator_t *mutator_of(vm_t *vm);
+void vm_lock(vm_t *vm);
+void vm_unlock(vm_t *vm);
+void vm_safepoint(vm_t *vm);
+void vm_blocking_begin(vm_t *vm);
+void vm_blocking_end(vm_t *vm);
+void gc_park(vm_t *vm, mutator_t *self);
+void gc_stop_world(vm_t *vm);
+void gc_start_world(vm_t *vm);
+void gc_merge_mutator(vm_t *vm, mutator_t *mutator);
+bool mutator_refill(mutator_t *mutator);
+object_t *mutator_alloc(mutator_t *mutator);
+void gc_count_allocation(vm_t *vm, size_t bytes);
+object_t *vm_intern(vm_t *vm, uint64_t hash, object_t *string);
+void gc_visit_frames(stack_t *frames, gc_visit_t visit, void *visit_ctx);
+void compact_frames(vm_t *vm, stack_t *frames);
 frame_t *vm_new_frame(vm_t *vm);
+void vm_frame_pop(vm_t *vm);
 void frame_free(frame_t *frame);
-void frame_reference_object(frame_t *frame, object_t *obj);
+bool frame_reference_object(frame_t *frame, object_t *obj);
+void frame_drop_references(frame_t *frame, size_t count);
 void vm_track_object(vm_t *vm, object_t *obj);
+slab_page_t *slab_page_new(void);
+slab_page_t *slab_page_of(object_t *obj);
+bool slab_slot_is_allocated(slab_page_t *page, size_t slot);
+bool gc_is_marked(object_t *obj);
+void gc_set_marked(object_t *obj, bool marked);
+bool gc_mark(object_t *obj);
+object_t *slab_alloc(heap_t *heap);
+void slab_release(heap_t *heap, object_t *obj);
+bool slab_page_release(slab_page_t *page, object_t *obj);
+void heap_free(vm_t *vm);
 void mark(vm_t *vm);
 void stack_remove_nulls(stack_t *stack);
 void sweep(vm_t *vm);
 void trace_blacken_object(stack_t *gray_objects, object_t *obj);
 void trace_mark_object(stack_t *gray_objects, object_t *obj);
 void vm_collect_garbage(vm_t *vm);
+void gc_collect(vm_t *vm, bool may_move);
+void vm_set_generational(vm_t *vm, bool enabled, uint8_t promotion_age);
+void vm_write_barrier(object_t *obj, object_t *value);
+bool snek_points_to_young(object_t *obj);
+void trace_mark_young_object(stack_t *gray_objects, object_t *obj);
+void trace_blacken_young_object(stack_t *gray_objects, object_t *obj);
+void sweep_young(vm_t *vm);
+void vm_collect_young(vm_t *vm);
+void gc_mark_roots(vm_t *vm, stack_t *gray_objects);
+void gc_visit_roots(vm_t *vm, gc_visit_t visit, void *visit_ctx);
+void gc_visit_gray(void *gray_objects, object_t *obj);
+void gc_visit_young(void *gray_objects, object_t *obj);
+void vm_add_global(vm_t *vm, object_t **global);
+void vm_remove_global(vm_t *vm, object_t **global);
+snek_handle_t *vm_new_handle(vm_t *vm, object_t *obj);
+void vm_free_handle(vm_t *vm, snek_handle_t *handle);
+void vm_add_roots(vm_t *vm, gc_roots_t enumerate, void *ctx);
+void vm_remove_roots(vm_t *vm, gc_roots_t enumerate, void *ctx);
+void gc_shade_new_object(vm_t *vm, object_t *obj);
+void sweep_begin(vm_t *vm);
+void sweep_slot(vm_t *vm, slab_page_t *page, size_t slot);
+bool sweep_pages(vm_t *vm, size_t budget);
+bool vm_collect_garbage_step(vm_t *vm, size_t budget);
+void vm_collect_garbage_finish(vm_t *vm);
+void vm_set_mark_threads(vm_t *vm, size_t threads);
+bool mark_claim(object_t *obj);
+void mark_local_push(mark_worker_t *worker, mark_task_t task);
+void mark_deque_push(mark_deque_t *deque, mark_task_t task);
+bool mark_deque_pop(mark_deque_t *deque, mark_task_t *task);
+bool mark_deque_steal(mark_deque_t *deque, mark_task_t *task);
+void mark_share(mark_worker_t *worker);
+bool mark_steal(mark_worker_t *worker, mark_task_t *task);
+void mark_process(mark_worker_t *worker, mark_task_t task);
+void *mark_worker_run(void *arg);
+void mark_parallel(vm_t *vm);
+void mark_deal_root(void *mark, object_t *obj);
+void vm_pin(vm_t *vm, object_t *obj);
+void vm_unpin(vm_t *vm, object_t *obj);
+void vm_set_compaction(vm_t *vm, size_t every);
+void vm_compact(vm_t *vm);
+void compact_keep(vm_t *vm, object_t *obj);
+void compact_keep_root(void *vm, object_t *obj);
+object_t *compact_evacuate(vm_t *vm, object_t *obj);
+void compact_release_pages(vm_t *vm, slab_page_t *pages);
+void vm_set_sweep_mode(vm_t *vm, sweep_mode_t mode, size_t threads);
+size_t snek_object_size(object_t *obj);
+void vm_set_gc_pacing(vm_t *vm, size_t percent, size_t min_bytes);
+void gc_cycle_end(vm_t *vm);
+bool gc_emergency_collect(vm_t *vm, object_t *keep);
+void *gc_realloc(vm_t *vm, object_t *owner, void *ptr, size_t old_size,
+                 size_t size);
+void *gc_calloc(vm_t *vm, object_t *owner, size_t count, size_t size);
+bool sweep_survivor(vm_t *vm, object_t *obj);
+void *sweep_worker_run(void *arg);
+void sweep_parallel(vm_t *vm);
+uint64_t gc_clock_ns(void);
+void gc_cycle_begin(vm_t *vm, gc_cycle_kind_t kind);
+void gc_pause_end(vm_t *vm, uint64_t start_ns);
+void gc_cycle_publish(vm_t *vm);
+void gc_count_freed(vm_t *vm, object_t *obj);
+void heap_stats_add(heap_stats_t *stats, object_kind_t kind, size_t objects,
+                    size_t bytes);
+void heap_stats_merge(heap_stats_t *stats, heap_stats_t *added);
+void gc_account(vm_t *vm, object_t *obj, size_t old_size);
+const heap_stats_t *vm_heap_stats(vm_t *vm);
+void gc_note_gray(vm_t *vm, stack_t *gray_objects);
+const gc_telemetry_t *vm_gc_telemetry(vm_t *vm);
+uint64_t vm_gc_pause_percentile(vm_t *vm, double percentile);
+void vm_set_gc_log(vm_t *vm, FILE *out);
+object_t *new_snek_weakref(vm_t *vm, object_t *referent);
+object_t *snek_weakref_get(object_t *obj);
+object_t *new_snek_ephemeron_table(vm_t *vm);
+uint64_t ephemeron_hash(object_t *key);
+ephemeron_entry_t *ephemeron_table_find(ephemeron_table_t *table,
+                                        object_t *key);
+bool ephemeron_table_rehash(vm_t *vm, object_t *obj, size_t capacity);
+void ephemeron_table_remove_slot(ephemeron_table_t *table, size_t slot);
+bool snek_ephemeron_set(object_t *obj, object_t *key, object_t *value);
+object_t *snek_ephemeron_get(object_t *obj, object_t *key);
+bool snek_ephemeron_remove(object_t *obj, object_t *key);
+bool vm_register_finalizer(vm_t *vm, object_t *obj, snek_finalizer_t finalize,
+                           void *ctx);
+size_t vm_run_finalizers(vm_t *vm);
+bool gc_weak_is_live(gc_cycle_kind_t kind, object_t *obj);
+object_t *gc_weak_forward(gc_cycle_kind_t kind, object_t *obj);
+object_t *gc_weak_keep(vm_t *vm, gc_cycle_kind_t kind, object_t *obj);
+bool gc_weak_keep_values(vm_t *vm, gc_cycle_kind_t kind);
+void gc_weak_clear(vm_t *vm, gc_cycle_kind_t kind, object_t *obj);
+void gc_process_weak(vm_t *vm, gc_cycle_kind_t kind);
+void compact_drain(vm_t *vm);
+bool vm_heap_dump(vm_t *vm, const char *path);
+void heap_dump_u64(FILE *out, uint64_t value);
+void heap_dump_root(void *visit_ctx, object_t *obj);
+void heap_dump_object(heap_dump_t *dump, object_t *obj);
+
+// the benchmarks (bench-*.c) include this file for its functions and bring
+// their own main
+#ifndef SNEK_NO_MAIN
+// the stack of a made up interpreter, used as a root source by the demo
+typedef struct InterpreterStack {
+  object_t *values[4];
+  size_t count;
+} interpreter_stack_t;
+
+void interpreter_roots(void *ctx, gc_visit_t visit, void *visit_ctx) {
+  interpreter_stack_t *stack = ctx;
+  for (size_t i = 0; i < stack->count; i++) {
+    visit(visit_ctx, stack->values[i]);
+  }
+}
+
+// finalizer of the demo, counts the objects it saw die in 'ctx'
+void count_finalized(vm_t *vm, object_t *obj, void *ctx) {
+  (void)vm;
+  assert(snek_kind(obj) == STRING);
+  (*(size_t *)ctx)++;
+}
+
+// a thread of the mutators demo: builds an array of 'MUTATOR_KEPT' strings
+// (and a lot of garbage) and hands it over in a handle
+#define MUTATOR_KEPT 500
+
+typedef struct MutatorDemo {
+  vm_t *vm;
+  int id;
+  snek_handle_t *result;
+} mutator_demo_t;
+
+void *mutator_demo(void *ctx) {
+  mutator_demo_t *demo = ctx;
+  vm_t *vm = demo->vm;
+  assert(vm_attach_mutator(vm) != NULL);
+  frame_t *frame = vm_new_frame(vm);
+  object_t *kept = new_snek_array(vm, MUTATOR_KEPT);
+  frame_reference_object(frame, kept);
+  for (int i = 0; i < MUTATOR_KEPT * 20; i++) {
+    object_t *garbage = new_snek_array(vm, 2);
+    snek_array_set(garbage, 0, new_snek_string(vm, "a garbage string"));
+    if (i % 20 == 0) {
+      snek_array_set(kept, (size_t)i / 20, new_snek_string(vm, "shared"));
+    }
+    if (i % 1000 == 0) {
+      vm_collect_young(vm); // explicit collections from several threads
+    }
+  }
+  snek_array_set(kept, 0, new_snek_integer(vm, demo->id));
+  demo->result = vm_new_handle(vm, kept);
+  vm_frame_pop(vm);
+  vm_detach_mutator(vm);
+  return NULL;
+}
 
 int main() {
+  // every object is allocated from the pages of a VM, so the demos below share
+  // one and release all of their objects at once with vm_free()
+  vm_t *vm = vm_new();
+
   // int
-  object_t *int_object = new_snek_integer(42);
-  printf("%d\n", int_object->data.v_int);
+  object_t *int_object = new_snek_integer(vm, 42);
+  printf("%d\n", snek_int_value(int_object));
 
   // float
-  object_t *float_object = new_snek_float(3.14);
-  printf("%.2f\n", float_object->data.v_float);
+  object_t *float_object = new_snek_float(vm, 3.14);
+  printf("%.2f\n", snek_float_value(float_object));
 
   // string
-  object_t *string_object = new_snek_string("hello world");
-  printf("%s\n", string_object->data.v_string);
+  object_t *string_object = new_snek_string(vm, "hello world");
+  printf("%s\n", snek_string_chars(string_object));
 
   // vector (3 point object)
-  object_t *x = new_snek_integer(1);
-  object_t *y = new_snek_integer(2);
-  object_t *z = new_snek_integer(3);
-  object_t *vector_object = new_snek_vector3(x, y, z);
+  object_t *x = new_snek_integer(vm, 1);
+  object_t *y = new_snek_integer(vm, 2);
+  object_t *z = new_snek_integer(vm, 3);
+  object_t *vector_object = new_snek_vector3(vm, x, y, z);
   // there is a lot more nesting here because
   // vector_object contains 3 of object_t
   // than each object_t contains a data and a kind field
   // the data field is a union that can have different types
-  printf("x:%d y:%d z:%d\n", vector_object->data.v_vector3.x->data.v_int,
-         vector_object->data.v_vector3.y->data.v_int,
-         vector_object->data.v_vector3.z->data.v_int);
+  printf("x:%d y:%d z:%d\n", snek_int_value(snek_vector3_get(vector_object, 0)),
+         snek_int_value(snek_vector3_get(vector_object, 1)),
+         snek_int_value(snek_vector3_get(vector_object, 2)));
 
-  object_t *a = new_snek_integer(1);
-  object_t *second_vector = new_snek_vector3(a, a, a);
-  printf("x:%d y:%d z:%d\n", second_vector->data.v_vector3.x->data.v_int,
-         second_vector->data.v_vector3.y->data.v_int,
-         second_vector->data.v_vector3.z->data.v_int);
+  object_t *a = new_snek_integer(vm, 1);
+  object_t *second_vector = new_snek_vector3(vm, a, a, a);
+  printf("x:%d y:%d z:%d\n", snek_int_value(snek_vector3_get(second_vector, 0)),
+         snek_int_value(snek_vector3_get(second_vector, 1)),
+         snek_int_value(snek_vector3_get(second_vector, 2)));
 
   // arrays
   int test_array_size = 5;
-  object_t *array_object = new_snek_array(test_array_size);
+  object_t *array_object = new_snek_array(vm, test_array_size);
   printf("size of the array: %zu\n", array_object->data.v_array.size);
-  object_t *new_int = new_snek_integer(3);
+  object_t *new_int = new_snek_integer(vm, 3);
   // set a new value inside the array at index 0
   bool success = snek_array_set(array_object, 0, new_int);
   if (!success) {
-    printf("failed to set %d in array at index %d\n", new_int->data.v_int, 0);
+    printf("failed to set %d in array at index %d\n", snek_int_value(new_int),
+           0);
   }
   // get the value inside the array at index 0
   object_t *value_at_index_0 = snek_array_get(array_object, 0);
   printf("element in array at index %d is %d\n", 0,
-         value_at_index_0->data.v_int);
+         snek_int_value(value_at_index_0));
   // get new integer object
-  object_t *new_int_1 = new_snek_integer(15);
+  object_t *new_int_1 = new_snek_integer(vm, 15);
   // set the new integer inside the array at index 1
   bool success_set_1 = snek_array_set(array_object, 1, new_int_1);
   // get the element at index 1 from the array
   object_t *value_at_index_1 = snek_array_get(array_object, 1);
   // check what we got at th end
   printf("element in array at index %d is %d\n", 1,
-         value_at_index_1->data.v_int);
+         snek_int_value(value_at_index_1));
 
   // get the length of an oject
   int len_of_int = snek_len(int_object);
@@ -165,114 +856,82 @@ int main() {
 
   //// dynamic add function
   // add integers
-  object_t *int_one = new_snek_integer(1);
-  object_t *int_three = new_snek_integer(3);
-  object_t *int_four = snek_add(int_one, int_three);
-  printf("result of snek_add(int_one, int_three): %d\n", int_four->data.v_int);
+  object_t *int_one = new_snek_integer(vm, 1);
+  object_t *int_three = new_snek_integer(vm, 3);
+  object_t *int_four = snek_add(vm, int_one, int_three);
+  printf("result of snek_add(int_one, int_three): %d\n",
+         snek_int_value(int_four));
 
   // add floats
-  object_t *float_one = new_snek_float(1.5);
-  object_t *float_three = new_snek_float(3.5);
-  object_t *float_five = snek_add(float_one, float_three);
+  object_t *float_one = new_snek_float(vm, 1.5);
+  object_t *float_three = new_snek_float(vm, 3.5);
+  object_t *float_five = snek_add(vm, float_one, float_three);
   printf("result of snek_add(float_one, float_three): %.2f\n",
-         float_five->data.v_float);
+         snek_float_value(float_five));
 
   // add strings
-  object_t *string_one = new_snek_string("hello");
-  object_t *string_two = new_snek_string(", world!");
-  object_t *result_string = snek_add(string_one, string_two);
+  object_t *string_one = new_snek_string(vm, "hello");
+  object_t *string_two = new_snek_string(vm, ", world!");
+  object_t *result_string = snek_add(vm, string_one, string_two);
   printf("result of snek_add(string_one, string_two): %s\n",
-         result_string->data.v_string);
+         snek_string_chars(result_string));
   // what if we add the same string twice
-  object_t *repeated_string = new_snek_string("hello ");
+  object_t *repeated_string = new_snek_string(vm, "hello ");
   object_t *result_after_repeated_string =
-      snek_add(repeated_string, repeated_string);
+      snek_add(vm, repeated_string, repeated_string);
   printf("result of snek_add(repeated_string, repeated_string): %s\n",
-         result_after_repeated_string->data.v_string);
+         snek_string_chars(result_after_repeated_string));
 
   // add vectors
-  object_t *vector_int_one = new_snek_integer(1);
-  object_t *vector_int_three = new_snek_integer(3);
-  object_t *vectory_int_five = new_snek_integer(5);
+  object_t *vector_int_one = new_snek_integer(vm, 1);
+  object_t *vector_int_three = new_snek_integer(vm, 3);
+  object_t *vectory_int_five = new_snek_integer(vm, 5);
   object_t *vector3_one =
-      new_snek_vector3(vector_int_one, vector_int_three, vectory_int_five);
-  object_t *result_vector_add = snek_add(vector3_one, vector3_one);
-  printf("vector3_one has: x: %d, y: %d, z: %d\n", vector_int_one->data.v_int,
-         vector_int_three->data.v_int, vectory_int_five->data.v_int);
+      new_snek_vector3(vm, vector_int_one, vector_int_three, vectory_int_five);
+  object_t *result_vector_add = snek_add(vm, vector3_one, vector3_one);
+  printf("vector3_one has: x: %d, y: %d, z: %d\n",
+         snek_int_value(vector_int_one), snek_int_value(vector_int_three),
+         snek_int_value(vectory_int_five));
   printf("result of repeated snek_add(vector3_one, vector3_one - x: %d y: %d "
          "z: %d\n",
-         result_vector_add->data.v_vector3.x->data.v_int,
-         result_vector_add->data.v_vector3.y->data.v_int,
-         result_vector_add->data.v_vector3.z->data.v_int);
+         snek_int_value(snek_vector3_get(result_vector_add, 0)),
+         snek_int_value(snek_vector3_get(result_vector_add, 1)),
+         snek_int_value(snek_vector3_get(result_vector_add, 2)));
 
   // add arrays
   // array of 2 integers
-  object_t *int_six = new_snek_integer(6);
-  object_t *array_of_sixes = new_snek_array(2);
+  object_t *int_six = new_snek_integer(vm, 6);
+  object_t *array_of_sixes = new_snek_array(vm, 2);
   assert(snek_array_set(array_of_sixes, 0, int_six));
   assert(snek_array_set(array_of_sixes, 1, int_six));
 
   // array of 3 strings
-  object_t *hi = new_snek_string("hi");
-  object_t *hellos = new_snek_array(3);
+  object_t *hi = new_snek_string(vm, "hi");
+  object_t *hellos = new_snek_array(vm, 3);
   assert(snek_array_set(hellos, 0, hi));
   assert(snek_array_set(hellos, 1, hi));
   assert(snek_array_set(hellos, 2, hi));
 
   // add the 2 together
-  object_t *result_array_add = snek_add(array_of_sixes, hellos);
+  object_t *result_array_add = snek_add(vm, array_of_sixes, hellos);
   printf("result of adding 2 arays, one of size 2 one of size 3: %zu\n",
          result_array_add->data.v_array.size);
   printf("print the second element: [%d] and fourth element: [%s] in "
          "the array to see that "
          "it is larger than both the 2 and 3 sized ones that were merged "
          "together, also second element is an int, fourth is a string\n ",
-         result_array_add->data.v_array.elements[1]->data.v_int,
-         result_array_add->data.v_array.elements[3]->data.v_string);
+         snek_int_value(result_array_add->data.v_array.elements[1]),
+         snek_string_chars(result_array_add->data.v_array.elements[3]));
 
   // Mark and sweep
-  vm_t *vm = vm_new();
   printf("frames capacity %zu\n", vm->frames->capacity);
-  printf("objects capacity %zu\n", vm->objects->capacity);
-  vm_free(vm);
+  printf("heap pages %zu objects %zu\n", vm->heap.page_count,
+         vm->heap.object_count);
 
   // don't forget to cleanup heap memory
-  free(int_object);
-  free(float_object);
-
-  // strings
-  if (string_object->data.v_string != NULL) {
-    free(string_object->data.v_string);
-  }
-  free(string_object);
-
-  // vector
-  free(vector_object);
-  free(second_vector);
-
-  // array
-  if (array_object->data.v_array.elements != NULL) {
-    free(array_object->data.v_array.elements);
-  }
-  free(array_object);
-
-  // custom dynamic objects
-  free(int_one);
-  free(int_three);
-  free(int_four);
-  free(float_one);
-  free(float_three);
-  free(float_five);
-  free(string_one);
-  free(string_two);
-  free(result_string);
-  free(repeated_string);
-  free(result_after_repeated_string);
-  free(vector_int_one);
-  free(vector_int_three);
-  free(vectory_int_five);
-  free(vector3_one);
-  free(result_vector_add);
+  // all of the objects above live in the pages of the VM, so freeing the VM
+  // also frees them (including the nested string and array buffers)
+  vm_free(vm);
 
   // Continue here for tracing GC tests
   // Test stack_push and stack_pop
@@ -306,93 +965,1254 @@ int main() {
   printf("vm_new_frame test passed (frames=%zu)\n", test_vm->frames->count);
 
   // Test frame_reference_object
-  object_t *ref_obj = new_snek_integer(123);
+  object_t *ref_obj = new_snek_string(test_vm, "referenced");
   frame_reference_object(test_frame, ref_obj);
-  assert(test_frame->references->count == 1);
+  assert(test_frame->count == 1);
   printf("frame_reference_object test passed (count=%zu)\n",
-         test_frame->references->count);
+         test_frame->count);
 
-  // Test vm_track_object
-  vm_track_object(test_vm, ref_obj);
-  assert(test_vm->objects->count == 1);
+  // Test vm_frame_pop: the popped frame comes back with the capacity it grew
+  // to and no references
+  frame_t *call_frame = vm_new_frame(test_vm);
+  for (size_t i = 0; i < 20; i++) {
+    frame_reference_object(call_frame, ref_obj);
+  }
+  size_t grown = call_frame->capacity;
+  vm_frame_pop(test_vm);
+  assert(test_vm->frames->count == 1);
+  assert(test_vm->frames->data[0] == test_frame);
+  frame_t *reused_frame = vm_new_frame(test_vm);
+  assert(reused_frame == call_frame);
+  assert(reused_frame->count == 0);
+  assert(reused_frame->capacity == grown);
+  vm_frame_pop(test_vm);
+  printf("vm_frame_pop test passed (capacity=%zu)\n", grown);
+
+  // Test SNEK_ROOT: the first references stay inside the frame, a scope drops
+  // its temporaries again
+  vm_t *root_vm = vm_new();
+  frame_t *root_frame = vm_new_frame(root_vm);
+  assert(root_frame->references == root_frame->inline_references);
+  size_t scope = root_frame->count;
+  for (size_t i = 0; i < FRAME_INLINE_REFERENCES; i++) {
+    SNEK_ROOT(root_frame, new_snek_array(root_vm, 0));
+  }
+  assert(root_frame->references == root_frame->inline_references);
+  SNEK_ROOT(root_frame, new_snek_array(root_vm, 0));
+  assert(root_frame->references != root_frame->inline_references);
+  assert(root_frame->count == FRAME_INLINE_REFERENCES + 1);
+  vm_collect_garbage(root_vm);
+  assert(root_vm->heap.object_count == FRAME_INLINE_REFERENCES + 1);
+  frame_drop_references(root_frame, scope);
+  assert(root_frame->count == 0);
+  vm_collect_garbage(root_vm);
+  assert(root_vm->heap.object_count == 0);
+  printf("SNEK_ROOT test passed (capacity=%zu)\n", root_frame->capacity);
+  vm_free(root_vm);
+
+  // Test vm_track_object: every constructor allocates from the VM's slab so
+  // the object is already tracked without calling vm_track_object() by hand
+  assert(test_vm->heap.object_count == 1);
+  assert(slab_page_of(ref_obj) == test_vm->heap.pages);
   printf("vm_track_object test passed (objects=%zu)\n",
-         test_vm->objects->count);
+         test_vm->heap.object_count);
 
   // Test trace_mark_object
   stack_t *gray = stack_new(4);
   trace_mark_object(gray, ref_obj);
-  assert(ref_obj->is_marked == true);
+  assert(gc_is_marked(ref_obj));
   assert(gray->count == 1);
   printf("trace_mark_object test passed\n");
 
-  // Test trace_blacken_object for VECTOR3
-  object_t *vx = new_snek_integer(1);
-  object_t *vy = new_snek_integer(2);
-  object_t *vz = new_snek_integer(3);
-  object_t *vec = new_snek_vector3(vx, vy, vz);
+  // Test trace_blacken_object for VECTOR3: the components are numbers stored
+  // in the vector itself, so there is nothing to mark (and strings are refused)
+  object_t *vx = new_snek_string(test_vm, "x");
+  object_t *vy = new_snek_string(test_vm, "y");
+  object_t *vz = new_snek_string(test_vm, "z");
+  assert(new_snek_vector3(test_vm, vx, vy, vz) == NULL);
+  assert(new_snek_vector3(test_vm, NULL, NULL, NULL) == NULL);
+  object_t *vec = new_snek_vector3(test_vm, new_snek_integer(test_vm, 1),
+                                   new_snek_float(test_vm, 2.5),
+                                   new_snek_integer(test_vm, 3));
   trace_blacken_object(gray, vec);
-  assert(vx->is_marked && vy->is_marked && vz->is_marked);
+  assert(gray->count == 1);
+  assert(snek_float_value(snek_vector3_get(vec, 0)) == 1.0f);
   printf("trace_blacken_object (VECTOR3) test passed\n");
 
   // Test trace_blacken_object for ARRAY
-  object_t *arr = new_snek_array(2);
+  object_t *arr = new_snek_array(test_vm, 3);
   snek_array_set(arr, 0, vx);
   snek_array_set(arr, 1, vy);
+  snek_array_set(arr, 2, vz);
   trace_blacken_object(gray, arr);
-  assert(vx->is_marked && vy->is_marked);
+  assert(gc_is_marked(vx) && gc_is_marked(vy) && gc_is_marked(vz));
   printf("trace_blacken_object (ARRAY) test passed\n");
 
   stack_free(gray);
 
   // Test sweep: add unmarked object and expect it removed
-  object_t *will_be_collected = new_snek_integer(999);
-  vm_track_object(test_vm, will_be_collected);
-  assert(test_vm->objects->count == 2);
+  // ref_obj, vx, vy and vz are marked, vec, arr and this one are not
+  object_t *will_be_collected = new_snek_string(test_vm, "garbage");
+  assert(test_vm->heap.object_count == 7);
   sweep(test_vm);
-  assert(test_vm->objects->count == 1); // unmarked object was removed
+  assert(test_vm->heap.object_count == 4); // unmarked objects were removed
   printf("sweep test passed (remaining objects=%zu)\n",
-         test_vm->objects->count);
+         test_vm->heap.object_count);
+
+  // Test slab reuse: sweep handed the dead slots back to the page, so the next
+  // allocation reuses the last freed slot instead of asking malloc for memory
+  object_t *reused = new_snek_string(test_vm, "reused");
+  assert(reused == will_be_collected);
+  assert(test_vm->heap.page_count == 1);
+  printf("slab reuse test passed (pages=%zu)\n", test_vm->heap.page_count);
 
   // Test full GC (mark + trace + sweep)
+  // only ref_obj is referenced by a frame, everything else is garbage now
   vm_collect_garbage(test_vm);
+  assert(test_vm->heap.object_count == 1);
+  assert(strcmp(snek_string_chars(ref_obj), "referenced") == 0);
   printf("vm_collect_garbage test ran successfully\n");
 
+  // Test slab growth: allocate more objects than fit in one page
+  size_t page_capacity = test_vm->heap.pages->capacity;
+  for (size_t i = 0; i < page_capacity * 2; i++) {
+    assert(new_snek_array(test_vm, 0) != NULL);
+  }
+  assert(test_vm->heap.page_count == 3);
+  vm_collect_garbage(test_vm);
+  assert(test_vm->heap.object_count == 1);
+  printf("slab growth test passed (pages=%zu)\n", test_vm->heap.page_count);
+
+  // Test immediates: numbers never touch the heap, not even as the results of
+  // snek_add or as elements of an array
+  size_t objects_before = test_vm->heap.object_count;
+  object_t *sum = new_snek_integer(test_vm, 0);
+  for (int i = 0; i < 1000; i++) {
+    sum = snek_add(test_vm, sum, new_snek_integer(test_vm, i));
+  }
+  object_t *float_sum = snek_add(test_vm, sum, new_snek_float(test_vm, 0.5));
+  assert(snek_is_immediate(sum) && snek_kind(sum) == INTEGER);
+  assert(snek_int_value(sum) == 499500);
+  assert(snek_kind(float_sum) == FLOAT);
+  assert(snek_float_value(float_sum) == 499500.5f);
+  assert(snek_int_value(new_snek_integer(test_vm, -7)) == -7);
+  assert(test_vm->heap.object_count == objects_before);
+  // an immediate inside a frame is skipped by the GC
+  frame_reference_object(test_frame, sum);
+  vm_collect_garbage(test_vm);
+  assert(test_vm->heap.object_count == objects_before);
+  printf("immediate values test passed (sum=%d)\n", snek_int_value(sum));
+
+  // Test small strings: short strings live inside the object, long ones get a
+  // buffer of their own, snek_len and snek_add work with both layouts
+  object_t *short_str = new_snek_string(test_vm, "key");
+  object_t *long_str =
+      new_snek_string(test_vm, "a string that is too long to be inlined");
+  assert(snek_string_is_inline(short_str));
+  assert(!snek_string_is_inline(long_str));
+  object_t *short_and_long = snek_add(test_vm, short_str, long_str);
+  assert(!snek_string_is_inline(short_and_long));
+  assert(snek_len(short_and_long) == snek_len(short_str) + snek_len(long_str));
+  assert(strncmp(snek_string_chars(short_and_long), "keya string", 11) == 0);
+  object_t *short_twice = snek_add(test_vm, short_str, short_str);
+  assert(snek_string_is_inline(short_twice));
+  assert(strcmp(snek_string_chars(short_twice), "keykey") == 0);
+  printf("small string test passed (%s)\n", snek_string_chars(short_twice));
+
+  // Test length tracked strings: building a string piece by piece keeps the
+  // cached length in sync with the characters
+  object_t *built = new_snek_string(test_vm, "");
+  object_t *piece = new_snek_string(test_vm, "ab");
+  for (int i = 0; i < 100; i++) {
+    built = snek_add(test_vm, built, piece);
+  }
+  assert(snek_len(built) == 200);
+  assert(strlen(snek_string_chars(built)) == 200);
+  assert(strncmp(snek_string_chars(built) + 196, "abab", 5) == 0);
+  printf("length tracked string test passed (len=%d)\n", snek_len(built));
+
+  // Test string interning: with interning on, equal strings share one object,
+  // also when one of them is the result of snek_add, and the table does not
+  // keep its strings alive
+  vm_t *intern_vm = vm_new();
+  vm_set_string_interning(intern_vm, true);
+  frame_t *intern_frame = vm_new_frame(intern_vm);
+  object_t *tag = new_snek_string(intern_vm, "status:ok");
+  frame_reference_object(intern_frame, tag);
+  assert(new_snek_string(intern_vm, "status:ok") == tag);
+  object_t *prefix = new_snek_string(intern_vm, "status:");
+  object_t *suffix = new_snek_string(intern_vm, "ok");
+  assert(snek_add(intern_vm, prefix, suffix) == tag);
+  assert(snek_string_equals(tag, new_snek_string(intern_vm, "status:ok")));
+  assert(!snek_string_equals(tag, new_snek_string(intern_vm, "status:error")));
+  assert(!snek_string_equals(tag, NULL) && !snek_string_equals(NULL, tag));
+  char key[32];
+  for (int i = 0; i < 1000; i++) {
+    snprintf(key, sizeof(key), "key-%d", i);
+    assert(new_snek_string(intern_vm, key) == new_snek_string(intern_vm, key));
+  }
+  assert(intern_vm->strings.count == 1004);
+  vm_collect_garbage(intern_vm);
+  // only the string referenced by the frame is left in the table
+  assert(intern_vm->strings.count == 1);
+  assert(intern_vm->heap.object_count == 1);
+  assert(new_snek_string(intern_vm, "status:ok") == tag);
+  printf("string interning test passed (interned=%zu)\n",
+         intern_vm->strings.count);
+  vm_free(intern_vm);
+
+  // Test growable arrays: pushing N elements grows the capacity geometrically
+  // and extending appends in place, the GC sees every pushed element
+  vm_t *array_vm = vm_new();
+  frame_t *array_frame = vm_new_frame(array_vm);
+  object_t *list = new_snek_array(array_vm, 0);
+  frame_reference_object(array_frame, list);
+  size_t reallocations = 0;
+  for (int i = 0; i < 1000; i++) {
+    size_t capacity_before = list->data.v_array.capacity;
+    assert(snek_array_push(list, new_snek_string(array_vm, "item")));
+    if (list->data.v_array.capacity != capacity_before) {
+      reallocations++;
+    }
+  }
+  assert(snek_len(list) == 1000);
+  assert(reallocations <= 10);
+  assert(snek_array_extend(list, list));
+  assert(snek_len(list) == 2000);
+  assert(snek_array_get(list, 1999) == snek_array_get(list, 999));
+  vm_collect_garbage(array_vm);
+  assert(array_vm->heap.object_count == 1001); // the list and its 1000 items
+  printf("growable array test passed (capacity=%zu, reallocations=%zu)\n",
+         list->data.v_array.capacity, reallocations);
+  vm_free(array_vm);
+
+  // Test typed arrays: the numbers are stored unboxed in one buffer, snek_add
+  // adds them element by element and only allocates the result
+  vm_t *typed_vm = vm_new();
+  int32_t ints[1000];
+  float floats[1000];
+  for (int i = 0; i < 1000; i++) {
+    ints[i] = i;
+    floats[i] = i * 0.5f;
+  }
+  object_t *int_array = new_snek_int_array(typed_vm, ints, 1000);
+  object_t *float_array = new_snek_float_array(typed_vm, floats, 1000);
+  object_t *int_sum = snek_add(typed_vm, int_array, int_array);
+  object_t *mixed_sum = snek_add(typed_vm, int_array, float_array);
+  assert(snek_kind(int_sum) == INT_ARRAY && snek_len(int_sum) == 1000);
+  assert(snek_int_value(snek_array_get(int_sum, 999)) == 1998);
+  assert(snek_kind(mixed_sum) == FLOAT_ARRAY);
+  assert(snek_float_value(snek_array_get(mixed_sum, 10)) == 15.0f);
+  assert(snek_array_set(float_array, 0, new_snek_integer(typed_vm, 7)));
+  assert(snek_float_value(snek_array_get(float_array, 0)) == 7.0f);
+  assert(!snek_array_set(int_array, 0, new_snek_float(typed_vm, 1.5)));
+  object_t *short_ints = new_snek_int_array(typed_vm, NULL, 3);
+  assert(snek_add(typed_vm, int_array, short_ints) == NULL);
+  assert(typed_vm->heap.object_count == 5);
+  printf("typed array test passed (int_sum[999]=%d)\n",
+         snek_int_value(snek_array_get(int_sum, 999)));
+  vm_free(typed_vm);
+
+  // Test the SIMD kernels: every kernel set the cpu supports gives the same
+  // results as the scalar loops, also for sizes that leave a scalar tail
+  const char *kernel_names[] = {"scalar", "sse2", "avx2"};
+  for (size_t k = 0; k < 3; k++) {
+    const snek_kernels_t *kernels = snek_kernels_by_name(kernel_names[k]);
+    if (kernels == NULL) {
+      continue;
+    }
+    for (size_t n = 0; n < 20; n++) {
+      int32_t sums[20];
+      int32_t products[20];
+      float differences[20];
+      kernels->i32_binary(SNEK_SIMD_ADD, ints, ints + 1, sums, n);
+      kernels->i32_binary(SNEK_SIMD_MUL, ints, ints + 1, products, n);
+      kernels->f32_binary(SNEK_SIMD_SUB, floats, floats + 2, differences, n);
+      for (size_t i = 0; i < n; i++) {
+        assert(sums[i] == 2 * (int32_t)i + 1);
+        assert(products[i] == (int32_t)(i * (i + 1)));
+        assert(differences[i] == -1.0f);
+      }
+      assert(kernels->i32_sum(ints, n) == (int32_t)(n * (n - 1) / 2));
+      assert(kernels->f32_dot(floats, floats, n) ==
+             snek_scalar_kernels.f32_dot(floats, floats, n));
+    }
+  }
+
+  vm_t *simd_vm = vm_new();
+  object_t *xs = new_snek_int_array(simd_vm, ints, 100);
+  object_t *ys = new_snek_float_array(simd_vm, floats, 100);
+  object_t *x_minus_y = snek_sub(simd_vm, xs, ys);
+  assert(snek_float_value(snek_array_get(x_minus_y, 99)) == 49.5f);
+  object_t *x_times_x = snek_mul(simd_vm, xs, xs);
+  assert(snek_int_value(snek_array_get(x_times_x, 99)) == 9801);
+  object_t *x_tripled = snek_scale(simd_vm, xs, new_snek_integer(simd_vm, 3));
+  assert(snek_kind(x_tripled) == INT_ARRAY);
+  assert(snek_int_value(snek_array_get(x_tripled, 7)) == 21);
+  object_t *y_halved = snek_scale(simd_vm, ys, new_snek_float(simd_vm, 0.5));
+  assert(snek_float_value(snek_array_get(y_halved, 10)) == 2.5f);
+  assert(snek_int_value(snek_sum(simd_vm, xs)) == 4950);
+  assert(snek_float_value(snek_sum(simd_vm, ys)) == 2475.0f);
+  assert(snek_int_value(snek_dot(simd_vm, xs, xs)) == 328350);
+  assert(snek_float_value(snek_dot(simd_vm, xs, ys)) == 164175.0f);
+  assert(snek_sub(simd_vm, xs, new_snek_integer(simd_vm, 1)) == NULL);
+  assert(snek_sum(simd_vm, NULL) == NULL);
+  assert(snek_dot(simd_vm, NULL, NULL) == NULL);
+  assert(snek_sub(simd_vm, xs, NULL) == NULL);
+  assert(snek_scale(simd_vm, xs, NULL) == NULL);
+  printf("simd kernel test passed (kernels=%s)\n", snek_kernels()->name);
+  vm_free(simd_vm);
+
+  // Test inline vectors: adding 2 vectors allocates only the result, adding
+  // into an existing vector allocates nothing at all
+  vm_t *vector_vm = vm_new();
+  object_t *zero = new_snek_integer(vector_vm, 0);
+  object_t *position = new_snek_vector3(vector_vm, zero, zero, zero);
+  object_t *velocity = new_snek_vector3(
+      vector_vm, new_snek_float(vector_vm, 0.5), new_snek_integer(vector_vm, 1),
+      new_snek_integer(vector_vm, -2));
+  assert(vector_vm->heap.object_count == 2);
+  object_t *moved = snek_add(vector_vm, position, velocity);
+  assert(vector_vm->heap.object_count == 3);
+  assert(moved->data.v_vector3.is_float);
+  assert(snek_float_value(snek_vector3_get(moved, 2)) == -2.0f);
+  for (int i = 0; i < 1000; i++) {
+    assert(snek_vector3_add_into(position, position, velocity));
+  }
+  assert(vector_vm->heap.object_count == 3);
+  assert(snek_float_value(snek_vector3_get(position, 0)) == 500.0f);
+  assert(snek_float_value(snek_vector3_get(position, 1)) == 1000.0f);
+  assert(!snek_vector3_add_into(position, position, zero));
+  printf("inline vector test passed (objects=%zu)\n",
+         vector_vm->heap.object_count);
+  vm_free(vector_vm);
+
+  // Test generational collection: temporaries die in a minor collection that
+  // never looks at the old objects, and the write barrier keeps a young object
+  // alive when only an old one points to it
+  vm_t *gen_vm = vm_new();
+  frame_t *gen_frame = vm_new_frame(gen_vm);
+  object_t *old_list = new_snek_array(gen_vm, 1);
+  frame_reference_object(gen_frame, old_list);
+  vm_set_generational(gen_vm, true, 2);
+  assert(old_list->is_old);
+  for (int i = 0; i < 1000; i++) {
+    snek_add(gen_vm, new_snek_string(gen_vm, "tmp"),
+             new_snek_string(gen_vm, "!"));
+  }
+  assert(gen_vm->heap.object_count == 3001);
+  vm_collect_young(gen_vm);
+  assert(gen_vm->heap.object_count == 1 && gen_vm->young->count == 0);
+
+  object_t *young = new_snek_string(gen_vm, "young");
+  assert(snek_array_set(old_list, 0, young));
+  assert(old_list->is_remembered && gen_vm->remembered->count == 1);
+  vm_collect_young(gen_vm);
+  assert(gen_vm->heap.object_count == 2);
+  assert(young->age == 1 && !young->is_old);
+  vm_collect_young(gen_vm);
+  assert(young->is_old && gen_vm->young->count == 0);
+  assert(!old_list->is_remembered && gen_vm->remembered->count == 0);
+
+  // old garbage is only freed by a full collection
+  assert(snek_array_set(old_list, 0, new_snek_integer(gen_vm, 0)));
+  vm_collect_young(gen_vm);
+  assert(gen_vm->heap.object_count == 2);
+  vm_collect_garbage(gen_vm);
+  assert(gen_vm->heap.object_count == 1);
+  printf("generational gc test passed (objects=%zu)\n",
+         gen_vm->heap.object_count);
+  vm_free(gen_vm);
+
+  // Test incremental collection: the cycle advances a bounded amount per step
+  // and the program may change the heap between the steps
+  vm_t *inc_vm = vm_new();
+  frame_t *inc_frame = vm_new_frame(inc_vm);
+  object_t *roots = new_snek_array(inc_vm, 2);
+  object_t *holder = new_snek_array(inc_vm, 1);
+  object_t *receiver = new_snek_array(inc_vm, 1);
+  object_t *moved_string = new_snek_string(inc_vm, "moved while marking");
+  snek_array_set(roots, 0, holder);
+  snek_array_set(roots, 1, receiver);
+  snek_array_set(holder, 0, moved_string);
+  frame_reference_object(inc_frame, roots);
+  for (int i = 0; i < 1000; i++) {
+    new_snek_string(inc_vm, "garbage");
+  }
+
+  // blacken roots, then receiver (it was grayed last), holder is still gray
+  assert(!vm_collect_garbage_step(inc_vm, 1));
+  assert(!vm_collect_garbage_step(inc_vm, 1));
+  assert(gc_is_marked(receiver) && !gc_is_marked(moved_string));
+  // move the string from the gray holder into the black receiver, without the
+  // barrier nothing would ever mark it
+  snek_array_set(receiver, 0, moved_string);
+  snek_array_set(holder, 0, new_snek_integer(inc_vm, 0));
+  assert(gc_is_marked(moved_string));
+
+  // finish marking and sweep part of the heap, objects allocated now survive
+  // the cycle no matter on which side of the sweep they end up
+  while (inc_vm->gc_phase != GC_SWEEPING) {
+    vm_collect_garbage_step(inc_vm, 1);
+  }
+  object_t *during_sweep = new_snek_string(inc_vm, "allocated while sweeping");
+  frame_reference_object(inc_frame, during_sweep);
+  size_t steps = 0;
+  while (!vm_collect_garbage_step(inc_vm, 64)) {
+    steps++;
+  }
+  assert(steps > 1 && inc_vm->gc_phase == GC_IDLE);
+  assert(inc_vm->heap.object_count == 5);
+  assert(strcmp(snek_string_chars(moved_string), "moved while marking") == 0);
+  assert(!gc_is_marked(during_sweep) && !gc_is_marked(moved_string));
+
+  // a full collection finishes a cycle that is still running first
+  new_snek_string(inc_vm, "garbage");
+  vm_collect_garbage_step(inc_vm, 1);
+  vm_collect_garbage(inc_vm);
+  assert(inc_vm->gc_phase == GC_IDLE && inc_vm->heap.object_count == 5);
+  printf("incremental gc test passed (sweep steps=%zu)\n", steps);
+  vm_free(inc_vm);
+
+  // Test parallel marking: a wide graph of arrays is marked by 4 threads and
+  // the collection keeps exactly what a serial one keeps
+  vm_t *par_vm = vm_new();
+  vm_set_mark_threads(par_vm, 4);
+  object_t *wide = new_snek_array(par_vm, 2000);
+  frame_reference_object(vm_new_frame(par_vm), wide);
+  for (size_t i = 0; i < 2000; i++) {
+    object_t *row = new_snek_array(par_vm, 4);
+    snek_array_set(wide, i, row);
+    for (size_t j = 0; j < 4; j++) {
+      // every row shares its first element with the previous row, so the
+      // workers race for the same objects
+      object_t *cell = j == 0 && i > 0
+                           ? snek_array_get(snek_array_get(wide, i - 1), 1)
+                           : new_snek_string(par_vm, "cell");
+      snek_array_set(row, j, cell);
+    }
+    new_snek_string(par_vm, "garbage");
+  }
+  size_t reachable = 1 + 2000 + 4 + 1999 * 3;
+  assert(par_vm->heap.object_count == reachable + 2000);
+  vm_collect_garbage(par_vm);
+  assert(par_vm->heap.object_count == reachable);
+  // the sweep left every mark bitmap cleared for the next cycle
+  for (slab_page_t *page = par_vm->heap.pages; page != NULL;
+       page = page->next) {
+    for (size_t w = 0; w < SLAB_PAGE_BITMAP_WORDS; w++) {
+      assert(page->marked[w] == 0);
+    }
+  }
+  vm_set_mark_threads(par_vm, 1);
+  vm_collect_garbage(par_vm);
+  assert(par_vm->heap.object_count == reachable);
+  printf("parallel mark test passed (objects=%zu)\n",
+         par_vm->heap.object_count);
+  vm_free(par_vm);
+
+  // Test lazy sweeping: the collection only marks, the allocations after it
+  // sweep the garbage bit by bit and reuse its slots
+  vm_t *lazy_vm = vm_new();
+  vm_set_sweep_mode(lazy_vm, SWEEP_LAZY, 1);
+  object_t *kept = new_snek_string(lazy_vm, "kept");
+  frame_reference_object(vm_new_frame(lazy_vm), kept);
+  for (int i = 0; i < 5000; i++) {
+    new_snek_string(lazy_vm, "garbage");
+  }
+  size_t lazy_pages = lazy_vm->heap.page_count;
+  vm_collect_garbage(lazy_vm);
+  assert(lazy_vm->gc_phase == GC_SWEEPING);
+  assert(lazy_vm->heap.object_count == 5001); // nothing swept yet
+  object_t *fresh = NULL;
+  size_t allocations = 0;
+  while (lazy_vm->gc_phase == GC_SWEEPING) {
+    fresh = new_snek_string(lazy_vm, "fresh");
+    allocations++;
+  }
+  // the fresh strings went into freed slots, the heap didn't grow
+  assert(lazy_vm->heap.page_count == lazy_pages);
+  assert(lazy_vm->heap.object_count == 1 + allocations);
+  assert(strcmp(snek_string_chars(kept), "kept") == 0);
+  assert(strcmp(snek_string_chars(fresh), "fresh") == 0);
+  // a collection finishes a lazy sweep that is still going first
+  vm_collect_garbage(lazy_vm);
+  new_snek_string(lazy_vm, "one more");
+  vm_collect_garbage(lazy_vm);
+  vm_collect_garbage_finish(lazy_vm);
+  assert(lazy_vm->heap.object_count == 1);
+  printf("lazy sweep test passed (allocations=%zu)\n", allocations);
+  vm_free(lazy_vm);
+
+  // Test parallel sweeping: 4 threads sweep their own pages, dead interned
+  // strings leave the table before any of them is freed
+  vm_t *psweep_vm = vm_new();
+  vm_set_string_interning(psweep_vm, true);
+  vm_set_sweep_mode(psweep_vm, SWEEP_PARALLEL, 4);
+  object_t *survivors = new_snek_array(psweep_vm, 0);
+  frame_reference_object(vm_new_frame(psweep_vm), survivors);
+  char label[32];
+  for (int i = 0; i < 20000; i++) {
+    snprintf(label, sizeof(label), "string %d", i);
+    object_t *str = new_snek_string(psweep_vm, label);
+    if (i % 4 == 0) {
+      snek_array_push(survivors, str);
+    }
+  }
+  assert(psweep_vm->heap.page_count >= PARALLEL_SWEEP_MIN_PAGES);
+  vm_collect_garbage(psweep_vm);
+  assert(psweep_vm->heap.object_count == 1 + 5000);
+  assert(psweep_vm->strings.count == 5000);
+  // the freed strings can be interned again, the survivors are still found
+  object_t *string_8 = new_snek_string(psweep_vm, "string 8");
+  assert(string_8 == snek_array_get(survivors, 2));
+  object_t *again = new_snek_string(psweep_vm, "string 9");
+  assert(strcmp(snek_string_chars(again), "string 9") == 0);
+  assert(psweep_vm->strings.count == 5001);
+  printf("parallel sweep test passed (pages=%zu)\n",
+         psweep_vm->heap.page_count);
+  vm_free(psweep_vm);
+
+  // Test automatic collection: with pacing on the heap stops growing even
+  // though nobody calls vm_collect_garbage(), with it off nothing is freed
+  vm_t *paced_vm = vm_new();
+  vm_set_gc_pacing(paced_vm, 100, 64 * 1024);
+  object_t *paced_root = new_snek_array(paced_vm, 0);
+  frame_reference_object(vm_new_frame(paced_vm), paced_root);
+  for (int i = 0; i < 100000; i++) {
+    object_t *temporary = new_snek_string(paced_vm, "a temporary string that "
+                                                    "lives on the heap");
+    if (i % 1000 == 0) {
+      snek_array_push(paced_root, temporary);
+    }
+  }
+  assert(paced_vm->heap.page_count < 10);
+  assert(paced_vm->gc_live_bytes > 0);
+  assert(paced_vm->gc_trigger == 64 * 1024); // the live heap is tiny
+  assert(snek_len(paced_root) == 100);
+  assert(strcmp(snek_string_chars(snek_array_get(paced_root, 99)),
+                "a temporary string that lives on the heap") == 0);
+  vm_set_gc_pacing(paced_vm, 0, 0);
+  size_t paced_pages = paced_vm->heap.page_count;
+  for (int i = 0; i < 10000; i++) {
+    new_snek_string(paced_vm, "kept until the next collection");
+  }
+  assert(paced_vm->heap.page_count > paced_pages);
+  // growing a buffer only counts the bytes it grew by
+  object_t *grown_array = new_snek_array(paced_vm, 8);
+  size_t allocated_before = paced_vm->gc_allocated_bytes;
+  assert(snek_array_reserve(grown_array, 16));
+  assert(paced_vm->gc_allocated_bytes - allocated_before ==
+         8 * sizeof(object_t *));
+  printf("gc pacing test passed (pages=%zu, allocated=%zu bytes)\n",
+         paced_vm->heap.page_count, paced_vm->gc_allocated_bytes);
+  vm_free(paced_vm);
+
+  // Test roots outside of the frames: a global variable, a handle and a root
+  // source that reports the objects of a C struct
+  vm_t *roots_vm = vm_new();
+  object_t *global = new_snek_string(roots_vm, "global");
+  vm_add_global(roots_vm, &global);
+  snek_handle_t *handle = vm_new_handle(roots_vm, new_snek_array(roots_vm, 1));
+  snek_array_set(handle->obj, 0, new_snek_string(roots_vm, "in the handle"));
+  snek_handle_t *dropped = vm_new_handle(roots_vm, new_snek_array(roots_vm, 0));
+  interpreter_stack_t interpreter = {.count = 2};
+  interpreter.values[0] = new_snek_string(roots_vm, "on the stack");
+  interpreter.values[1] = new_snek_integer(roots_vm, 7);
+  vm_add_roots(roots_vm, interpreter_roots, &interpreter);
+  for (int i = 0; i < 100; i++) {
+    new_snek_string(roots_vm, "garbage");
+  }
+  vm_free_handle(roots_vm, dropped);
+  vm_collect_garbage(roots_vm);
+  // global, the handle's array and its string, the string on the stack
+  assert(roots_vm->heap.object_count == 4);
+  assert(strcmp(snek_string_chars(global), "global") == 0);
+  // the global is read at collection time, not when it was added
+  global = new_snek_string(roots_vm, "replaced");
+  vm_remove_roots(roots_vm, interpreter_roots, &interpreter);
+  vm_collect_garbage(roots_vm);
+  assert(roots_vm->heap.object_count == 3);
+  vm_remove_global(roots_vm, &global);
+  vm_free_handle(roots_vm, handle);
+  vm_collect_garbage(roots_vm);
+  assert(roots_vm->heap.object_count == 0);
+  printf("roots test passed\n");
+  vm_free(roots_vm);
+
+  // Test compaction: after most objects died the survivors are spread over
+  // many pages, vm_compact() packs them in a few and updates every reference
+  vm_t *compact_vm = vm_new();
+  vm_set_string_interning(compact_vm, true);
+  object_t *table = new_snek_array(compact_vm, 0);
+  frame_t *compact_frame = vm_new_frame(compact_vm);
+  frame_reference_object(compact_frame, table);
+  object_t *pinned = NULL;
+  for (int i = 0; i < 20000; i++) {
+    snprintf(label, sizeof(label), "row %d", i);
+    object_t *row = new_snek_array(compact_vm, 2);
+    snek_array_set(row, 0, new_snek_string(compact_vm, label));
+    snek_array_set(row, 1, new_snek_integer(compact_vm, i));
+    if (i % 50 == 0) {
+      snek_array_push(table, row);
+    }
+    if (i == 1000) {
+      pinned = row;
+      vm_pin(compact_vm, pinned);
+    }
+  }
+  vm_collect_garbage(compact_vm);
+  size_t fragmented_pages = compact_vm->heap.page_count;
+  object_t *moved_global = snek_array_get(table, 1);
+  vm_add_global(compact_vm, &moved_global);
+  snek_handle_t *moved_handle =
+      vm_new_handle(compact_vm, snek_array_get(table, 2));
+  vm_compact(compact_vm);
+  // C variables that are not roots still point to the old address, the table
+  // has to be read from its frame again
+  assert(compact_frame->references[0] != table);
+  table = compact_frame->references[0];
+  assert(compact_vm->heap.object_count == 1 + 400 * 2);
+  // the pinned row's page is kept (it is one of the 20 rows that survived)
+  assert(compact_vm->heap.page_count < fragmented_pages);
+  assert(snek_array_get(table, 20) == pinned);
+  assert(moved_global == snek_array_get(table, 1));
+  assert(moved_handle->obj == snek_array_get(table, 2));
+  // the elements of the table were copied one after the other (except where
+  // a page is full)
+  size_t adjacent = 0;
+  for (size_t i = 1; i < 400; i++) {
+    adjacent += snek_array_get(table, i) == snek_array_get(table, i - 1) + 1;
+  }
+  assert(adjacent >= 395);
+  for (size_t i = 0; i < 400; i++) {
+    object_t *row = snek_array_get(table, i);
+    snprintf(label, sizeof(label), "row %zu", i * 50);
+    assert(strcmp(snek_string_chars(snek_array_get(row, 0)), label) == 0);
+    assert(snek_int_value(snek_array_get(row, 1)) == (int)i * 50);
+    // the intern table found the moved strings
+    assert(new_snek_string(compact_vm, label) == snek_array_get(row, 0));
+  }
+  vm_remove_global(compact_vm, &moved_global);
+  vm_free_handle(compact_vm, moved_handle);
+  // every second collection compacts from now on
+  vm_set_compaction(compact_vm, 2);
+  vm_collect_garbage(compact_vm);
+  vm_collect_garbage(compact_vm);
+  assert(compact_vm->heap.object_count == 1 + 400 * 2);
+  printf("compaction test passed (pages %zu -> %zu)\n", fragmented_pages,
+         compact_vm->heap.page_count);
+  vm_free(compact_vm);
+
+  // Test compaction together with pacing: the automatic collections happen
+  // inside snek_add, snek_scale, snek_array_reserve and the constructors,
+  // which still use the pointers they were given, so they never move
+  // anything. The compaction they were due for waits for vm_collect_garbage()
+  vm_t *moving_vm = vm_new();
+  vm_set_gc_pacing(moving_vm, 100, 1);
+  vm_set_compaction(moving_vm, 1);
+  frame_t *moving_frame = vm_new_frame(moving_vm);
+  frame_reference_object(
+      moving_frame,
+      new_snek_string(moving_vm, "a string that does not fit inline, "));
+  frame_reference_object(moving_frame,
+                         new_snek_string(moving_vm, "and neither does this"));
+  frame_reference_object(moving_frame,
+                         new_snek_int_array(moving_vm, NULL, 64));
+  frame_reference_object(moving_frame, new_snek_array(moving_vm, 0));
+  size_t moving_collections = moving_vm->full_collections;
+  for (int i = 0; i < 1000; i++) {
+    object_t **refs = moving_frame->references;
+    object_t *joined = snek_add(moving_vm, refs[0], refs[1]);
+    assert(strcmp(snek_string_chars(joined),
+                  "a string that does not fit inline, "
+                  "and neither does this") == 0);
+    assert(snek_len(snek_add(moving_vm, refs[2], refs[2])) == 64);
+    object_t *two = new_snek_integer(moving_vm, 2);
+    assert(snek_len(snek_scale(moving_vm, refs[2], two)) == 64);
+    assert(snek_array_reserve(refs[3], (size_t)i + 1));
+  }
+  assert(moving_vm->full_collections > moving_collections + 10);
+  assert(moving_vm->compact_pending);
+  vm_collect_garbage(moving_vm);
+  assert(!moving_vm->compact_pending);
+  assert(snek_len(moving_frame->references[0]) == 35);
+  printf("compaction with pacing test passed (%zu collections)\n",
+         moving_vm->full_collections - moving_collections);
+  vm_free(moving_vm);
+
+  // telemetry: every kind of cycle reports what it freed and kept
+  vm_t *stats_vm = vm_new();
+  FILE *gc_log = tmpfile();
+  vm_set_gc_log(stats_vm, gc_log);
+  frame_t *stats_frame = vm_new_frame(stats_vm);
+  object_t *stats_kept = new_snek_array(stats_vm, 100);
+  frame_reference_object(stats_frame, stats_kept);
+  for (size_t i = 0; i < 100; i++) {
+    snek_array_set(stats_kept, i, new_snek_array(stats_vm, 0));
+  }
+  for (size_t i = 0; i < 1000; i++) {
+    new_snek_array(stats_vm, 4);
+  }
+  vm_collect_garbage(stats_vm);
+  const gc_telemetry_t *telemetry = vm_gc_telemetry(stats_vm);
+  assert(telemetry->cycles == 1);
+  assert(telemetry->last.kind == GC_CYCLE_FULL);
+  assert(telemetry->last.objects_freed == 1000);
+  assert(telemetry->last.bytes_freed ==
+         1000 * (sizeof(object_t) + 4 * sizeof(object_t *)));
+  assert(telemetry->last.survivors == 101);
+  assert(telemetry->last.pauses == 1);
+  assert(telemetry->last.gray_high_water >= 1);
+  assert(telemetry->last.pause_ns >= telemetry->last.sweep_ns);
+  // an incremental cycle is paused many times
+  for (size_t i = 0; i < 500; i++) {
+    new_snek_array(stats_vm, 0);
+  }
+  while (!vm_collect_garbage_step(stats_vm, 64)) {
+  }
+  assert(telemetry->cycles == 2);
+  assert(telemetry->last.pauses > 1);
+  assert(telemetry->last.objects_freed == 500);
+  // a lazy sweep ends with an allocation
+  vm_set_sweep_mode(stats_vm, SWEEP_LAZY, 1);
+  for (size_t i = 0; i < 200; i++) {
+    new_snek_array(stats_vm, 0);
+  }
+  vm_collect_garbage(stats_vm);
+  assert(telemetry->cycles == 2);
+  while (stats_vm->gc_phase != GC_IDLE) {
+    frame_reference_object(stats_frame, new_snek_array(stats_vm, 0));
+  }
+  assert(telemetry->cycles == 3);
+  assert(telemetry->last.objects_freed == 200);
+  vm_set_sweep_mode(stats_vm, SWEEP_EAGER, 1);
+  vm_compact(stats_vm);
+  assert(telemetry->cycles == 4);
+  assert(telemetry->last.kind == GC_CYCLE_COMPACT);
+  assert(telemetry->last.objects_freed == 0);
+  assert(telemetry->last.survivors == stats_vm->heap.object_count);
+  vm_set_generational(stats_vm, true, 2);
+  for (size_t i = 0; i < 10; i++) {
+    new_snek_array(stats_vm, 0);
+  }
+  vm_collect_young(stats_vm);
+  assert(telemetry->cycles == 5);
+  assert(telemetry->last.kind == GC_CYCLE_YOUNG);
+  assert(telemetry->last.objects_freed == 10);
+  size_t histogram_pauses = 0;
+  for (size_t i = 0; i < GC_PAUSE_BUCKETS; i++) {
+    histogram_pauses += telemetry->pause_histogram[i];
+  }
+  assert(histogram_pauses == telemetry->pauses);
+  uint64_t p99 = vm_gc_pause_percentile(stats_vm, 99);
+  assert(p99 > 0 && p99 <= telemetry->max_pause_ns);
+  assert(vm_gc_pause_percentile(stats_vm, 50) <= p99);
+  // one line per cycle
+  rewind(gc_log);
+  size_t log_lines = 0;
+  for (int c = fgetc(gc_log); c != EOF; c = fgetc(gc_log)) {
+    log_lines += c == '\n';
+  }
+  assert(log_lines == telemetry->cycles);
+  fclose(gc_log);
+  printf("telemetry test passed (%zu cycles, %zu pauses, p99 %lluns)\n",
+         telemetry->cycles, telemetry->pauses, (unsigned long long)p99);
+  vm_free(stats_vm);
+
+  // weak references, ephemerons and finalizers
+  vm_t *weak_vm = vm_new();
+  frame_t *weak_frame = vm_new_frame(weak_vm);
+  object_t *cache = new_snek_ephemeron_table(weak_vm);
+  object_t *cache_key = new_snek_array(weak_vm, 0);
+  object_t *memoized = new_snek_string(weak_vm, "a big memoized result");
+  object_t *weak = new_snek_weakref(weak_vm, memoized);
+  frame_reference_object(weak_frame, cache);
+  frame_reference_object(weak_frame, weak);
+  size_t weak_scope = weak_frame->count;
+  frame_reference_object(weak_frame, cache_key);
+  assert(snek_ephemeron_set(cache, cache_key, memoized));
+  // the value of one entry is the key of the next one
+  assert(snek_ephemeron_set(cache, memoized, new_snek_array(weak_vm, 0)));
+  // a value that references its own key doesn't keep the key alive
+  object_t *cyclic_key = new_snek_array(weak_vm, 0);
+  object_t *cyclic_value = new_snek_array(weak_vm, 1);
+  snek_array_set(cyclic_value, 0, cyclic_key);
+  assert(snek_ephemeron_set(cache, cyclic_key, cyclic_value));
+  vm_collect_garbage(weak_vm);
+  assert(snek_len(cache) == 2);
+  assert(snek_ephemeron_get(cache, cache_key) == memoized);
+  assert(snek_kind(snek_ephemeron_get(cache, memoized)) == ARRAY);
+  assert(snek_weakref_get(weak) == memoized);
+  assert(weak_vm->heap.object_count == 5);
+  // the compaction moves the keys, the table is rebuilt
+  vm_compact(weak_vm);
+  cache = weak_frame->references[0];
+  weak = weak_frame->references[1];
+  cache_key = weak_frame->references[weak_scope];
+  memoized = snek_weakref_get(weak);
+  assert(snek_ephemeron_get(cache, cache_key) == memoized);
+  assert(strcmp(snek_string_chars(memoized), "a big memoized result") == 0);
+  assert(snek_kind(snek_ephemeron_get(cache, memoized)) == ARRAY);
+  // once the key is gone the whole chain goes with it
+  frame_drop_references(weak_frame, weak_scope);
+  vm_collect_garbage(weak_vm);
+  assert(snek_len(cache) == 0);
+  assert(snek_weakref_get(weak) == NULL);
+  assert(snek_weakref_get(NULL) == NULL);
+  assert(!snek_ephemeron_set(NULL, cache, cache));
+  assert(snek_ephemeron_get(NULL, cache) == NULL);
+  assert(!snek_ephemeron_remove(NULL, cache));
+  assert(!snek_ephemeron_remove(cache, NULL) && snek_len(cache) == 0);
+  assert(weak_vm->heap.object_count == 2);
+  // a finalizer keeps its object until it ran, weak references are cleared
+  size_t finalized = 0;
+  object_t *doomed = new_snek_string(weak_vm, "finalize me");
+  object_t *doomed_ref = new_snek_weakref(weak_vm, doomed);
+  frame_reference_object(weak_frame, doomed_ref);
+  assert(vm_register_finalizer(weak_vm, doomed, count_finalized, &finalized));
+  vm_collect_garbage(weak_vm);
+  assert(snek_weakref_get(doomed_ref) == NULL);
+  assert(weak_vm->heap.object_count == 4);
+  assert(finalized == 0);
+  assert(vm_run_finalizers(weak_vm) == 1);
+  assert(finalized == 1);
+  vm_collect_garbage(weak_vm);
+  assert(weak_vm->heap.object_count == 3);
+  assert(vm_run_finalizers(weak_vm) == 0);
+  // a minor collection clears weak references to young objects
+  vm_set_generational(weak_vm, true, 2);
+  object_t *young_weak =
+      new_snek_weakref(weak_vm, new_snek_array(weak_vm, 0));
+  frame_reference_object(weak_frame, young_weak);
+  vm_collect_young(weak_vm);
+  assert(snek_weakref_get(young_weak) == NULL);
+  // and so does an incremental cycle
+  vm_set_generational(weak_vm, false, 0);
+  object_t *inc_weak = new_snek_weakref(weak_vm, new_snek_array(weak_vm, 0));
+  frame_reference_object(weak_frame, inc_weak);
+  while (!vm_collect_garbage_step(weak_vm, 8)) {
+  }
+  assert(snek_weakref_get(inc_weak) == NULL);
+  printf("weak references test passed (finalized=%zu)\n", finalized);
+  vm_free(weak_vm);
+
+  // mutators: threads share one VM, each allocates from its own TLAB and the
+  // collections (paced or explicit, from any of them) stop all of them
+  vm_t *threads_vm = vm_new();
+  vm_set_gc_pacing(threads_vm, 100, 16 * 1024);
+  vm_set_generational(threads_vm, true, 2);
+  vm_set_string_interning(threads_vm, true);
+  assert(vm_attach_mutator(threads_vm) != NULL);
+  frame_t *threads_frame = vm_new_frame(threads_vm);
+  object_t *before = new_snek_string(threads_vm, "shared");
+  frame_reference_object(threads_frame, before);
+  pthread_t threads[4];
+  mutator_demo_t demos[4];
+  for (int i = 0; i < 4; i++) {
+    demos[i] = (mutator_demo_t){.vm = threads_vm, .id = i, .result = NULL};
+    assert(pthread_create(&threads[i], NULL, mutator_demo, &demos[i]) == 0);
+  }
+  // joining blocks, the collections of the others don't wait for this one
+  vm_blocking_begin(threads_vm);
+  for (int i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  vm_blocking_end(threads_vm);
+  size_t thread_collections = threads_vm->gc_telemetry.cycles;
+  assert(thread_collections > 0);
+  for (int i = 0; i < 4; i++) {
+    object_t *kept = demos[i].result->obj;
+    assert(snek_int_value(snek_array_get(kept, 0)) == i);
+    // every "shared" string is the one interned before the threads started
+    for (size_t k = 1; k < MUTATOR_KEPT; k++) {
+      assert(snek_array_get(kept, k) == threads_frame->references[0]);
+    }
+  }
+  vm_frame_pop(threads_vm);
+  vm_detach_mutator(threads_vm);
+  vm_collect_garbage(threads_vm);
+  // the 4 arrays and the shared string, the ints are immediates
+  assert(threads_vm->heap.object_count == 5);
+  for (int i = 0; i < 4; i++) {
+    vm_free_handle(threads_vm, demos[i].result);
+  }
+  vm_collect_garbage(threads_vm);
+  assert(threads_vm->heap.object_count == 0);
+  assert(vm_heap_stats(threads_vm)->live_bytes == 0);
+  printf("mutators test passed (%zu collections)\n", thread_collections);
+  vm_free(threads_vm);
+
+  // freeing a VM drops the mutator of the calling thread if it is still
+  // attached, the thread can attach to another VM afterwards
+  vm_t *undetached_vm = vm_new();
+  assert(vm_attach_mutator(undetached_vm) != NULL);
+  assert(new_snek_array(undetached_vm, 8) != NULL);
+  vm_free(undetached_vm);
+  assert(snek_current_mutator == NULL);
+  vm_t *reattached_vm = vm_new();
+  assert(vm_attach_mutator(reattached_vm) != NULL);
+  assert(new_snek_array(reattached_vm, 8) != NULL);
+  vm_detach_mutator(reattached_vm);
+  vm_free(reattached_vm);
+
+  // heap dumps: only what the roots reach is written, each object once
+  vm_t *dump_vm = vm_new();
+  frame_t *dump_frame = vm_new_frame(dump_vm);
+  object_t *outer = new_snek_array(dump_vm, 2);
+  object_t *inner = new_snek_array(dump_vm, 2);
+  frame_reference_object(dump_frame, outer);
+  frame_reference_object(dump_frame, inner);
+  snek_array_set(outer, 0, inner);
+  snek_array_set(outer, 1, new_snek_string(dump_vm, "a string on the heap"));
+  snek_array_set(inner, 0, new_snek_string(dump_vm, "short"));
+  snek_array_set(inner, 1, outer); // a cycle
+  new_snek_string(dump_vm, "garbage");
+  const char *dump_path = "snek-heap-demo.dump";
+  assert(vm_heap_dump(dump_vm, dump_path));
+  FILE *dump_file = fopen(dump_path, "rb");
+  char magic[8];
+  assert(fread(magic, 1, 8, dump_file) == 8);
+  assert(memcmp(magic, SNEK_HEAP_DUMP_MAGIC, 8) == 0);
+  uint64_t dumped = 0;
+  fseek(dump_file, -(long)sizeof(dumped), SEEK_END);
+  assert(fread(&dumped, sizeof(dumped), 1, dump_file) == 1);
+  fclose(dump_file);
+  remove(dump_path);
+  assert(dumped == 4);
+  // the marks of the walk are gone, a collection frees the garbage
+  vm_collect_garbage(dump_vm);
+  assert(dump_vm->heap.object_count == 4);
+  printf("heap dump test passed (%llu objects)\n", (unsigned long long)dumped);
+  vm_free(dump_vm);
+
+  // heap accounting: every object is counted in bytes per kind together with
+  // its buffers, a long string is much bigger than a vector
+  vm_t *bytes_vm = vm_new();
+  const heap_stats_t *heap_stats = vm_heap_stats(bytes_vm);
+  frame_t *bytes_frame = vm_new_frame(bytes_vm);
+  object_t *long_string =
+      new_snek_string(bytes_vm, "a string that does not fit inline");
+  assert(heap_stats->bytes[STRING] == sizeof(object_t) + 34);
+  object_t *pushed = new_snek_array(bytes_vm, 0);
+  frame_reference_object(bytes_frame, pushed);
+  assert(snek_array_push(pushed, long_string)); // grows to 4 elements
+  object_t *hundred_ints = new_snek_int_array(bytes_vm, NULL, 100);
+  frame_reference_object(bytes_frame, hundred_ints);
+  object_t *unit = new_snek_vector3(bytes_vm, new_snek_integer(bytes_vm, 0),
+                                    new_snek_integer(bytes_vm, 0),
+                                    new_snek_integer(bytes_vm, 1));
+  snek_add(bytes_vm, unit, unit); // garbage, counted until it is swept
+  assert(heap_stats->objects[VECTOR3] == 2);
+  assert(heap_stats->bytes[ARRAY] == sizeof(object_t) + 4 * sizeof(object_t *));
+  assert(heap_stats->bytes[INT_ARRAY] == sizeof(object_t) + 400);
+  size_t accounted = 5 * sizeof(object_t) + 34 + 4 * sizeof(object_t *) + 400;
+  assert(heap_stats->live_bytes == accounted);
+  vm_collect_garbage(bytes_vm);
+  assert(heap_stats->objects[VECTOR3] == 0);
+  assert(heap_stats->live_bytes == accounted - 2 * sizeof(object_t));
+  // the collector adds up the same number from the survivors
+  assert(heap_stats->live_bytes == bytes_vm->gc_live_bytes);
+  assert(heap_stats->peak_bytes == accounted);
+  vm_frame_pop(bytes_vm);
+  vm_collect_garbage(bytes_vm);
+  assert(heap_stats->live_bytes == 0);
+  printf("heap accounting test passed (peak %zu bytes)\n",
+         heap_stats->peak_bytes);
+  vm_free(bytes_vm);
+
   vm_free(test_vm);
 
   return 0;
 }
+#endif // SNEK_NO_MAIN
 
-object_t *new_snek_integer(int value) {
-  // allocate memory on the heap for the object
-  object_t *obj = malloc(sizeof(object_t));
-  if (obj == NULL) {
+object_t *new_snek_integer(vm_t *vm, int value) {
+  // the vm is not needed because nothing is allocated, we still take it so
+  // that every constructor has the same shape
+  (void)vm;
+
+  // integers are immediate values, nothing is allocated on the heap, the value
+  // and the INTEGER tag are packed into the pointer itself
+  uintptr_t bits = (uintptr_t)(uint32_t)value;
+  return (object_t *)((bits << 32) | SNEK_TAG_INTEGER);
+}
+
+object_t *new_snek_float(vm_t *vm, float value) {
+  (void)vm; // same as new_snek_integer(), nothing to allocate
+
+  // floats are immediate values too, we copy the bits of the float into an
+  // integer (memcpy is the well defined way to do that in C) and tag them
+  uint32_t float_bits;
+  memcpy(&float_bits, &value, sizeof(float_bits));
+  uintptr_t bits = (uintptr_t)float_bits;
+  return (object_t *)((bits << 32) | SNEK_TAG_FLOAT);
+}
+
+bool snek_is_immediate(object_t *obj) {
+  // real objects are aligned so their low bits are never set
+  return ((uintptr_t)obj & SNEK_TAG_MASK) != 0;
+}
+
+// the kind of any value, immediate or not, always use this instead of reading
+// obj->kind directly because immediates can't be dereferenced
+object_kind_t snek_kind(object_t *obj) {
+  switch ((uintptr_t)obj & SNEK_TAG_MASK) {
+  case SNEK_TAG_INTEGER:
+    return INTEGER;
+  case SNEK_TAG_FLOAT:
+    return FLOAT;
+  default:
+    return obj->kind;
+  }
+}
+
+int snek_int_value(object_t *obj) {
+  if (snek_is_immediate(obj)) {
+    return (int)(uint32_t)((uintptr_t)obj >> 32);
+  }
+  // a boxed integer, e.g. a zeroed object from new_snek_object()
+  return obj->data.v_int;
+}
+
+float snek_float_value(object_t *obj) {
+  if (snek_is_immediate(obj)) {
+    uint32_t float_bits = (uint32_t)((uintptr_t)obj >> 32);
+    float value;
+    memcpy(&value, &float_bits, sizeof(value));
+    return value;
+  }
+  return obj->data.v_float;
+}
+
+// the characters of a STRING no matter which of the 2 layouts it uses
+char *snek_string_chars(object_t *obj) {
+  if (snek_string_is_inline(obj)) {
+    return obj->data.v_string.inline_chars;
+  }
+  return obj->data.v_string.heap_chars;
+}
+
+bool snek_string_is_inline(object_t *obj) {
+  return obj->data.v_string.length <= SNEK_SMALL_STRING_MAX;
+}
+
+// FNV-1a, simple and good enough for short keys. It works on one byte at a
+// time so hashing 'a' and continuing with 'b' gives the same hash as hashing
+// the concatenation of both, snek_add relies on that
+#define INTERN_HASH_SEED 14695981039346656037ULL
+#define INTERN_HASH_PRIME 1099511628211ULL
+
+uint64_t intern_hash(uint64_t hash, const char *chars, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char)chars[i];
+    hash *= INTERN_HASH_PRIME;
+  }
+  return hash;
+}
+
+// look for an interned string whose characters are 'a' followed by 'b' ('b'
+// can be empty), this way snek_add can check for its result without building
+// it first
+object_t *intern_table_find(intern_table_t *table, uint64_t hash,
+                            const char *a, size_t a_length, const char *b,
+                            size_t b_length) {
+  if (table->count == 0) {
     return NULL;
   }
 
-  obj->kind = INTEGER;
-  obj->data.v_int = value;
+  size_t mask = table->capacity - 1;
+  // linear probing, walk from the home slot until we hit an empty one
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    intern_entry_t *entry = &table->entries[i];
+    if (entry->string == NULL) {
+      return NULL;
+    }
 
-  return obj;
+    object_t *string = entry->string;
+    if (entry->hash == hash &&
+        string->data.v_string.length == a_length + b_length) {
+      char *chars = snek_string_chars(string);
+      if (memcmp(chars, a, a_length) == 0 &&
+          memcmp(chars + a_length, b, b_length) == 0) {
+        return string;
+      }
+    }
+  }
+}
+
+bool intern_table_grow(intern_table_t *table) {
+  size_t new_capacity = table->capacity == 0 ? 64 : table->capacity * 2;
+  intern_entry_t *new_entries = calloc(new_capacity, sizeof(intern_entry_t));
+  if (new_entries == NULL) {
+    return false;
+  }
+
+  // put every string back at its place in the bigger table, the hashes are
+  // kept in the entries so we don't have to touch the characters
+  size_t mask = new_capacity - 1;
+  for (size_t i = 0; i < table->capacity; i++) {
+    intern_entry_t entry = table->entries[i];
+    if (entry.string == NULL) {
+      continue;
+    }
+    size_t slot = entry.hash & mask;
+    while (new_entries[slot].string != NULL) {
+      slot = (slot + 1) & mask;
+    }
+    new_entries[slot] = entry;
+  }
+
+  free(table->entries);
+  table->entries = new_entries;
+  table->capacity = new_capacity;
+  return true;
+}
+
+// add a string that is not in the table yet
+bool intern_table_insert(intern_table_t *table, uint64_t hash,
+                         object_t *string) {
+  // keep the table at most 3/4 full so the probe sequences stay short
+  if ((table->count + 1) * 4 > table->capacity * 3) {
+    if (!intern_table_grow(table)) {
+      return false;
+    }
+  }
+
+  size_t mask = table->capacity - 1;
+  size_t slot = hash & mask;
+  while (table->entries[slot].string != NULL) {
+    slot = (slot + 1) & mask;
+  }
+  table->entries[slot] = (intern_entry_t){.hash = hash, .string = string};
+  table->count++;
+  string->is_interned = true;
+
+  return true;
+}
+
+// remove a string that is about to be freed
+void intern_table_remove(intern_table_t *table, object_t *string) {
+  if (table->count == 0) {
+    return;
+  }
+
+  uint64_t hash = intern_hash(INTERN_HASH_SEED, snek_string_chars(string),
+                              string->data.v_string.length);
+  size_t mask = table->capacity - 1;
+  size_t slot = hash & mask;
+  while (table->entries[slot].string != string) {
+    if (table->entries[slot].string == NULL) {
+      return; // not in the table
+    }
+    slot = (slot + 1) & mask;
+  }
+
+  // backward shift deletion: move the entries after the hole back into it
+  // when that gets them closer to their home slot, so lookups never have to
+  // skip over deleted entries
+  size_t hole = slot;
+  for (size_t next = (hole + 1) & mask; table->entries[next].string != NULL;
+       next = (next + 1) & mask) {
+    size_t home = table->entries[next].hash & mask;
+    // distance from home to next vs from home to the hole (wrapping around)
+    if (((next - home) & mask) >= ((next - hole) & mask)) {
+      table->entries[hole] = table->entries[next];
+      hole = next;
+    }
+  }
+  table->entries[hole] = (intern_entry_t){.hash = 0, .string = NULL};
+  table->count--;
+  string->is_interned = false;
+}
+
+void intern_table_free(intern_table_t *table) {
+  free(table->entries);
+  *table = (intern_table_t){.count = 0, .capacity = 0, .entries = NULL};
+}
+
+// remove every string that marking did not reach, so that a parallel sweep can
+// free them without touching the (shared) table
+void intern_table_remove_unmarked(intern_table_t *table) {
+  for (size_t i = 0; i < table->capacity; i++) {
+    // the backward shift can move the next entry into slot i, check it again
+    while (table->entries[i].string != NULL &&
+           !gc_is_marked(table->entries[i].string)) {
+      intern_table_remove(table, table->entries[i].string);
+    }
+  }
+}
+
+// compare 2 strings, interned strings are the only copy of their characters so
+// for them comparing the pointers is enough
+bool snek_string_equals(object_t *a, object_t *b) {
+  if (a == b) {
+    return true;
+  }
+  if (a == NULL || b == NULL || snek_kind(a) != STRING ||
+      snek_kind(b) != STRING) {
+    return false;
+  }
+  if (a->is_interned && b->is_interned) {
+    return false;
+  }
+
+  size_t length = a->data.v_string.length;
+  return length == b->data.v_string.length &&
+         memcmp(snek_string_chars(a), snek_string_chars(b), length) == 0;
+}
+
+void vm_set_string_interning(vm_t *vm, bool enabled) {
+  // strings that were interned before stay in the table until they are freed,
+  // turning it off only means new strings don't look there anymore
+  vm->intern_strings = enabled;
 }
 
-object_t *new_snek_float(float value) {
-  // allocate memory on the heap for the object
-  object_t *obj = malloc(sizeof(object_t));
+// we make this a const char * to make it clear we do not intend to modify the
+// input
+object_t *new_snek_string(vm_t *vm, const char *value) {
+  // strlen() once here, after this the length travels with the string
+  size_t length = strlen(value);
+
+  // with interning turned on hand out the canonical copy if there is one
+  uint64_t hash = 0;
+  if (vm->intern_strings) {
+    hash = intern_hash(INTERN_HASH_SEED, value, length);
+    vm_lock(vm);
+    object_t *interned =
+        intern_table_find(&vm->strings, hash, value, length, "", 0);
+    vm_unlock(vm);
+    if (interned != NULL) {
+      // the table is weak, the string may already be considered garbage by
+      // an incremental cycle that is running
+      gc_shade_new_object(vm, interned);
+      return interned;
+    }
+  }
+
+  object_t *obj = _new_snek_string_buffer(vm, length);
   if (obj == NULL) {
     return NULL;
   }
 
-  obj->kind = FLOAT;
-  obj->data.v_float = value;
+  // copy value into the string (+1 to also copy the '\0')
+  memcpy(snek_string_chars(obj), value, length + 1);
+
+  // this is the first copy of these characters, it becomes the canonical one
+  // (if the table can't grow the string simply stays a regular string)
+  if (vm->intern_strings) {
+    return vm_intern(vm, hash, obj);
+  }
 
   return obj;
 }
 
-// we make this a const char * to make it clear we do not intend to modify the
-// input
-object_t *new_snek_string(const char *value) {
-  // allocate memory on the heap for the object
-  object_t *obj = malloc(sizeof(object_t));
+// create a STRING with room for 'length' bytes (and the '\0') but without
+// any characters yet, the caller fills them in, this lets snek_add build a
+// string in place instead of going through a temporary buffer
+object_t *_new_snek_string_buffer(vm_t *vm, size_t length) {
+  // allocate memory for the object from the VM heap
+  object_t *obj = _new_snek_object(vm);
   if (obj == NULL) {
     return NULL;
   }
@@ -400,71 +2220,183 @@ object_t *new_snek_string(const char *value) {
   obj->kind =
       STRING; // set type before allocating string data so we can
               // correctly clean this object even if the next malloc fails.
-
-  // allocate a second set of memory on the heap that will actually store the
-  // value of the string (char * / array of char)
-  obj->data.v_string = malloc(strlen(value) + 1);
-  if (obj->data.v_string == NULL) {
-    // we free the object here to make sure we don't leak memory if the
-    // secondary heap allocation for the actual string contents fails
-    free(obj);
-    return NULL;
+  obj->data.v_string.length = length;
+
+  // short strings fit inside the object, only long ones need a second set of
+  // memory on the heap that will actually store the value of the string
+  if (!snek_string_is_inline(obj)) {
+    obj->data.v_string.heap_chars = gc_realloc(vm, obj, NULL, 0, length + 1);
+    if (obj->data.v_string.heap_chars == NULL) {
+      // we free the object here to make sure we don't leak memory if the
+      // secondary heap allocation for the actual string contents fails, the
+      // slot goes straight back to its page
+      slab_release(&vm->heap, obj);
+      return NULL;
+    }
   }
-  // copy value into newly allocated char * object (also copies the '\0')
-  strcpy(obj->data.v_string, value);
+  gc_account(vm, obj, 0);
 
   return obj;
 }
 
 // a collection type object (similar to python's tuple that contains 3 elements)
-object_t *new_snek_vector3(object_t *x, object_t *y, object_t *z) {
-  if (x == NULL || y == NULL || z == NULL) {
-    return NULL;
+// the components have to be numbers, they are copied into the vector
+object_t *new_snek_vector3(vm_t *vm, object_t *x, object_t *y, object_t *z) {
+  object_t *components[3] = {x, y, z};
+  bool is_float = false;
+  for (size_t i = 0; i < 3; i++) {
+    if (components[i] == NULL) {
+      return NULL;
+    }
+    object_kind_t kind = snek_kind(components[i]);
+    if (kind != INTEGER && kind != FLOAT) {
+      return NULL;
+    }
+    is_float = is_float || kind == FLOAT;
   }
 
-  // allocate space on heap of the object
-  object_t *obj = malloc(sizeof(object_t));
+  // allocate space for the object from the VM heap
+  object_t *obj = _new_snek_object(vm);
   if (obj == NULL) {
     return NULL;
   }
 
   obj->kind = VECTOR3;
 
-  // assign each object inside the fields of the vector struct
-  obj->data.v_vector3.x = x;
-  obj->data.v_vector3.y = y;
-  obj->data.v_vector3.z = z;
-
-  // can also be represented with a compound literal instead of assigning each
-  // value individually
-  // obj->data.v_vector3 = (vector_t){.x = x, .y = y, .z = z};
+  // copy each number into the vector, ints are converted when one of the
+  // other components is a float
+  obj->data.v_vector3.is_float = is_float;
+  for (size_t i = 0; i < 3; i++) {
+    if (!is_float) {
+      obj->data.v_vector3.ints[i] = snek_int_value(components[i]);
+    } else if (snek_kind(components[i]) == FLOAT) {
+      obj->data.v_vector3.floats[i] = snek_float_value(components[i]);
+    } else {
+      obj->data.v_vector3.floats[i] = (float)snek_int_value(components[i]);
+    }
+  }
+  gc_account(vm, obj, 0);
 
   return obj;
 }
 
-object_t *new_snek_array(size_t size) {
-  // allocate space on heap for the object
-  object_t *obj = malloc(sizeof(object_t));
+// component 'axis' (0 = x, 1 = y, 2 = z) of a vector, handed out as an
+// immediate so nothing is allocated
+object_t *snek_vector3_get(object_t *obj, size_t axis) {
+  if (obj == NULL || snek_kind(obj) != VECTOR3 || axis >= 3) {
+    return NULL;
+  }
+
+  if (obj->data.v_vector3.is_float) {
+    return new_snek_float(NULL, obj->data.v_vector3.floats[axis]);
+  }
+  return new_snek_integer(NULL, obj->data.v_vector3.ints[axis]);
+}
+
+// out = a + b for 3 vectors that already exist, nothing is allocated so a
+// loop like 'position += velocity' can run without ever collecting garbage.
+// out can be a or b itself
+bool snek_vector3_add_into(object_t *out, object_t *a, object_t *b) {
+  if (out == NULL || a == NULL || b == NULL || snek_kind(out) != VECTOR3 ||
+      snek_kind(a) != VECTOR3 || snek_kind(b) != VECTOR3) {
+    return false;
+  }
+
+  vector_t *x = &a->data.v_vector3;
+  vector_t *y = &b->data.v_vector3;
+  // the sum is built on the side in case out is one of the inputs
+  vector_t sum = {.is_float = x->is_float || y->is_float};
+  for (size_t i = 0; i < 3; i++) {
+    if (!sum.is_float) {
+      sum.ints[i] = x->ints[i] + y->ints[i];
+      continue;
+    }
+    float x_i = x->is_float ? x->floats[i] : (float)x->ints[i];
+    float y_i = y->is_float ? y->floats[i] : (float)y->ints[i];
+    sum.floats[i] = x_i + y_i;
+  }
+
+  out->data.v_vector3 = sum;
+  return true;
+}
+
+object_t *new_snek_array(vm_t *vm, size_t size) {
+  // allocate space for the object from the VM heap
+  object_t *obj = _new_snek_object(vm);
   if (obj == NULL) {
     return NULL;
   }
 
+  // an empty array until the elements are there, gc_calloc() may collect and
+  // the slot still holds whatever its previous object left in it
+  obj->kind = ARRAY;
+  obj->data.v_array = (array_t){0};
+
   // allocate space for an array of pointers, each of size one object_t *
   // and the array itself of 'size' (from function argument)
   // use calloc to make sure they are initialized to zero values
-  object_t **array_of_pointers = calloc(size, sizeof(object_t *));
+  object_t **array_of_pointers =
+      gc_calloc(vm, obj, size, sizeof(object_t *));
   if (array_of_pointers == NULL) {
-    free(obj);
+    slab_release(&vm->heap, obj);
     return NULL;
   }
 
-  obj->kind = ARRAY;
-  obj->data.v_array = (array_t){.size = size, .elements = array_of_pointers};
+  obj->data.v_array = (array_t){
+      .size = size, .capacity = size, .elements = array_of_pointers};
   // instead of using a compounding literal we can also break it down into
   // separate rows :
   //
   // obj->data.v_array.size = size;
+  // obj->data.v_array.capacity = size;
   // obj->data.v_array.elements = array_of_pointers;
+  gc_account(vm, obj, 0);
+
+  return obj;
+}
+
+// an array of 'size' ints copied in one go from 'values', or all zeroes if
+// 'values' is NULL
+object_t *new_snek_int_array(vm_t *vm, const int32_t *values, size_t size) {
+  object_t *obj = _new_snek_typed_array(vm, INT_ARRAY, size);
+  if (obj != NULL && values != NULL) {
+    memcpy(obj->data.v_typed_array.ints, values, size * sizeof(int32_t));
+  }
+  return obj;
+}
+
+// same as new_snek_int_array() but for floats
+object_t *new_snek_float_array(vm_t *vm, const float *values, size_t size) {
+  object_t *obj = _new_snek_typed_array(vm, FLOAT_ARRAY, size);
+  if (obj != NULL && values != NULL) {
+    memcpy(obj->data.v_typed_array.floats, values, size * sizeof(float));
+  }
+  return obj;
+}
+
+// create a zeroed INT_ARRAY or FLOAT_ARRAY of 'size' numbers
+object_t *_new_snek_typed_array(vm_t *vm, object_kind_t kind, size_t size) {
+  // allocate space for the object from the VM heap
+  object_t *obj = _new_snek_object(vm);
+  if (obj == NULL) {
+    return NULL;
+  }
+
+  // empty until the numbers are there, same as in new_snek_array()
+  obj->kind = kind;
+  obj->data.v_typed_array = (typed_array_t){0};
+
+  // int32_t and float are both 4 bytes so one buffer size works for both,
+  // calloc gives us zeroes (which is also 0.0f for floats)
+  void *numbers = gc_calloc(vm, obj, size, sizeof(int32_t));
+  if (numbers == NULL) {
+    slab_release(&vm->heap, obj);
+    return NULL;
+  }
+
+  obj->data.v_typed_array.size = size;
+  obj->data.v_typed_array.ints = numbers; // same pointer for floats
+  gc_account(vm, obj, 0);
 
   return obj;
 }
@@ -475,7 +2407,29 @@ bool snek_array_set(object_t *obj, size_t index, object_t *value) {
     return false;
   }
 
-  if (obj->kind != ARRAY) {
+  object_kind_t kind = snek_kind(obj);
+  if (kind == INT_ARRAY || kind == FLOAT_ARRAY) {
+    // typed arrays store the number itself, not the (immediate) object
+    if (index >= obj->data.v_typed_array.size) {
+      return false;
+    }
+    object_kind_t value_kind = snek_kind(value);
+    if (kind == INT_ARRAY && value_kind == INTEGER) {
+      obj->data.v_typed_array.ints[index] = snek_int_value(value);
+      return true;
+    }
+    if (kind == FLOAT_ARRAY && value_kind == FLOAT) {
+      obj->data.v_typed_array.floats[index] = snek_float_value(value);
+      return true;
+    }
+    if (kind == FLOAT_ARRAY && value_kind == INTEGER) {
+      obj->data.v_typed_array.floats[index] = (float)snek_int_value(value);
+      return true;
+    }
+    return false; // a float doesn't fit in an INT_ARRAY, nor does a string
+  }
+
+  if (kind != ARRAY) {
     return false;
   }
 
@@ -487,6 +2441,7 @@ bool snek_array_set(object_t *obj, size_t index, object_t *value) {
 
   // set the the new 'value' in the array 'element' at 'index'
   obj->data.v_array.elements[index] = value;
+  vm_write_barrier(obj, value);
 
   return true;
 }
@@ -497,7 +2452,20 @@ object_t *snek_array_get(object_t *obj, size_t index) {
     return NULL;
   }
 
-  if (obj->kind != ARRAY) {
+  object_kind_t kind = snek_kind(obj);
+  if (kind == INT_ARRAY || kind == FLOAT_ARRAY) {
+    if (index >= obj->data.v_typed_array.size) {
+      return NULL;
+    }
+    // the number is handed out as an immediate so nothing is allocated (which
+    // is also why the constructors below don't need a vm)
+    if (kind == INT_ARRAY) {
+      return new_snek_integer(NULL, obj->data.v_typed_array.ints[index]);
+    }
+    return new_snek_float(NULL, obj->data.v_typed_array.floats[index]);
+  }
+
+  if (kind != ARRAY) {
     return NULL;
   }
 
@@ -511,22 +2479,107 @@ object_t *snek_array_get(object_t *obj, size_t index) {
   return obj->data.v_array.elements[index];
 }
 
-int snek_len(object_t *obj) {
-  if (obj == NULL) {
-    return -1;
+// make room for at least 'capacity' elements without changing the size
+bool snek_array_reserve(object_t *obj, size_t capacity) {
+  if (obj == NULL || snek_kind(obj) != ARRAY) {
+    return false;
   }
 
-  switch (obj->kind) {
-  case INTEGER:
-    return 1;
-  case FLOAT:
-    return 1;
+  if (capacity <= obj->data.v_array.capacity) {
+    return true; // already big enough
+  }
+
+  object_t **elements =
+      gc_realloc(slab_page_of(obj)->vm, obj, obj->data.v_array.elements,
+                 obj->data.v_array.capacity * sizeof(object_t *),
+                 capacity * sizeof(object_t *));
+  if (elements == NULL) {
+    return false; // the old elements are still there and untouched
+  }
+
+  size_t old_size = snek_object_size(obj);
+  obj->data.v_array.elements = elements;
+  obj->data.v_array.capacity = capacity;
+  gc_account(slab_page_of(obj)->vm, obj, old_size);
+  return true;
+}
+
+// grow the capacity geometrically so that adding N elements one at a time
+// only reallocates log(N) times, i.e. amortized O(1) per element
+bool snek_array_grow_for(object_t *obj, size_t extra) {
+  size_t needed = obj->data.v_array.size + extra;
+  if (needed <= obj->data.v_array.capacity) {
+    return true;
+  }
+
+  size_t new_capacity =
+      obj->data.v_array.capacity < 4 ? 4 : obj->data.v_array.capacity * 2;
+  if (new_capacity < needed) {
+    new_capacity = needed;
+  }
+  return snek_array_reserve(obj, new_capacity);
+}
+
+// append one element at the end of the array, in place
+bool snek_array_push(object_t *obj, object_t *value) {
+  if (obj == NULL || value == NULL || snek_kind(obj) != ARRAY) {
+    return false;
+  }
+
+  if (!snek_array_grow_for(obj, 1)) {
+    return false;
+  }
+
+  obj->data.v_array.elements[obj->data.v_array.size] = value;
+  obj->data.v_array.size++;
+  vm_write_barrier(obj, value);
+  return true;
+}
+
+// append all elements of 'other' at the end of the array, in place
+bool snek_array_extend(object_t *obj, object_t *other) {
+  if (obj == NULL || other == NULL || snek_kind(obj) != ARRAY ||
+      snek_kind(other) != ARRAY) {
+    return false;
+  }
+
+  // read the size of 'other' before growing, it may be the same array
+  size_t other_size = other->data.v_array.size;
+  if (!snek_array_grow_for(obj, other_size)) {
+    return false;
+  }
+
+  object_t **destination = obj->data.v_array.elements + obj->data.v_array.size;
+  memcpy(destination, other->data.v_array.elements,
+         other_size * sizeof(object_t *));
+  obj->data.v_array.size += other_size;
+  for (size_t i = 0; i < other_size; i++) {
+    vm_write_barrier(obj, destination[i]);
+  }
+  return true;
+}
+
+int snek_len(object_t *obj) {
+  if (obj == NULL) {
+    return -1;
+  }
+
+  switch (snek_kind(obj)) {
+  case INTEGER:
+    return 1;
+  case FLOAT:
+    return 1;
   case STRING:
-    return strlen(obj->data.v_string);
+    return obj->data.v_string.length;
   case VECTOR3:
     return 3;
   case ARRAY:
     return obj->data.v_array.size;
+  case INT_ARRAY:
+  case FLOAT_ARRAY:
+    return obj->data.v_typed_array.size;
+  case EPHEMERON_TABLE:
+    return obj->data.v_ephemerons.count;
   default:
     fprintf(stderr, "invalid object type");
     return -1;
@@ -535,23 +2588,28 @@ int snek_len(object_t *obj) {
 
 // dynamically add 2 things together, works for integers, floats, strings,
 // arrays, vector3
-object_t *snek_add(object_t *a, object_t *b) {
+object_t *snek_add(vm_t *vm, object_t *a, object_t *b) {
   if (a == NULL || b == NULL) {
     return NULL;
   }
 
-  switch (a->kind) {
+  // kinds are looked up once, a and b may be immediates
+  object_kind_t a_kind = snek_kind(a);
+  object_kind_t b_kind = snek_kind(b);
+
+  switch (a_kind) {
   case INTEGER:
-    if (b->kind == INTEGER) {
-      return new_snek_integer(a->data.v_int + b->data.v_int);
+    if (b_kind == INTEGER) {
+      return new_snek_integer(vm, snek_int_value(a) + snek_int_value(b));
     }
 
     // int + float = float
-    if (b->kind == FLOAT) {
+    if (b_kind == FLOAT) {
       // typecasting 'а' to a float here is optional since it will get promoted
       // to a float automatically, but I add it for visual clarity of what
       // happens
-      return new_snek_float((float)a->data.v_int + b->data.v_float);
+      return new_snek_float(vm, (float)snek_int_value(a) +
+                            snek_float_value(b));
     }
 
     return NULL; // if netither int nor float return because invalid operation
@@ -559,153 +2617,364 @@ object_t *snek_add(object_t *a, object_t *b) {
 
   case FLOAT:
     // float + int = float
-    if (b->kind == INTEGER) {
+    if (b_kind == INTEGER) {
       // typecasting 'b' to a float here is optional since it will get promoted
       // to a float automatically, but I add it for visual clarity of what
       // happens
-      return new_snek_float(a->data.v_float + (float)b->data.v_int);
+      return new_snek_float(vm, snek_float_value(a) +
+                            (float)snek_int_value(b));
     }
 
-    if (b->kind == FLOAT) {
-      return new_snek_float(a->data.v_float + b->data.v_float);
+    if (b_kind == FLOAT) {
+      return new_snek_float(vm, snek_float_value(a) + snek_float_value(b));
     }
 
     return NULL; // if netither int nor float return because invalid operation
                  // we can add only integers and floats together
 
   case STRING:
-    if (b->kind != STRING) {
+    if (b_kind != STRING) {
       return NULL; // only a string can be added to another string
     }
 
-    // Calculate the length of the new string by combining the length of the two
-    // strings (properly handling the null terminator)
+    // the lengths of both strings are cached so there is nothing to count,
+    // we create the result with exactly enough room and copy each input into
+    // it once, no temporary buffer and no second copy
     //
     // type should be size_t not int because we can hit issues with very large
-    // strings and size_t is what strlen() returns as a valid size
-    size_t len_of_combined_str =
-        strlen(a->data.v_string) + strlen(b->data.v_string) + 1; // +1 for '\0'
-
-    // Allocate memory for a new temporary string using calloc (to make sure it
-    // is also initialized)
-    char *temp_string = calloc(len_of_combined_str, sizeof(char));
-    if (temp_string == NULL) {
-      fprintf(stderr, "failed to allocate space for temp string");
-      return NULL;
+    // strings and size_t is the type of a valid size
+    size_t len_of_a = a->data.v_string.length;
+    size_t len_of_b = b->data.v_string.length;
+
+    // when interning, check if the result already exists before building it,
+    // the hash of the 2 parts is the same as the hash of the combined string
+    uint64_t hash = 0;
+    if (vm->intern_strings) {
+      hash = intern_hash(INTERN_HASH_SEED, snek_string_chars(a), len_of_a);
+      hash = intern_hash(hash, snek_string_chars(b), len_of_b);
+      vm_lock(vm);
+      object_t *interned =
+          intern_table_find(&vm->strings, hash, snek_string_chars(a), len_of_a,
+                            snek_string_chars(b), len_of_b);
+      vm_unlock(vm);
+      if (interned != NULL) {
+        gc_shade_new_object(vm, interned); // see new_snek_string()
+        return interned;
+      }
     }
 
-    // combine data from both arrays to a new one
-    //  we use strcpy the first time to just copy the first full aray into the
-    //  new one
-    //  than we use strcat to only append the contents of 'b' on top of
-    //  what was already added from 'a'
-    strcpy(temp_string, a->data.v_string);
-    strcat(temp_string, b->data.v_string);
+    object_t *combined_string =
+        _new_snek_string_buffer(vm, len_of_a + len_of_b);
+    if (combined_string == NULL) {
+      fprintf(stderr, "failed to allocate space for combined string");
+      return NULL;
+    }
 
-    // Create a new_snek_string and pass in the temporary string.
-    object_t *combined_string = new_snek_string(temp_string);
+    char *combined_chars = snek_string_chars(combined_string);
+    memcpy(combined_chars, snek_string_chars(a), len_of_a);
+    // and the contents of 'b' right after what was already added from 'a'
+    memcpy(combined_chars + len_of_a, snek_string_chars(b), len_of_b);
+    combined_chars[len_of_a + len_of_b] = '\0';
 
-    // Free the memory for the temporary string and return the new string
-    // object.
-    free(temp_string);
+    if (vm->intern_strings) {
+      return vm_intern(vm, hash, combined_string);
+    }
 
     return combined_string;
 
   case VECTOR3:
-    if (b->kind != VECTOR3) {
+    if (b_kind != VECTOR3) {
       return NULL;
     }
 
-    // Recursively call snek_add for each of the x, y, and z fields. For
-    // example, a vector [1,2,3]+[4,5,6] should result in a new vector [5,7,9].
-    object_t *result_of_x = snek_add(a->data.v_vector3.x, b->data.v_vector3.x);
-    if (!result_of_x) {
-      return NULL; // handle the case where recursive add may fail
-    }
-    object_t *result_of_y = snek_add(a->data.v_vector3.y, b->data.v_vector3.y);
-    if (!result_of_y) {
-      free(result_of_x); // if the second add fails for any reason we need to
-                         // free the memory that was allocated by the first add
-                         // otherwise we will leak it
-
-      return NULL; // handle the case where recursive add may fail
-    }
-    object_t *result_of_z = snek_add(a->data.v_vector3.z, b->data.v_vector3.z);
-    if (!result_of_z) {
-      // and in this case we have aleady allocated 2 obejcts, so we need to free
-      // both if the third allocation fails, so that we do not leak memory
-      free(result_of_x);
-      free(result_of_y);
-
-      return NULL; // handle the case where recursive add may fail
+    // the components are added directly into the new vector, e.g.
+    // [1,2,3]+[4,5,6] results in a new vector [5,7,9], the only allocation is
+    // the result itself so there is nothing to clean up if it fails
+    object_t *new_vector = _new_snek_object(vm);
+    if (new_vector == NULL) {
+      return NULL;
     }
-    object_t *new_vector =
-        new_snek_vector3(result_of_x, result_of_y, result_of_z);
+    new_vector->kind = VECTOR3;
+    snek_vector3_add_into(new_vector, a, b);
+    gc_account(vm, new_vector, 0);
     return new_vector;
 
   case ARRAY:
-    if (b->kind != ARRAY) {
+    if (b_kind != ARRAY) {
       return NULL;
     }
 
-    // Create a new_snek_array with the combined length of the two arrays.
+    // Create a new_snek_array with the combined length of the two arrays, it
+    // is created at its final size so it never has to grow.
     size_t len_of_combined_array = a->data.v_array.size + b->data.v_array.size;
-    object_t *new_combined_array = new_snek_array(len_of_combined_array);
-
-    // populate elements from array 'a' into the new array
-    for (size_t i = 0; i < a->data.v_array.size; i++) {
-      object_t *current_value_at_index_i = snek_array_get(a, i);
-      bool succes =
-          snek_array_set(new_combined_array, i, current_value_at_index_i);
-      if (!succes) {
-        fprintf(stderr, "failed to set value in array 'a' at index %zu", i);
-      }
+    object_t *new_combined_array = new_snek_array(vm, len_of_combined_array);
+    if (new_combined_array == NULL) {
+      return NULL;
     }
-    // offset is used to see how many elements have been addded so far from
-    // array 'a' and continue at the next free index, if we don't do this we
-    // sould start from i = 0 which will start overwriting the elements that
-    // have already been populated by 'a'
-
-    // populate elements from array 'b' into the new array
-    size_t offset = a->data.v_array.size;
-    for (size_t i = 0; i < b->data.v_array.size; i++) {
-      object_t *current_value_at_index_i = snek_array_get(b, i);
-      bool succes = snek_array_set(new_combined_array, offset + i,
-                                   current_value_at_index_i);
-      if (!succes) {
-        fprintf(stderr, "failed to set value in array 'b' at index %zu", i);
+
+    // copy the elements of 'a' and than the ones of 'b' right after them,
+    // one block copy per array instead of a get/set per element
+    object_t **combined_elements = new_combined_array->data.v_array.elements;
+    memcpy(combined_elements, a->data.v_array.elements,
+           a->data.v_array.size * sizeof(object_t *));
+    memcpy(combined_elements + a->data.v_array.size, b->data.v_array.elements,
+           b->data.v_array.size * sizeof(object_t *));
+
+    // while an incremental cycle is marking the new array is already black,
+    // its elements have to go through the barrier like any other store
+    if (vm->gc_phase == GC_MARKING) {
+      for (size_t i = 0; i < len_of_combined_array; i++) {
+        vm_write_barrier(new_combined_array, combined_elements[i]);
       }
     }
 
     return new_combined_array;
 
+  case INT_ARRAY:
+  case FLOAT_ARRAY:
+    // adding 2 typed arrays adds them element by element (like numpy does)
+    return snek_typed_array_binary(vm, SNEK_SIMD_ADD, a, b);
+
   default:
     fprintf(stderr, "invalid operation");
     return NULL;
   }
 }
 
+// element wise a - b of 2 typed arrays of the same size, see
+// snek_typed_array_binary
+object_t *snek_sub(vm_t *vm, object_t *a, object_t *b) {
+  return snek_typed_array_binary(vm, SNEK_SIMD_SUB, a, b);
+}
+
+// element wise a * b of 2 typed arrays of the same size, see
+// snek_typed_array_binary
+object_t *snek_mul(vm_t *vm, object_t *a, object_t *b) {
+  return snek_typed_array_binary(vm, SNEK_SIMD_MUL, a, b);
+}
+
+bool snek_is_typed_array(object_t *obj) {
+  if (obj == NULL) {
+    return false;
+  }
+
+  object_kind_t kind = snek_kind(obj);
+  return kind == INT_ARRAY || kind == FLOAT_ARRAY;
+}
+
+// element wise a op b of 2 typed arrays of the same size, int op int stays an
+// INT_ARRAY, as soon as one of them holds floats the result is a FLOAT_ARRAY.
+// The loops themselves are the kernels of snek-simd.h, the int side of a mixed
+// operation is first converted into the result buffer and then combined with
+// the float side in place
+object_t *snek_typed_array_binary(vm_t *vm, snek_simd_op_t op, object_t *a,
+                                  object_t *b) {
+  if (!snek_is_typed_array(a) || !snek_is_typed_array(b) ||
+      a->data.v_typed_array.size != b->data.v_typed_array.size) {
+    return NULL;
+  }
+
+  object_kind_t a_kind = snek_kind(a);
+  object_kind_t b_kind = snek_kind(b);
+  size_t size = a->data.v_typed_array.size;
+  object_kind_t result_kind =
+      (a_kind == INT_ARRAY && b_kind == INT_ARRAY) ? INT_ARRAY : FLOAT_ARRAY;
+  object_t *result = _new_snek_typed_array(vm, result_kind, size);
+  if (result == NULL) {
+    return NULL;
+  }
+
+  const snek_kernels_t *kernels = snek_kernels();
+  typed_array_t *x = &a->data.v_typed_array;
+  typed_array_t *y = &b->data.v_typed_array;
+  typed_array_t *out = &result->data.v_typed_array;
+  if (result_kind == INT_ARRAY) {
+    kernels->i32_binary(op, x->ints, y->ints, out->ints, size);
+  } else if (a_kind == FLOAT_ARRAY && b_kind == FLOAT_ARRAY) {
+    kernels->f32_binary(op, x->floats, y->floats, out->floats, size);
+  } else if (a_kind == INT_ARRAY) {
+    kernels->i32_to_f32(x->ints, out->floats, size);
+    kernels->f32_binary(op, out->floats, y->floats, out->floats, size);
+  } else {
+    kernels->i32_to_f32(y->ints, out->floats, size);
+    kernels->f32_binary(op, x->floats, out->floats, out->floats, size);
+  }
+
+  return result;
+}
+
+// every element of a typed array times a number, an INT_ARRAY scaled by an
+// INTEGER stays an INT_ARRAY, anything else gives a FLOAT_ARRAY
+object_t *snek_scale(vm_t *vm, object_t *array, object_t *factor) {
+  if (factor == NULL) {
+    return NULL;
+  }
+
+  object_kind_t factor_kind = snek_kind(factor);
+  if (!snek_is_typed_array(array) ||
+      (factor_kind != INTEGER && factor_kind != FLOAT)) {
+    return NULL;
+  }
+
+  size_t size = array->data.v_typed_array.size;
+  bool ints_only = snek_kind(array) == INT_ARRAY && factor_kind == INTEGER;
+  object_t *result =
+      _new_snek_typed_array(vm, ints_only ? INT_ARRAY : FLOAT_ARRAY, size);
+  if (result == NULL) {
+    return NULL;
+  }
+
+  const snek_kernels_t *kernels = snek_kernels();
+  typed_array_t *x = &array->data.v_typed_array;
+  typed_array_t *out = &result->data.v_typed_array;
+  if (ints_only) {
+    kernels->i32_scale(x->ints, snek_int_value(factor), out->ints, size);
+    return result;
+  }
+
+  float f = factor_kind == INTEGER ? (float)snek_int_value(factor)
+                                   : snek_float_value(factor);
+  if (snek_kind(array) == INT_ARRAY) {
+    kernels->i32_to_f32(x->ints, out->floats, size);
+    kernels->f32_scale(out->floats, f, out->floats, size);
+  } else {
+    kernels->f32_scale(x->floats, f, out->floats, size);
+  }
+
+  return result;
+}
+
+// the sum of all elements of a typed array, an INTEGER for an INT_ARRAY (it
+// wraps around on overflow) and a FLOAT for a FLOAT_ARRAY. Both are immediates
+// so nothing is allocated
+object_t *snek_sum(vm_t *vm, object_t *array) {
+  if (!snek_is_typed_array(array)) {
+    return NULL;
+  }
+
+  typed_array_t *x = &array->data.v_typed_array;
+  if (snek_kind(array) == INT_ARRAY) {
+    return new_snek_integer(vm, snek_kernels()->i32_sum(x->ints, x->size));
+  }
+  return new_snek_float(vm, snek_kernels()->f32_sum(x->floats, x->size));
+}
+
+// the dot product of 2 typed arrays of the same size, an INTEGER for 2
+// INT_ARRAYs and a FLOAT otherwise. A mixed dot product converts the ints into
+// a temporary buffer first, it is freed before returning
+object_t *snek_dot(vm_t *vm, object_t *a, object_t *b) {
+  if (!snek_is_typed_array(a) || !snek_is_typed_array(b) ||
+      a->data.v_typed_array.size != b->data.v_typed_array.size) {
+    return NULL;
+  }
+
+  const snek_kernels_t *kernels = snek_kernels();
+  typed_array_t *x = &a->data.v_typed_array;
+  typed_array_t *y = &b->data.v_typed_array;
+  size_t size = x->size;
+  if (snek_kind(a) == INT_ARRAY && snek_kind(b) == INT_ARRAY) {
+    return new_snek_integer(vm, kernels->i32_dot(x->ints, y->ints, size));
+  }
+  if (snek_kind(a) == FLOAT_ARRAY && snek_kind(b) == FLOAT_ARRAY) {
+    return new_snek_float(vm, kernels->f32_dot(x->floats, y->floats, size));
+  }
+
+  // the dot product is symmetric, so only which side holds the ints matters
+  typed_array_t *ints = snek_kind(a) == INT_ARRAY ? x : y;
+  typed_array_t *floats = snek_kind(a) == INT_ARRAY ? y : x;
+  float *converted = malloc((size > 0 ? size : 1) * sizeof(float));
+  if (converted == NULL) {
+    return NULL;
+  }
+  kernels->i32_to_f32(ints->ints, converted, size);
+  float dot = kernels->f32_dot(converted, floats->floats, size);
+  free(converted);
+
+  return new_snek_float(vm, dot);
+}
+
 object_t *_new_snek_object(vm_t *vm) {
-  // allocate and initialize an object on the heap, e.g. snek_integer,
+  if (vm == NULL) {
+    return NULL; // every object has to belong to a VM
+  }
+
+  // a thread sharing the VM allocates from its TLAB, see mutator_t
+  mutator_t *mutator = vm->threaded ? mutator_of(vm) : NULL;
+  if (mutator != NULL) {
+    vm_safepoint(vm);
+    object_t *obj = mutator_alloc(mutator);
+    if (obj == NULL && gc_emergency_collect(vm, NULL)) {
+      obj = mutator_alloc(mutator);
+    }
+    if (obj == NULL) {
+      return NULL;
+    }
+    mutator->allocated_objects++;
+    mutator->allocated_bytes += sizeof(object_t);
+
+    // vm_track_object() without touching the VM, the page is this thread's
+    slab_page_t *page = slab_page_of(obj);
+    size_t slot = (size_t)(obj - page->slots);
+    page->allocated[slot / 64] |= (uint64_t)1 << (slot % 64);
+    page->live++;
+    mutator->object_count++;
+    gc_set_marked(obj, false);
+    if (vm->generational) {
+      stack_push(mutator->young, obj);
+    }
+    return obj;
+  }
+
+  // collect by itself once enough was allocated, see vm_set_gc_pacing()
+  if (vm->gc_percent > 0 && vm->gc_phase == GC_IDLE &&
+      vm->gc_allocated_bytes >= vm->gc_trigger) {
+    gc_collect(vm, false);
+  }
+
+  // a lazy sweep is paid for by the allocations after the collection, a few
+  // slots each, and gives the allocator the slots it frees right away
+  if (vm->gc_phase == GC_SWEEPING && vm->sweep_mode == SWEEP_LAZY &&
+      sweep_pages(vm, LAZY_SWEEP_BUDGET)) {
+    gc_cycle_publish(vm);
+  }
+
+  // allocate and initialize an object from the VM heap, e.g. snek_integer,
   // snek_string, snek_array, etc
-  object_t *obj = calloc(1, sizeof(object_t));
+  object_t *obj = slab_alloc(&vm->heap);
+  if (obj == NULL && gc_emergency_collect(vm, NULL)) {
+    obj = slab_alloc(&vm->heap);
+  }
   if (obj == NULL) {
     return NULL;
   }
+  vm->gc_allocated_objects++;
+  vm->gc_allocated_bytes += sizeof(object_t);
 
   // track the object in the VM for garbage collection
   vm_track_object(vm, obj);
-  obj->is_marked = false;
+  gc_set_marked(obj, false);
+  gc_shade_new_object(vm, obj);
+
+  // new objects start young, minor collections only look at this list
+  if (vm->generational) {
+    stack_push(vm->young, obj);
+  }
 
   return obj;
 }
 
 // free an object from heap memory, while checking what type it is, if it is a
 // type that has nested objects, we would free those as well
-void snek_object_free(object_t *obj) {
+void snek_object_free(vm_t *vm, object_t *obj) {
+  snek_object_free_buffers(vm, obj);
+  slab_release(&vm->heap, obj);
+}
+
+// free what an object owns outside of its slot, the slot itself is left alone
+void snek_object_free_buffers(vm_t *vm, object_t *obj) {
   switch (obj->kind) {
   // int and float are simple because they don't have anything nested
-  // so we just have to call free(obj) on each of them
+  // so we just have to give their slot back to the slab
   case INTEGER:
     break;
   case FLOAT:
@@ -713,20 +2982,36 @@ void snek_object_free(object_t *obj) {
   // for string we have to also make sure that we first free the data inside
   // and only than can we free the obj
   case STRING:
-    free(obj->data.v_string);
+    // the intern table must not hand out a string that no longer exists
+    if (obj->is_interned) {
+      intern_table_remove(&vm->strings, obj);
+    }
+    // short strings are stored inside the object, nothing else to free
+    if (!snek_string_is_inline(obj)) {
+      free(obj->data.v_string.heap_chars);
+    }
     break;
-  // for refcount we had to free nested integer objects inside the vector but in
-  // mark and sweep GC we don't, we can just free the main object and let mark
-  // and sweep handle freeing the nested objects
+  // the components of a vector are stored inline, there is nothing else to
+  // free
   case VECTOR3:
     break;
   // for array we need to only free the elements array, mark and sweep GC will
   // handle freeing the nested objects inside each element
   case ARRAY:
     free(obj->data.v_array.elements);
+    break;
+  // typed arrays only have their buffer of numbers, no nested objects
+  case INT_ARRAY:
+  case FLOAT_ARRAY:
+    free(obj->data.v_typed_array.ints);
+    break;
+  // the referent is not owned by the weak reference
+  case WEAKREF:
+    break;
+  case EPHEMERON_TABLE:
+    free(obj->data.v_ephemerons.entries);
+    break;
   }
-
-  free(obj);
 }
 
 stack_t *stack_new(size_t capacity) {
@@ -834,7 +3119,55 @@ void *vm_new() {
   }
 
   vm->frames = stack_new(8);
-  vm->objects = stack_new(8);
+  vm->free_frames = NULL;
+  // the heap starts without any pages, the first allocation creates one
+  vm->heap = (heap_t){.vm = vm,
+                      .pages = NULL,
+                      .current = NULL,
+                      .page_count = 0,
+                      .object_count = 0};
+  vm->strings = (intern_table_t){.count = 0, .capacity = 0, .entries = NULL};
+  vm->intern_strings = false;
+  vm->generational = false;
+  vm->promotion_age = 0;
+  vm->young = stack_new(8);
+  vm->remembered = stack_new(8);
+  vm->gc_phase = GC_IDLE;
+  vm->gray = stack_new(8);
+  vm->sweep_page = NULL;
+  vm->sweep_slot = 0;
+  vm->mark_threads = 1;
+  vm->sweep_mode = SWEEP_EAGER;
+  vm->sweep_threads = 1;
+  vm->gc_percent = 0;
+  vm->gc_min_trigger = GC_DEFAULT_MIN_TRIGGER;
+  vm->gc_trigger = GC_DEFAULT_MIN_TRIGGER;
+  vm->gc_allocated_bytes = 0;
+  vm->gc_allocated_objects = 0;
+  vm->gc_live_bytes = 0;
+  vm->globals = stack_new(8);
+  vm->handles = stack_new(8);
+  vm->root_sources = stack_new(8);
+  vm->weak_objects = stack_new(8);
+  vm->finalizers = stack_new(8);
+  vm->pending_finalizers = stack_new(8);
+  vm->compact_every = 0;
+  vm->full_collections = 0;
+  vm->compact_pending = false;
+  memset(&vm->gc_cycle, 0, sizeof(vm->gc_cycle));
+  vm->gc_cycle_open = false;
+  memset(&vm->gc_telemetry, 0, sizeof(vm->gc_telemetry));
+  memset(&vm->heap_stats, 0, sizeof(vm->heap_stats));
+  vm->gc_log = getenv("SNEK_GC_LOG") != NULL ? stderr : NULL;
+  vm->threaded = false;
+  vm->mutators = stack_new(8);
+  pthread_mutex_init(&vm->lock, NULL);
+  pthread_mutex_init(&vm->safepoint_lock, NULL);
+  pthread_cond_init(&vm->safepoint_cond, NULL);
+  vm->mutators_running = 0;
+  vm->mutators_parked = 0;
+  vm->stop_requested = false;
+  vm->stop_depth = 0;
 
   return vm;
 }
@@ -861,233 +3194,2747 @@ void vm_free(vm_t *vm) {
     vm->frames =
         NULL; // this prevents dangling pointers if vm is ever reused after free
   }
+  while (vm->free_frames != NULL) {
+    frame_t *frame = vm->free_frames;
+    vm->free_frames = frame->next_free;
+    frame_free(frame);
+  }
 
-  if (vm->objects != NULL) {
-    // if there are objects inside the vm stack go over them and free each one
-    for (int i = 0; i < vm->objects->count; i++) {
-      // typecasting (object_t *) is optional here is it will implictly be cast
-      // by the C compiler from void * to frame_t* but it might be nice to
-      // explicitly declare the type that we expect this to be for safety
-      // also implicit converstions are not allowed in C++ so if we use C++
-      // compiler it will fail
-      snek_object_free((object_t *)vm->objects->data[i]);
+  // the table only points into the heap, free it first so freeing the strings
+  // below doesn't have to remove them one by one
+  intern_table_free(&vm->strings);
+
+  // free every object that is still alive in the heap together with the pages
+  // that hold them
+  heap_free(vm);
+  stack_free(vm->young);
+  stack_free(vm->remembered);
+  stack_free(vm->gray);
+  stack_free(vm->globals);
+  for (size_t i = 0; i < vm->handles->count; i++) {
+    free(vm->handles->data[i]);
+  }
+  stack_free(vm->handles);
+  for (size_t i = 0; i < vm->root_sources->count; i++) {
+    free(vm->root_sources->data[i]);
+  }
+  stack_free(vm->root_sources);
+  // finalizers don't run when the VM goes away
+  stack_free(vm->weak_objects);
+  for (size_t i = 0; i < vm->finalizers->count; i++) {
+    free(vm->finalizers->data[i]);
+  }
+  stack_free(vm->finalizers);
+  for (size_t i = 0; i < vm->pending_finalizers->count; i++) {
+    free(vm->pending_finalizers->data[i]);
+  }
+  stack_free(vm->pending_finalizers);
+  // mutators that never detached, their threads must be done with the VM
+  for (size_t i = 0; i < vm->mutators->count; i++) {
+    mutator_t *mutator = vm->mutators->data[i];
+    for (size_t f = 0; f < mutator->frames->count; f++) {
+      frame_free(mutator->frames->data[f]);
     }
-    stack_free(vm->objects);
-    // defensive programming: nullify the pointers in case they may accidentally
-    // be referenced after they are freed
-    vm->objects = NULL;
+    while (mutator->free_frames != NULL) {
+      frame_t *frame = mutator->free_frames;
+      mutator->free_frames = frame->next_free;
+      frame_free(frame);
+    }
+    stack_free(mutator->frames);
+    stack_free(mutator->young);
+    stack_free(mutator->remembered);
+    if (mutator == snek_current_mutator) {
+      snek_current_mutator = NULL; // the calling thread never detached
+    }
+    free(mutator);
   }
+  stack_free(vm->mutators);
+  pthread_mutex_destroy(&vm->lock);
+  pthread_mutex_destroy(&vm->safepoint_lock);
+  pthread_cond_destroy(&vm->safepoint_cond);
 
   free(vm);
 }
 
-void vm_frame_push(vm_t *vm, frame_t *frame) {
-  if (vm == NULL || vm->frames == NULL) {
-    return; // vm should not be empty
-  }
-
-  if (frame == NULL) {
-    return; // frame should not be empty
-  }
-
-  // push a frame on the frames stack
-  stack_push(vm->frames, frame);
+// the mutator of the calling thread if it is attached to 'vm', NULL otherwise
+mutator_t *mutator_of(vm_t *vm) {
+  mutator_t *mutator = snek_current_mutator;
+  return mutator != NULL && mutator->vm == vm ? mutator : NULL;
 }
 
-frame_t *vm_new_frame(vm_t *vm) {
+// see mutator_t, returns NULL if there is no memory (or 'vm' is NULL)
+mutator_t *vm_attach_mutator(vm_t *vm) {
   if (vm == NULL) {
-    return NULL; // vm should not be empty
+    return NULL;
   }
-  // allocate space for a frame on the heap
-  frame_t *frame = malloc(sizeof(frame_t));
-  if (frame == NULL) {
-    return NULL; // heap allocation should succeed
+  mutator_t *mutator = mutator_of(vm);
+  if (mutator != NULL) {
+    return mutator; // already attached
+  }
+  if (!vm->threaded) {
+    // the cycles after this are stop-the-world, finish the running one
+    vm_collect_garbage_finish(vm);
   }
 
-  // create a new stack reference with capacity 8
-  frame->references = stack_new(8);
-  if (frame->references == NULL) {
-    free(frame);
-    return NULL; // assigning a new stack to the references should succeed
+  mutator = malloc(sizeof(mutator_t));
+  if (mutator == NULL) {
+    return NULL;
+  }
+  *mutator = (mutator_t){.vm = vm,
+                         .tlab = NULL,
+                         .frames = stack_new(8),
+                         .free_frames = NULL,
+                         .young = stack_new(8),
+                         .remembered = stack_new(8)};
+  if (mutator->frames == NULL || mutator->young == NULL ||
+      mutator->remembered == NULL) {
+    stack_free(mutator->frames);
+    stack_free(mutator->young);
+    stack_free(mutator->remembered);
+    free(mutator);
+    return NULL;
   }
 
-  // push newly allocated frame to the stack, we use the helper function we
-  // created above to make sure we don't forget to associate the frame with our
-  // VM
-  vm_frame_push(vm, frame);
+  // a collection in progress doesn't know about this thread yet, wait for it
+  pthread_mutex_lock(&vm->safepoint_lock);
+  while (vm->stop_requested) {
+    pthread_cond_wait(&vm->safepoint_cond, &vm->safepoint_lock);
+  }
+  stack_push(vm->mutators, mutator);
+  vm->mutators_running++;
+  if (!vm->threaded) {
+    vm->threaded = true; // the threads of the other mutators start after this
+  }
+  pthread_mutex_unlock(&vm->safepoint_lock);
 
-  return frame;
+  snek_current_mutator = mutator;
+  return mutator;
 }
 
-void frame_free(frame_t *frame) {
-  if (frame == NULL) {
-    return; // already free
+// the calling thread is done with 'vm'. What it allocated stays in the heap,
+// its frames are dropped
+void vm_detach_mutator(vm_t *vm) {
+  mutator_t *mutator = mutator_of(vm);
+  if (mutator == NULL) {
+    return;
   }
 
-  if (frame->references != NULL) {
-    stack_free(frame->references);
+  // holding the lock keeps the world from stopping while the mutator's lists
+  // and counters move to the VM
+  pthread_mutex_lock(&vm->safepoint_lock);
+  gc_park(vm, mutator);
+  pthread_mutex_lock(&vm->lock);
+  gc_merge_mutator(vm, mutator);
+  pthread_mutex_unlock(&vm->lock);
+  for (size_t i = 0; i < vm->mutators->count; i++) {
+    if (vm->mutators->data[i] == mutator) {
+      vm->mutators->data[i] = vm->mutators->data[--vm->mutators->count];
+      break;
+    }
   }
+  vm->mutators_running--;
+  pthread_cond_broadcast(&vm->safepoint_cond);
+  pthread_mutex_unlock(&vm->safepoint_lock);
 
-  free(frame);
+  for (size_t f = 0; f < mutator->frames->count; f++) {
+    frame_free(mutator->frames->data[f]);
+  }
+  while (mutator->free_frames != NULL) {
+    frame_t *frame = mutator->free_frames;
+    mutator->free_frames = frame->next_free;
+    frame_free(frame);
+  }
+  stack_free(mutator->frames);
+  stack_free(mutator->young);
+  stack_free(mutator->remembered);
+  free(mutator);
+  snek_current_mutator = NULL;
 }
 
-void frame_reference_object(frame_t *frame, object_t *obj) {
-  if (frame == NULL || obj == NULL) {
-    return; // neither should be empty
+// the lock of what the mutators share, only taken once there are mutators.
+// It is never held across an allocation or a safepoint
+void vm_lock(vm_t *vm) {
+  if (vm->threaded) {
+    pthread_mutex_lock(&vm->lock);
   }
-  stack_push(frame->references, (void *)obj);
 }
 
-void vm_track_object(vm_t *vm, object_t *obj) {
-  if (vm == NULL || obj == NULL) {
-    return; // neither should be empty
+void vm_unlock(vm_t *vm) {
+  if (vm->threaded) {
+    pthread_mutex_unlock(&vm->lock);
   }
-
-  // push the object to the vm->objects stack, in order to
-  // start tracking it for later garbage collection
-  stack_push(vm->objects,
-             obj); // optionally we can also cast the object here to (void
-                   // *)obj, this is is not
-  // required in C but may be required if we use a C++ compiler, since they may
-  // not allow implicit conversions
 }
 
-void mark(vm_t *vm) {
-  if (vm == NULL) {
-    return; // vm should not be empty
+// park here if another thread wants to collect, cheap enough to call in
+// every iteration of a loop
+void vm_safepoint(vm_t *vm) {
+  if (!__atomic_load_n(&vm->stop_requested, __ATOMIC_ACQUIRE)) {
+    return;
   }
-
-  // go over each frame
-  for (int f = 0; f < vm->frames->count; f++) {
-    frame_t *frame = (frame_t *)vm->frames->data[f];
-    if (frame == NULL || frame->references == NULL) {
-      continue;
-    }
-
-    // go over each reference in each frame
-    for (int r = 0; r < frame->references->count; r++) {
-      object_t *obj = (object_t *)frame->references->data[r];
-      // continue only if object is not NULL to prevent seg fault errors when
-      // ocassionally the VM may hold null references on the stack
-      if (obj != NULL) {
-        // set mark on each referenced object to true because we have those
-        // objects references directly by the stack frames which means they
-        // should not be cleaned up
-        obj->is_marked = true;
-      }
-    }
+  mutator_t *mutator = mutator_of(vm);
+  if (mutator == NULL) {
+    return;
   }
+  pthread_mutex_lock(&vm->safepoint_lock);
+  gc_park(vm, mutator);
+  pthread_mutex_unlock(&vm->safepoint_lock);
 }
 
-void trace_mark_object(stack_t *gray_objects, object_t *obj) {
-  if (obj == NULL || obj->is_marked == true) {
-    return; // obj should not be empty and we don't need to do anything to
-            // objects that are already marked
+// the calling thread is about to block (e.g. in pthread_join()) and won't
+// touch the VM until vm_blocking_end(), collections don't wait for it
+void vm_blocking_begin(vm_t *vm) {
+  if (mutator_of(vm) == NULL) {
+    return;
   }
-
-  // if object is not empty and not marked, we mark it and we push it on the
-  // gray objects stack
-  obj->is_marked = true;
-  stack_push(gray_objects, obj);
+  pthread_mutex_lock(&vm->safepoint_lock);
+  vm->mutators_running--;
+  pthread_cond_broadcast(&vm->safepoint_cond);
+  pthread_mutex_unlock(&vm->safepoint_lock);
 }
 
-// there are 3 sets of objects in Mark and Swee
-// white - Unreachable, not yet visited → will be freed
-// gray - Reachable, discovered but not fully processed
-// black - Reachable and fully processed (all children marked)
-
-// mark nested objects for GC
-void trace_blacken_object(stack_t *gray_objects, object_t *obj) {
-  switch (obj->kind) {
-    // int, float,string don't contain any references to other objects
-  case INTEGER:
-    return;
-  case FLOAT:
-    return;
-  case STRING:
+void vm_blocking_end(vm_t *vm) {
+  if (mutator_of(vm) == NULL) {
     return;
-  case VECTOR3:
-    // mark the nested integer objects inside vector3
-    trace_mark_object(gray_objects, obj->data.v_vector3.x);
-    trace_mark_object(gray_objects, obj->data.v_vector3.y);
-    trace_mark_object(gray_objects, obj->data.v_vector3.z);
-    break;
-  case ARRAY:
-    // mark each nested element inside the array
-    for (int i = 0; i < obj->data.v_array.size; i++) {
-      object_t *elem = obj->data.v_array.elements[i];
-      trace_mark_object(gray_objects, elem);
-    }
-    break;
   }
+  pthread_mutex_lock(&vm->safepoint_lock);
+  while (vm->stop_requested) {
+    pthread_cond_wait(&vm->safepoint_cond, &vm->safepoint_lock);
+  }
+  vm->mutators_running++;
+  pthread_mutex_unlock(&vm->safepoint_lock);
 }
 
-// trace all objects in the VM and mark them and their nested objects for GC
-void trace(vm_t *vm) {
-  stack_t *gray_objects = stack_new(8);
-  if (gray_objects == NULL) {
-    return; // the allocation of a new stack failed
+// wait until the world runs again, with safepoint_lock held. 'self' (NULL
+// for a thread that isn't a mutator) doesn't count as running meanwhile
+void gc_park(vm_t *vm, mutator_t *self) {
+  if (!vm->stop_requested || pthread_equal(vm->stopper, pthread_self())) {
+    return;
   }
-
-  // build gray stack
-  // collect a list of all marked objects in the VM
-  for (int i = 0; i < vm->objects->count; i++) {
-    object_t *obj = (object_t *)vm->objects->data[i];
-    if (obj->is_marked == true) {
-      // push each object that is marked to the gray_objects stack
-      stack_push(gray_objects, obj);
-    }
+  if (self != NULL) {
+    vm->mutators_running--;
+    vm->mutators_parked++;
+    pthread_cond_broadcast(&vm->safepoint_cond);
   }
-
-  // go through each marked object and mark all of its nested objects
-  while (gray_objects->count > 0) {
-    // pop one of them and move it to the backen objects stack
-    object_t *popped_obj = stack_pop(gray_objects);
-    trace_blacken_object(gray_objects, popped_obj);
+  while (vm->stop_requested) {
+    pthread_cond_wait(&vm->safepoint_cond, &vm->safepoint_lock);
+  }
+  if (self != NULL) {
+    vm->mutators_parked--;
+    vm->mutators_running++;
   }
-
-  // we free this stack because we used it only as a placeholder stack to keep
-  // the gray objects that were marked and but their nested objects also needed
-  // to be checked, after we dealt with marking both the gray objects and their
-  // nested ones, we no longer need this placeholder
-  stack_free(gray_objects);
 }
 
-void sweep(vm_t *vm) {
-  if (vm == NULL) {
-    return; // vm should not be empty
+// wait until every other mutator is parked or blocking, a collection calls
+// this first. It nests, only the outermost gc_start_world() restarts them
+void gc_stop_world(vm_t *vm) {
+  if (!vm->threaded) {
+    return;
+  }
+  mutator_t *self = mutator_of(vm);
+  pthread_mutex_lock(&vm->safepoint_lock);
+  if (vm->stop_depth > 0 && pthread_equal(vm->stopper, pthread_self())) {
+    vm->stop_depth++;
+    pthread_mutex_unlock(&vm->safepoint_lock);
+    return;
   }
 
-  for (int i = 0; i < vm->objects->count; i++) {
-    // go over each object in the stack
-    object_t *obj = (object_t *)vm->objects->data[i];
-    if (obj->is_marked == true) {
-      // if it is marked as used remove the mark
-      obj->is_marked = false;
-      continue;
-    } else {
-      // otherwise free the oject
-      snek_object_free(obj);
-      // and set the previous position it occupied to NULL
-      vm->objects->data[i] = NULL;
-    }
+  // 2 threads that want to collect at once: the second one parks until the
+  // first is done (and then collects again, pacing may not need it but an
+  // explicit call asked for it)
+  while (vm->stop_requested) {
+    gc_park(vm, self);
   }
+  __atomic_store_n(&vm->stop_requested, true, __ATOMIC_RELEASE);
+  vm->stopper = pthread_self();
+  vm->stop_depth = 1;
+  size_t own = self != NULL ? 1 : 0;
+  while (vm->mutators_running > own) {
+    pthread_cond_wait(&vm->safepoint_cond, &vm->safepoint_lock);
+  }
+  pthread_mutex_unlock(&vm->safepoint_lock);
 
-  // remove NULLs from the objects stack in the VM
-  stack_remove_nulls(vm->objects);
+  // everything the mutators kept to themselves goes back to the VM
+  for (size_t i = 0; i < vm->mutators->count; i++) {
+    gc_merge_mutator(vm, vm->mutators->data[i]);
+  }
 }
 
-void vm_collect_garbage(vm_t *vm) {
-  if (vm == NULL) {
-    return; // vm should not be empty
+void gc_start_world(vm_t *vm) {
+  if (!vm->threaded) {
+    return;
   }
+  pthread_mutex_lock(&vm->safepoint_lock);
+  if (--vm->stop_depth == 0) {
+    __atomic_store_n(&vm->stop_requested, false, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&vm->safepoint_cond);
+  }
+  pthread_mutex_unlock(&vm->safepoint_lock);
+}
+
+// move the counters, young objects and remembered set of 'mutator' to the
+// VM and give back its TLAB. The world is stopped (or vm->lock held)
+void gc_merge_mutator(vm_t *vm, mutator_t *mutator) {
+  vm->gc_allocated_bytes += mutator->allocated_bytes;
+  vm->gc_allocated_objects += mutator->allocated_objects;
+  vm->heap.object_count += mutator->object_count;
+  heap_stats_merge(&vm->heap_stats, &mutator->heap_stats);
+  mutator->allocated_bytes = 0;
+  mutator->allocated_objects = 0;
+  mutator->object_count = 0;
+
+  if (mutator->tlab != NULL) {
+    mutator->tlab->owner = NULL;
+    mutator->tlab = NULL;
+  }
+
+  for (size_t i = 0; i < mutator->young->count; i++) {
+    stack_push(vm->young, mutator->young->data[i]);
+  }
+  mutator->young->count = 0;
+  for (size_t i = 0; i < mutator->remembered->count; i++) {
+    stack_push(vm->remembered, mutator->remembered->data[i]);
+  }
+  mutator->remembered->count = 0;
+}
+
+// the allocation of a mutator, slab_alloc() from its TLAB. NULL if there is
+// no memory
+object_t *mutator_alloc(mutator_t *mutator) {
+  slab_page_t *page = mutator->tlab;
+  if (page == NULL ||
+      (page->free_list == NULL && page->bump == page->capacity)) {
+    if (!mutator_refill(mutator)) {
+      return NULL;
+    }
+    page = mutator->tlab;
+  }
+
+  object_t *obj;
+  if (page->free_list != NULL) {
+    obj = (object_t *)page->free_list;
+    page->free_list = page->free_list->next;
+  } else {
+    obj = &page->slots[page->bump];
+    page->bump++;
+  }
+  memset(obj, 0, sizeof(object_t));
+  return obj;
+}
+
+// swap the TLAB of 'mutator' for a page with room, collects first if pacing
+// says so. False if there is no memory for a new page
+bool mutator_refill(mutator_t *mutator) {
+  vm_t *vm = mutator->vm;
+  pthread_mutex_lock(&vm->lock);
+  if (mutator->tlab != NULL) {
+    mutator->tlab->owner = NULL;
+    mutator->tlab = NULL;
+  }
+  vm->gc_allocated_bytes += mutator->allocated_bytes;
+  vm->gc_allocated_objects += mutator->allocated_objects;
+  vm->heap.object_count += mutator->object_count;
+  heap_stats_merge(&vm->heap_stats, &mutator->heap_stats);
+  mutator->allocated_bytes = 0;
+  mutator->allocated_objects = 0;
+  mutator->object_count = 0;
+  bool collect =
+      vm->gc_percent > 0 && vm->gc_allocated_bytes >= vm->gc_trigger;
+  pthread_mutex_unlock(&vm->lock);
+
+  // see vm_set_gc_pacing(), not under the lock: the collection waits for the
+  // other mutators and they may need it to get to a safepoint
+  if (collect) {
+    gc_collect(vm, false);
+  }
+
+  pthread_mutex_lock(&vm->lock);
+  heap_t *heap = &vm->heap;
+  slab_page_t *page = heap->pages;
+  // the owner first, the free slots of a TLAB change without the lock
+  while (page != NULL &&
+         (page->owner != NULL ||
+          (page->free_list == NULL && page->bump == page->capacity))) {
+    page = page->next;
+  }
+  if (page == NULL) {
+    page = slab_page_new();
+    if (page != NULL) {
+      page->next = heap->pages;
+      page->vm = vm;
+      heap->pages = page;
+      heap->page_count++;
+    }
+  }
+  if (page != NULL) {
+    page->owner = mutator;
+    mutator->tlab = page;
+  }
+  pthread_mutex_unlock(&vm->lock);
+  return page != NULL;
+}
+
+// count 'bytes' of buffers towards the next automatic collection
+void gc_count_allocation(vm_t *vm, size_t bytes) {
+  mutator_t *mutator = vm->threaded ? mutator_of(vm) : NULL;
+  if (mutator != NULL) {
+    mutator->allocated_bytes += bytes;
+  } else {
+    vm->gc_allocated_bytes += bytes;
+  }
+}
+
+// make 'string' the canonical copy of its characters, unless another thread
+// interned the same ones since the caller looked. Returns the canonical one
+object_t *vm_intern(vm_t *vm, uint64_t hash, object_t *string) {
+  vm_lock(vm);
+  object_t *interned = NULL;
+  if (vm->threaded) {
+    interned = intern_table_find(&vm->strings, hash, snek_string_chars(string),
+                                 string->data.v_string.length, "", 0);
+  }
+  if (interned == NULL) {
+    intern_table_insert(&vm->strings, hash, string);
+    interned = string;
+  }
+  vm_unlock(vm);
+  return interned;
+}
+
+void vm_frame_push(vm_t *vm, frame_t *frame) {
+  if (vm == NULL || vm->frames == NULL) {
+    return; // vm should not be empty
+  }
+
+  if (frame == NULL) {
+    return; // frame should not be empty
+  }
+
+  // push a frame on the frames stack (of the calling thread if it's a
+  // mutator)
+  mutator_t *mutator = mutator_of(vm);
+  stack_push(mutator != NULL ? mutator->frames : vm->frames, frame);
+}
+
+frame_t *vm_new_frame(vm_t *vm) {
+  if (vm == NULL) {
+    return NULL; // vm should not be empty
+  }
+
+  // reuse a popped frame if there is one, its references stack keeps the
+  // capacity it grew to, so a call doesn't allocate anything
+  mutator_t *mutator = mutator_of(vm);
+  frame_t **free_frames =
+      mutator != NULL ? &mutator->free_frames : &vm->free_frames;
+  if (*free_frames != NULL) {
+    frame_t *frame = *free_frames;
+    *free_frames = frame->next_free;
+    frame->next_free = NULL;
+    vm_frame_push(vm, frame);
+    return frame;
+  }
+
+  // allocate space for a frame on the heap
+  frame_t *frame = malloc(sizeof(frame_t));
+  if (frame == NULL) {
+    return NULL; // heap allocation should succeed
+  }
+
+  // the references start out in the frame itself
+  frame->references = frame->inline_references;
+  frame->count = 0;
+  frame->capacity = FRAME_INLINE_REFERENCES;
+  frame->next_free = NULL;
+
+  // push newly allocated frame to the stack, we use the helper function we
+  // created above to make sure we don't forget to associate the frame with our
+  // VM
+  vm_frame_push(vm, frame);
+
+  return frame;
+}
+
+// the function of the top frame returned: its references are no roots anymore
+// and the frame goes to the free list for the next vm_new_frame(). The frame
+// must not be used after this
+void vm_frame_pop(vm_t *vm) {
+  if (vm == NULL || vm->frames == NULL) {
+    return;
+  }
+  mutator_t *mutator = mutator_of(vm);
+  stack_t *frames = mutator != NULL ? mutator->frames : vm->frames;
+  frame_t **free_frames =
+      mutator != NULL ? &mutator->free_frames : &vm->free_frames;
+  if (frames->count == 0) {
+    return; // there is no frame to pop
+  }
+
+  frame_t *frame = stack_pop(frames);
+  if (frame == NULL) {
+    return;
+  }
+  frame->count = 0;
+  frame->next_free = *free_frames;
+  *free_frames = frame;
+}
+
+void frame_free(frame_t *frame) {
+  if (frame == NULL) {
+    return; // already free
+  }
+
+  if (frame->references != frame->inline_references) {
+    free(frame->references);
+  }
+
+  free(frame);
+}
+
+// see SNEK_ROOT() for the fast version, returns false if the frame needed a
+// bigger buffer and there was no memory for it
+bool frame_reference_object(frame_t *frame, object_t *obj) {
+  if (frame == NULL || obj == NULL) {
+    return false; // neither should be empty
+  }
+
+  if (frame->count == frame->capacity) {
+    // double the capacity like stack_push(), the first time the inline
+    // references are copied out
+    size_t capacity = frame->capacity * 2;
+    object_t **references =
+        frame->references == frame->inline_references
+            ? malloc(capacity * sizeof(object_t *))
+            : realloc(frame->references, capacity * sizeof(object_t *));
+    if (references == NULL) {
+      return false;
+    }
+    if (frame->references == frame->inline_references) {
+      memcpy(references, frame->inline_references,
+             sizeof(frame->inline_references));
+    }
+    frame->references = references;
+    frame->capacity = capacity;
+  }
+
+  frame->references[frame->count++] = obj;
+  return true;
+}
+
+// forget the references of 'frame' after the first 'count', e.g. the
+// temporaries rooted in a scope that ended
+void frame_drop_references(frame_t *frame, size_t count) {
+  if (frame != NULL && count < frame->count) {
+    frame->count = count;
+  }
+}
+
+void vm_track_object(vm_t *vm, object_t *obj) {
+  if (vm == NULL || obj == NULL) {
+    return; // neither should be empty
+  }
+
+  // flip the bit of the slot in its page, in order to start tracking it for
+  // later garbage collection, sweep() only looks at slots that have it set
+  slab_page_t *page = slab_page_of(obj);
+  size_t slot = (size_t)(obj - page->slots);
+  page->allocated[slot / 64] |= (uint64_t)1 << (slot % 64);
+  page->live++;
+  vm->heap.object_count++;
+}
+
+slab_page_t *slab_page_new(void) {
+  // pages are aligned to their own size so that slab_page_of() can find the
+  // page of an object without storing a pointer in every object
+  slab_page_t *page = aligned_alloc(SLAB_PAGE_SIZE, SLAB_PAGE_SIZE);
+  if (page == NULL) {
+    return NULL;
+  }
+
+  page->next = NULL;
+  page->vm = NULL;
+  page->free_list = NULL;
+  page->capacity =
+      (SLAB_PAGE_SIZE - sizeof(slab_page_t)) / sizeof(object_t);
+  page->bump = 0;
+  page->live = 0;
+  // a page made while a sweep is running is behind it, nothing to sweep there
+  page->swept = true;
+  page->owner = NULL;
+  memset(page->allocated, 0, sizeof(page->allocated));
+  memset(page->marked, 0, sizeof(page->marked));
+
+  return page;
+}
+
+slab_page_t *slab_page_of(object_t *obj) {
+  // clear the low bits of the address to get to the start of the page
+  return (slab_page_t *)((uintptr_t)obj & ~((uintptr_t)SLAB_PAGE_SIZE - 1));
+}
+
+bool slab_slot_is_allocated(slab_page_t *page, size_t slot) {
+  return (page->allocated[slot / 64] >> (slot % 64)) & 1;
+}
+
+// the mark bit of an object lives in the bitmap of its page
+bool gc_is_marked(object_t *obj) {
+  slab_page_t *page = slab_page_of(obj);
+  size_t slot = (size_t)(obj - page->slots);
+  return (page->marked[slot / 64] >> (slot % 64)) & 1;
+}
+
+void gc_set_marked(object_t *obj, bool marked) {
+  slab_page_t *page = slab_page_of(obj);
+  size_t slot = (size_t)(obj - page->slots);
+  uint64_t bit = (uint64_t)1 << (slot % 64);
+  if (marked) {
+    page->marked[slot / 64] |= bit;
+  } else {
+    page->marked[slot / 64] &= ~bit;
+  }
+}
+
+// set the mark of an object, returns false if it was already set
+bool gc_mark(object_t *obj) {
+  slab_page_t *page = slab_page_of(obj);
+  size_t slot = (size_t)(obj - page->slots);
+  uint64_t bit = (uint64_t)1 << (slot % 64);
+  uint64_t *word = &page->marked[slot / 64];
+  if (*word & bit) {
+    return false;
+  }
+  *word |= bit;
+  return true;
+}
+
+object_t *slab_alloc(heap_t *heap) {
+  slab_page_t *page = heap->current;
+
+  // look for a page that still has room starting at the current one, pages
+  // before it were already full the last time we went past them and only
+  // sweep() can give them free slots again (it resets 'current' when it does)
+  while (page != NULL &&
+         (page->owner != NULL ||
+          (page->free_list == NULL && page->bump == page->capacity))) {
+    page = page->next;
+  }
+
+  if (page == NULL) {
+    // every page is full, get a new one from malloc
+    page = slab_page_new();
+    if (page == NULL) {
+      return NULL;
+    }
+    page->next = heap->pages;
+    page->vm = heap->vm;
+    heap->pages = page;
+    heap->page_count++;
+  }
+  heap->current = page;
+
+  object_t *obj;
+  if (page->free_list != NULL) {
+    // reuse a slot that sweep() gave back first, it is still warm in the cache
+    obj = (object_t *)page->free_list;
+    page->free_list = page->free_list->next;
+  } else {
+    // otherwise bump allocate the next never used slot
+    obj = &page->slots[page->bump];
+    page->bump++;
+  }
+
+  // the old allocator used calloc, keep handing out zeroed objects
+  memset(obj, 0, sizeof(object_t));
+
+  return obj;
+}
+
+// give the slot of an object back to its page, the nested buffers of the object
+// have to be freed before this (see snek_object_free())
+void slab_release(heap_t *heap, object_t *obj) {
+  if (slab_page_release(slab_page_of(obj), obj)) {
+    heap->object_count--;
+  }
+}
+
+// the part of slab_release() that only touches the page, returns whether the
+// object was counted as live. Threads that own different pages can call it at
+// the same time
+bool slab_page_release(slab_page_t *page, object_t *obj) {
+  size_t slot = (size_t)(obj - page->slots);
+
+  // the slot may have never been tracked if a constructor failed half way
+  bool tracked = slab_slot_is_allocated(page, slot);
+  if (tracked) {
+    page->allocated[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+    page->live--;
+  }
+
+  free_slot_t *free_slot = (free_slot_t *)obj;
+  free_slot->next = page->free_list;
+  page->free_list = free_slot;
+  return tracked;
+}
+
+void heap_free(vm_t *vm) {
+  slab_page_t *page = vm->heap.pages;
+  while (page != NULL) {
+    // free the nested buffers of every object that is still alive in the page
+    for (size_t i = 0; i < page->bump; i++) {
+      if (slab_slot_is_allocated(page, i)) {
+        snek_object_free(vm, &page->slots[i]);
+      }
+    }
+
+    slab_page_t *next = page->next;
+    free(page);
+    page = next;
+  }
+
+  vm->heap = (heap_t){.vm = vm,
+                      .pages = NULL,
+                      .current = NULL,
+                      .page_count = 0,
+                      .object_count = 0};
+}
+
+void mark(vm_t *vm) {
+  if (vm == NULL) {
+    return; // vm should not be empty
+  }
+
+  // mark every root (the references of the frames, globals, handles, ...) and
+  // push it straight on the gray stack, so trace() can start from them without
+  // looking for the marked objects in the heap first
+  gc_mark_roots(vm, vm->gray);
+}
+
+void trace_mark_object(stack_t *gray_objects, object_t *obj) {
+  if (obj == NULL || snek_is_immediate(obj) || !gc_mark(obj)) {
+    return; // obj should not be empty and we don't need to do anything to
+            // objects that are already marked or that don't live on the heap
+  }
+
+  // if object is not empty and was not marked before, we push it on the gray
+  // objects stack
+  stack_push(gray_objects, obj);
+}
+
+// there are 3 sets of objects in Mark and Swee
+// white - Unreachable, not yet visited → will be freed
+// gray - Reachable, discovered but not fully processed
+// black - Reachable and fully processed (all children marked)
+
+// mark nested objects for GC
+void trace_blacken_object(stack_t *gray_objects, object_t *obj) {
+  switch (obj->kind) {
+    // int, float,string don't contain any references to other objects
+  case INTEGER:
+    return;
+  case FLOAT:
+    return;
+  case STRING:
+    return;
+  case VECTOR3:
+    // the components are plain numbers stored inline, nothing to mark
+    return;
+  case ARRAY:
+    // mark each nested element inside the array
+    for (int i = 0; i < obj->data.v_array.size; i++) {
+      object_t *elem = obj->data.v_array.elements[i];
+      trace_mark_object(gray_objects, elem);
+    }
+    break;
+  case INT_ARRAY:
+  case FLOAT_ARRAY:
+    // typed arrays hold plain numbers, there is nothing in them to trace no
+    // matter how big they are
+    return;
+  case WEAKREF:
+  case EPHEMERON_TABLE:
+    // weak, gc_process_weak() looks at them once marking is done
+    return;
+  }
+}
+
+// trace all objects in the VM and mark them and their nested objects for GC,
+// starting from the roots mark() left on the gray stack. The work depends on
+// the number of reachable objects only, not on the size of the heap
+void trace(vm_t *vm) {
+  stack_t *gray_objects = vm->gray;
+
+  // go through each marked object and mark all of its nested objects
+  while (gray_objects->count > 0) {
+    gc_note_gray(vm, gray_objects);
+    // pop one of them and move it to the backen objects stack
+    object_t *popped_obj = stack_pop(gray_objects);
+    trace_blacken_object(gray_objects, popped_obj);
+  }
+}
+
+void sweep(vm_t *vm) {
+  if (vm == NULL) {
+    return; // vm should not be empty
+  }
+
+  // walk the pages slot by slot instead of chasing the pointers of a
+  // separate list of objects, dead objects are handed back to the free list of
+  // their own page so there is nothing left to compact afterwards
+  sweep_begin(vm);
+  sweep_pages(vm, SIZE_MAX);
+}
+
+// start sweeping from the first page, every page has to be swept again.
+// Marking is over at this point, so the weak references are processed first
+void sweep_begin(vm_t *vm) {
+  gc_process_weak(vm, GC_CYCLE_FULL);
+  vm->gc_phase = GC_SWEEPING;
+  vm->sweep_page = vm->heap.pages;
+  vm->sweep_slot = 0;
+  for (slab_page_t *page = vm->heap.pages; page != NULL; page = page->next) {
+    page->swept = false;
+  }
+
+  // every survivor of a full collection is promoted, so the young list and the
+  // remembered set start over (the young list may also point to objects that
+  // are about to be freed). Objects allocated while an incremental sweep runs
+  // are added to them again
+  vm->young->count = 0;
+  vm->remembered->count = 0;
+  vm->gc_live_bytes = 0;
+}
+
+void sweep_slot(vm_t *vm, slab_page_t *page, size_t slot) {
+  if (!slab_slot_is_allocated(page, slot)) {
+    return; // slot is already free
+  }
+
+  object_t *obj = &page->slots[slot];
+  if (sweep_survivor(vm, obj)) {
+    vm->gc_live_bytes += snek_object_size(obj);
+  } else {
+    // free the object and give its slot back to the page
+    gc_count_freed(vm, obj);
+    snek_object_free(vm, obj);
+  }
+}
+
+// returns false for garbage, a survivor gets ready for the next cycle. Its
+// mark stays set, the marks of a whole page are cleared once it is swept
+bool sweep_survivor(vm_t *vm, object_t *obj) {
+  if (!gc_is_marked(obj)) {
+    return false;
+  }
+
+  // in generational mode a full collection promotes every survivor
+  obj->is_old = vm->generational;
+  obj->is_remembered = false;
+  return true;
+}
+
+// sweep at most 'budget' slots from where the last call stopped, returns true
+// once every page is swept (the cycle is over then)
+bool sweep_pages(vm_t *vm, size_t budget) {
+  size_t work = 0;
+  while (vm->sweep_page != NULL) {
+    slab_page_t *page = vm->sweep_page;
+    // bump is read again every time, objects may be allocated in the part of
+    // the page that is not swept yet
+    for (; vm->sweep_slot < page->bump; vm->sweep_slot++) {
+      if (work == budget) {
+        return false;
+      }
+      sweep_slot(vm, page, vm->sweep_slot);
+      work++;
+    }
+
+    memset(page->marked, 0, sizeof(page->marked));
+    page->swept = true;
+    vm->sweep_page = page->next;
+    vm->sweep_slot = 0;
+    // a lazy sweep can't wait for the end of the cycle to reuse the page
+    if (vm->sweep_mode == SWEEP_LAZY && page->free_list != NULL) {
+      vm->heap.current = page;
+    }
+  }
+
+  // pages before 'current' may have free slots now, start looking from the
+  // first page again on the next allocation
+  vm->heap.current = vm->heap.pages;
+  gc_cycle_end(vm);
+  return true;
+}
+
+void vm_collect_garbage(vm_t *vm) {
+  if (vm == NULL) {
+    return; // vm should not be empty
+  }
+  gc_collect(vm, true);
+}
+
+// a full collection. The ones the VM starts by itself (pacing, running out
+// of memory) pass 'may_move' false: they happen inside an allocation, and the
+// function that allocates still holds pointers to its operands. A compaction
+// that is due then waits for the program's next vm_collect_garbage()
+void gc_collect(vm_t *vm, bool may_move) {
+  // the other mutators wait at a safepoint until the collection is over
+  gc_stop_world(vm);
+
+  // an incremental cycle in progress is finished first, its marks would
+  // otherwise keep garbage alive
+  vm_collect_garbage_finish(vm);
+
+  vm->full_collections++;
+  if (vm->compact_every > 0 && vm->full_collections % vm->compact_every == 0) {
+    vm->compact_pending = true;
+  }
+  if (vm->compact_pending && may_move) {
+    vm_compact(vm);
+    gc_start_world(vm);
+    return;
+  }
+
+  gc_cycle_begin(vm, GC_CYCLE_FULL);
+  uint64_t start = gc_clock_ns();
+
+  // big heaps are marked by several threads, this replaces mark() + trace()
+  if (vm->mark_threads > 1 &&
+      vm->heap.object_count >= PARALLEL_MARK_MIN_OBJECTS) {
+    mark_parallel(vm);
+  } else {
+    // mark objects that have no references for garbage collection
+    mark(vm);
+    vm->gc_cycle.mark_ns += gc_clock_ns() - start;
+
+    // trace all the objects (and their nested objects) for garbage collection
+    trace(vm);
+  }
+  uint64_t traced = gc_clock_ns();
+  vm->gc_cycle.trace_ns += traced - start - vm->gc_cycle.mark_ns;
+
+  // sweep all of the objects that have no references. The mutators don't
+  // sweep when they allocate, so with more than one a lazy sweep is eager
+  sweep_mode_t sweep_mode = vm->sweep_mode;
+  if (sweep_mode == SWEEP_LAZY && vm->threaded) {
+    sweep_mode = SWEEP_EAGER;
+  }
+  switch (sweep_mode) {
+  case SWEEP_EAGER:
+    sweep(vm);
+    break;
+  case SWEEP_LAZY:
+    // the allocations sweep from here on, see _new_snek_object()
+    sweep_begin(vm);
+    break;
+  case SWEEP_PARALLEL:
+    sweep_parallel(vm);
+    break;
+  }
+  vm->gc_cycle.sweep_ns += gc_clock_ns() - traced;
+  gc_pause_end(vm, start);
+  gc_start_world(vm);
+}
+
+// turn generational mode on or off, objects that already exist when it is
+// turned on are treated as old. 'promotion_age' is how many minor collections
+// a young object has to survive before it is promoted (at least 1)
+void vm_set_generational(vm_t *vm, bool enabled, uint8_t promotion_age) {
+  if (vm == NULL) {
+    return;
+  }
+  vm_collect_garbage_finish(vm);
+
+  vm->generational = enabled;
+  vm->promotion_age = promotion_age > 0 ? promotion_age : 1;
+  vm->young->count = 0;
+  vm->remembered->count = 0;
+
+  for (slab_page_t *page = vm->heap.pages; page != NULL; page = page->next) {
+    for (size_t i = 0; i < page->bump; i++) {
+      if (slab_slot_is_allocated(page, i)) {
+        page->slots[i].is_old = enabled;
+        page->slots[i].is_remembered = false;
+        page->slots[i].age = 0;
+      }
+    }
+  }
+}
+
+// has to be called after a pointer to 'value' is stored inside 'obj', it
+// keeps 2 kinds of collections correct:
+// - incremental marking (Dijkstra style): obj may already be black, so a white
+//   value stored in it would never be found, it is grayed right away instead
+// - generational: when an old object starts pointing to a young one it goes
+//   into the remembered set, otherwise a minor collection would not see that
+//   the young object is in use
+void vm_write_barrier(object_t *obj, object_t *value) {
+  if (obj == NULL || value == NULL || snek_is_immediate(value)) {
+    return;
+  }
+
+  vm_t *vm = slab_page_of(obj)->vm;
+  if (vm->gc_phase == GC_MARKING) {
+    trace_mark_object(vm->gray, value);
+  }
+
+  // only objects of a VM in generational mode are ever old
+  if (obj->is_old && !obj->is_remembered && !value->is_old) {
+    // 2 threads may both remember it, it is then simply in the set twice
+    obj->is_remembered = true;
+    mutator_t *mutator = vm->threaded ? mutator_of(vm) : NULL;
+    stack_push(mutator != NULL ? mutator->remembered : vm->remembered, obj);
+  }
+}
+
+// whether one of the objects directly referenced by obj is young
+bool snek_points_to_young(object_t *obj) {
+  if (snek_kind(obj) != ARRAY) {
+    return false; // only arrays hold pointers to other objects
+  }
+
+  for (size_t i = 0; i < obj->data.v_array.size; i++) {
+    object_t *elem = obj->data.v_array.elements[i];
+    if (elem != NULL && !snek_is_immediate(elem) && !elem->is_old) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// trace_mark_object() for a minor collection, old objects are live by
+// definition so they are neither marked nor traced through
+void trace_mark_young_object(stack_t *gray_objects, object_t *obj) {
+  if (obj == NULL || snek_is_immediate(obj) || obj->is_old ||
+      !gc_mark(obj)) {
+    return;
+  }
+
+  stack_push(gray_objects, obj);
+}
+
+// trace_blacken_object() for a minor collection
+void trace_blacken_young_object(stack_t *gray_objects, object_t *obj) {
+  if (snek_kind(obj) != ARRAY) {
+    return; // only arrays hold pointers to other objects
+  }
+
+  for (size_t i = 0; i < obj->data.v_array.size; i++) {
+    trace_mark_young_object(gray_objects, obj->data.v_array.elements[i]);
+  }
+}
+
+// sweep the young list only: unmarked young objects are freed, marked ones
+// get older and are promoted once they reach the promotion age
+void sweep_young(vm_t *vm) {
+  stack_t *young = vm->young;
+  size_t still_young = 0;
+  for (size_t i = 0; i < young->count; i++) {
+    object_t *obj = young->data[i];
+    if (obj->is_old) {
+      continue; // allocated during an incremental sweep that promoted it
+    }
+    if (!gc_is_marked(obj)) {
+      gc_count_freed(vm, obj);
+      snek_object_free(vm, obj);
+      continue;
+    }
+
+    gc_set_marked(obj, false);
+    obj->age++;
+    if (obj->age < vm->promotion_age) {
+      young->data[still_young++] = obj;
+      continue;
+    }
+
+    // the promoted object may point to objects that stay young, remember it
+    // for now, the loop below drops it again if it doesn't
+    obj->is_old = true;
+    obj->is_remembered = true;
+    stack_push(vm->remembered, obj);
+  }
+  young->count = still_young;
+
+  // only old objects that still point to young ones have to stay remembered
+  stack_t *remembered = vm->remembered;
+  size_t still_remembered = 0;
+  for (size_t i = 0; i < remembered->count; i++) {
+    object_t *obj = remembered->data[i];
+    if (snek_points_to_young(obj)) {
+      remembered->data[still_remembered++] = obj;
+    } else {
+      obj->is_remembered = false;
+    }
+  }
+  remembered->count = still_remembered;
+
+  // slots were freed all over the heap, look for them from the first page
+  vm->heap.current = vm->heap.pages;
+}
+
+// minor collection, the pause depends on the number of young objects (and
+// roots) instead of the size of the whole heap. Without generational mode
+// every object counts as young, so this is the same as vm_collect_garbage()
+void vm_collect_young(vm_t *vm) {
+  if (vm == NULL) {
+    return;
+  }
+  // the marks of a minor collection would mix with the ones of the cycle
+  vm_collect_garbage_finish(vm);
+  if (!vm->generational) {
+    vm_collect_garbage(vm);
+    return;
+  }
+
+  stack_t *gray_objects = stack_new(8);
+  if (gray_objects == NULL) {
+    return;
+  }
+  gc_stop_world(vm);
+  gc_cycle_begin(vm, GC_CYCLE_YOUNG);
+  uint64_t start = gc_clock_ns();
+
+  // the roots are the young objects among the roots of the VM and the ones
+  // referenced by the old objects in the remembered set
+  gc_visit_roots(vm, gc_visit_young, gray_objects);
+  for (size_t i = 0; i < vm->remembered->count; i++) {
+    trace_blacken_young_object(gray_objects, vm->remembered->data[i]);
+  }
+  uint64_t marked = gc_clock_ns();
+  vm->gc_cycle.mark_ns += marked - start;
+
+  while (gray_objects->count > 0) {
+    gc_note_gray(vm, gray_objects);
+    trace_blacken_young_object(gray_objects, stack_pop(gray_objects));
+  }
+  stack_free(gray_objects);
+  gc_process_weak(vm, GC_CYCLE_YOUNG);
+  uint64_t traced = gc_clock_ns();
+  vm->gc_cycle.trace_ns += traced - marked;
+
+  sweep_young(vm);
+  vm->gc_cycle.sweep_ns += gc_clock_ns() - traced;
+  gc_pause_end(vm, start);
+  gc_start_world(vm);
+}
+
+// gray every root
+void gc_mark_roots(vm_t *vm, stack_t *gray_objects) {
+  gc_visit_roots(vm, gc_visit_gray, gray_objects);
+}
+
+// call 'visit' for every root of the VM: the references of the frames, the
+// globals, the handles and whatever the root sources of vm_add_roots() report.
+// NULL and immediates may be passed to 'visit' too
+void gc_visit_roots(vm_t *vm, gc_visit_t visit, void *visit_ctx) {
+  gc_visit_frames(vm->frames, visit, visit_ctx);
+  for (size_t i = 0; i < vm->mutators->count; i++) {
+    mutator_t *mutator = vm->mutators->data[i];
+    gc_visit_frames(mutator->frames, visit, visit_ctx);
+  }
+  for (size_t i = 0; i < vm->globals->count; i++) {
+    visit(visit_ctx, *(object_t **)vm->globals->data[i]);
+  }
+  for (size_t i = 0; i < vm->handles->count; i++) {
+    visit(visit_ctx, ((snek_handle_t *)vm->handles->data[i])->obj);
+  }
+  for (size_t i = 0; i < vm->root_sources->count; i++) {
+    root_source_t *source = vm->root_sources->data[i];
+    source->enumerate(source->ctx, visit, visit_ctx);
+  }
+  // a finalizer that didn't run yet still needs its object
+  for (size_t i = 0; i < vm->pending_finalizers->count; i++) {
+    finalizer_t *finalizer = vm->pending_finalizers->data[i];
+    visit(visit_ctx, finalizer->obj);
+  }
+}
+
+void gc_visit_frames(stack_t *frames, gc_visit_t visit, void *visit_ctx) {
+  for (size_t f = 0; f < frames->count; f++) {
+    frame_t *frame = frames->data[f];
+    if (frame == NULL) {
+      continue;
+    }
+    for (size_t r = 0; r < frame->count; r++) {
+      visit(visit_ctx, frame->references[r]);
+    }
+  }
+}
+
+// gc_visit_t of a full collection, the gray stack is the context
+void gc_visit_gray(void *gray_objects, object_t *obj) {
+  trace_mark_object(gray_objects, obj);
+}
+
+// gc_visit_t of a minor collection
+void gc_visit_young(void *gray_objects, object_t *obj) {
+  trace_mark_young_object(gray_objects, obj);
+}
+
+// keep the object that 'global' points to alive, whatever object it points to
+// at the time of a collection. The variable has to stay valid until it is
+// removed with vm_remove_global()
+void vm_add_global(vm_t *vm, object_t **global) {
+  if (vm == NULL || global == NULL) {
+    return;
+  }
+  vm_lock(vm);
+  stack_push(vm->globals, global);
+  vm_unlock(vm);
+}
+
+void vm_remove_global(vm_t *vm, object_t **global) {
+  vm_lock(vm);
+  for (size_t i = 0; i < vm->globals->count; i++) {
+    if (vm->globals->data[i] == global) {
+      // the order doesn't matter, move the last one into the gap
+      vm->globals->data[i] = vm->globals->data[--vm->globals->count];
+      break;
+    }
+  }
+  vm_unlock(vm);
+}
+
+// a root owned by the VM for C code that holds on to an object, e.g. across
+// calls. It stays a root until vm_free_handle(), vm_free() frees the ones left
+snek_handle_t *vm_new_handle(vm_t *vm, object_t *obj) {
+  if (vm == NULL) {
+    return NULL;
+  }
+  snek_handle_t *handle = malloc(sizeof(snek_handle_t));
+  if (handle == NULL) {
+    return NULL;
+  }
+
+  handle->obj = obj;
+  vm_lock(vm);
+  handle->index = vm->handles->count;
+  stack_push(vm->handles, handle);
+  vm_unlock(vm);
+  return handle;
+}
+
+void vm_free_handle(vm_t *vm, snek_handle_t *handle) {
+  if (vm == NULL || handle == NULL) {
+    return;
+  }
+
+  // move the last handle into the slot of this one, O(1)
+  vm_lock(vm);
+  snek_handle_t *last = vm->handles->data[--vm->handles->count];
+  vm->handles->data[handle->index] = last;
+  last->index = handle->index;
+  vm_unlock(vm);
+  free(handle);
+}
+
+// plug in a function that visits roots the VM doesn't know about (e.g. the
+// stack of an interpreter), it is called with 'ctx' by every collection
+void vm_add_roots(vm_t *vm, gc_roots_t enumerate, void *ctx) {
+  if (vm == NULL || enumerate == NULL) {
+    return;
+  }
+  root_source_t *source = malloc(sizeof(root_source_t));
+  if (source == NULL) {
+    exit(1); // losing roots would free live objects, see stack_push()
+  }
+  *source = (root_source_t){.enumerate = enumerate, .ctx = ctx};
+  vm_lock(vm);
+  stack_push(vm->root_sources, source);
+  vm_unlock(vm);
+}
+
+void vm_remove_roots(vm_t *vm, gc_roots_t enumerate, void *ctx) {
+  vm_lock(vm);
+  for (size_t i = 0; i < vm->root_sources->count; i++) {
+    root_source_t *source = vm->root_sources->data[i];
+    if (source->enumerate == enumerate && source->ctx == ctx) {
+      vm->root_sources->data[i] =
+          vm->root_sources->data[--vm->root_sources->count];
+      free(source);
+      break;
+    }
+  }
+  vm_unlock(vm);
+}
+
+// give a new object (or a string the intern table hands out again) the color
+// that keeps it alive until the end of the cycle in progress:
+// - marking: black, the marker may already be past everything that points to
+//   it. It has no children yet, later stores go through the write barrier
+// - sweeping: black only if the sweep still has to reach its slot, the sweep
+//   removes the mark again. Slots the sweep is done with stay white for the
+//   next cycle
+void gc_shade_new_object(vm_t *vm, object_t *obj) {
+  if (vm->gc_phase == GC_MARKING) {
+    gc_set_marked(obj, true);
+  } else if (vm->gc_phase == GC_SWEEPING) {
+    slab_page_t *page = slab_page_of(obj);
+    size_t slot = (size_t)(obj - page->slots);
+    bool swept =
+        page->swept || (page == vm->sweep_page && slot < vm->sweep_slot);
+    gc_set_marked(obj, !swept);
+  }
+}
+
+// do at most about 'budget' units of collection work and return, one unit is
+// one object blackened (plus one per element of an array) or one slot swept.
+// The first call starts a new cycle, returns true once the cycle is over.
+// Between 2 steps the program can keep running, the write barrier and
+// gc_shade_new_object() make sure it doesn't hide objects from the marker
+bool vm_collect_garbage_step(vm_t *vm, size_t budget) {
+  if (vm == NULL) {
+    return true;
+  }
+  if (vm->threaded) {
+    // the barrier of other mutators can't gray objects while this one marks
+    vm_collect_garbage(vm);
+    return true;
+  }
+
+  uint64_t start = gc_clock_ns();
+  if (vm->gc_phase == GC_IDLE) {
+    // there are few roots compared to the heap, graying them is not counted
+    gc_cycle_begin(vm, GC_CYCLE_FULL);
+    vm->gc_phase = GC_MARKING;
+    gc_mark_roots(vm, vm->gray);
+    vm->gc_cycle.mark_ns += gc_clock_ns() - start;
+  }
+
+  uint64_t traced = gc_clock_ns();
+  bool marking = vm->gc_phase == GC_MARKING;
+  size_t work = 0;
+  while (vm->gc_phase == GC_MARKING && work < budget) {
+    gc_note_gray(vm, vm->gray);
+    if (vm->gray->count == 0) {
+      // frames have no write barrier, scan them again before marking ends so
+      // that references added since the cycle started are seen too
+      gc_mark_roots(vm, vm->gray);
+      if (vm->gray->count == 0) {
+        sweep_begin(vm);
+      }
+      continue;
+    }
+
+    object_t *obj = stack_pop(vm->gray);
+    trace_blacken_object(vm->gray, obj);
+    work += 1 + (snek_kind(obj) == ARRAY ? obj->data.v_array.size : 0);
+  }
+  if (marking) {
+    uint64_t now = gc_clock_ns();
+    vm->gc_cycle.trace_ns += now - traced;
+    traced = now;
+  }
+
+  if (vm->gc_phase == GC_SWEEPING && work < budget) {
+    sweep_pages(vm, budget - work);
+    vm->gc_cycle.sweep_ns += gc_clock_ns() - traced;
+  }
+
+  gc_pause_end(vm, start);
+  return vm->gc_phase == GC_IDLE;
+}
+
+// run the incremental cycle in progress (if there is one) to its end
+void vm_collect_garbage_finish(vm_t *vm) {
+  while (vm->gc_phase != GC_IDLE) {
+    vm_collect_garbage_step(vm, SIZE_MAX);
+  }
+}
+
+// how many threads mark the heap during a full collection (vm_collect_garbage),
+// 1 keeps marking on the calling thread
+void vm_set_mark_threads(vm_t *vm, size_t threads) {
+  if (vm == NULL) {
+    return;
+  }
+  vm->mark_threads = threads > 0 ? threads : 1;
+}
+
+// set the mark of an object, returns true only for the one worker that set it
+// first, that worker is the only one that traces the object
+bool mark_claim(object_t *obj) {
+  if (obj == NULL || snek_is_immediate(obj)) {
+    return false;
+  }
+
+  // the 63 other slots of the word may be claimed at the same time
+  slab_page_t *page = slab_page_of(obj);
+  size_t slot = (size_t)(obj - page->slots);
+  uint64_t bit = (uint64_t)1 << (slot % 64);
+  uint64_t *word = &page->marked[slot / 64];
+  if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit) {
+    return false;
+  }
+  return !(__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit);
+}
+
+// a task that is lost would leave reachable objects unmarked, so like
+// stack_push() running out of memory here ends the program
+void mark_local_push(mark_worker_t *worker, mark_task_t task) {
+  if (worker->local_count == worker->local_capacity) {
+    worker->local_capacity *= 2;
+    worker->local =
+        realloc(worker->local, worker->local_capacity * sizeof(mark_task_t));
+    if (worker->local == NULL) {
+      exit(1);
+    }
+  }
+
+  worker->local[worker->local_count++] = task;
+  if (worker->local_count > worker->local_high_water) {
+    worker->local_high_water = worker->local_count;
+  }
+}
+
+void mark_deque_push(mark_deque_t *deque, mark_task_t task) {
+  pthread_mutex_lock(&deque->lock);
+  if (deque->tail == deque->capacity) {
+    // move the tasks back to the start first, thieves may have emptied it
+    size_t size = deque->tail - deque->head;
+    memmove(deque->tasks, deque->tasks + deque->head,
+            size * sizeof(mark_task_t));
+    deque->head = 0;
+    deque->tail = size;
+  }
+  if (deque->tail == deque->capacity) {
+    deque->capacity *= 2;
+    deque->tasks =
+        realloc(deque->tasks, deque->capacity * sizeof(mark_task_t));
+    if (deque->tasks == NULL) {
+      exit(1); // see mark_local_push()
+    }
+  }
+
+  deque->tasks[deque->tail++] = task;
+  __atomic_store_n(&deque->size, deque->tail - deque->head, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&deque->lock);
+}
+
+// the owner takes the newest task
+bool mark_deque_pop(mark_deque_t *deque, mark_task_t *task) {
+  if (__atomic_load_n(&deque->size, __ATOMIC_ACQUIRE) == 0) {
+    return false;
+  }
+
+  pthread_mutex_lock(&deque->lock);
+  bool found = deque->tail > deque->head;
+  if (found) {
+    *task = deque->tasks[--deque->tail];
+    __atomic_store_n(&deque->size, deque->tail - deque->head,
+                     __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return found;
+}
+
+// a thief takes the oldest task, it is usually the biggest piece of work
+bool mark_deque_steal(mark_deque_t *deque, mark_task_t *task) {
+  if (__atomic_load_n(&deque->size, __ATOMIC_ACQUIRE) == 0) {
+    return false;
+  }
+
+  pthread_mutex_lock(&deque->lock);
+  bool found = deque->tail > deque->head;
+  if (found) {
+    *task = deque->tasks[deque->head++];
+    __atomic_store_n(&deque->size, deque->tail - deque->head,
+                     __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return found;
+}
+
+// hand a batch of the oldest private tasks to the other workers, only when
+// there is plenty left for this worker and the previous batch was taken
+void mark_share(mark_worker_t *worker) {
+  if (worker->local_count < 2 * PARALLEL_MARK_BATCH ||
+      __atomic_load_n(&worker->deque.size, __ATOMIC_ACQUIRE) > 0) {
+    return;
+  }
+
+  for (size_t i = 0; i < PARALLEL_MARK_BATCH; i++) {
+    mark_deque_push(&worker->deque, worker->local[i]);
+  }
+  worker->local_count -= PARALLEL_MARK_BATCH;
+  memmove(worker->local, worker->local + PARALLEL_MARK_BATCH,
+          worker->local_count * sizeof(mark_task_t));
+}
+
+// try to take a task from the deque of any other worker
+bool mark_steal(mark_worker_t *worker, mark_task_t *task) {
+  parallel_mark_t *mark = worker->mark;
+  size_t self = (size_t)(worker - mark->workers);
+  for (size_t i = 1; i < mark->count; i++) {
+    mark_worker_t *victim = &mark->workers[(self + i) % mark->count];
+    if (mark_deque_steal(&victim->deque, task)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// trace one chunk of an array, what is left of it goes back on the stack
+void mark_process(mark_worker_t *worker, mark_task_t task) {
+  object_t *obj = task.obj;
+  if (snek_kind(obj) != ARRAY) {
+    return; // only arrays hold pointers to other objects
+  }
+
+  size_t size = obj->data.v_array.size;
+  size_t end = task.start + PARALLEL_MARK_CHUNK;
+  if (end < size) {
+    mark_local_push(worker, (mark_task_t){.obj = obj, .start = end});
+  } else {
+    end = size;
+  }
+
+  for (size_t i = task.start; i < end; i++) {
+    object_t *elem = obj->data.v_array.elements[i];
+    // objects other than arrays are done as soon as they are marked
+    if (mark_claim(elem) && snek_kind(elem) == ARRAY) {
+      mark_local_push(worker, (mark_task_t){.obj = elem, .start = 0});
+    }
+  }
+}
+
+void *mark_worker_run(void *arg) {
+  mark_worker_t *worker = arg;
+  parallel_mark_t *mark = worker->mark;
+  mark_task_t task;
+
+  for (;;) {
+    if (worker->local_count > 0) {
+      task = worker->local[--worker->local_count];
+    } else if (!mark_deque_pop(&worker->deque, &task) &&
+               !mark_steal(worker, &task)) {
+      // out of work: stop counting as busy and wait until either someone
+      // shares work again or nobody is busy anymore. Only busy workers share,
+      // so when the count reaches 0 every deque is empty and marking is done
+      __atomic_fetch_sub(&mark->busy, 1, __ATOMIC_ACQ_REL);
+      bool found = false;
+      while (!found && __atomic_load_n(&mark->busy, __ATOMIC_ACQUIRE) > 0) {
+        __atomic_fetch_add(&mark->busy, 1, __ATOMIC_ACQ_REL);
+        found = mark_steal(worker, &task);
+        if (!found) {
+          __atomic_fetch_sub(&mark->busy, 1, __ATOMIC_ACQ_REL);
+          sched_yield();
+        }
+      }
+      if (!found) {
+        return NULL;
+      }
+    }
+
+    mark_process(worker, task);
+    mark_share(worker);
+  }
+}
+
+// gc_visit_t of mark_parallel(), gives every root to the next worker in turn
+void mark_deal_root(void *mark, object_t *obj) {
+  parallel_mark_t *parallel = mark;
+  if (mark_claim(obj)) {
+    size_t worker = parallel->next_root++ % parallel->count;
+    mark_deque_push(&parallel->workers[worker].deque,
+                    (mark_task_t){.obj = obj, .start = 0});
+  }
+}
+
+// mark everything reachable from the roots with vm->mark_threads threads,
+// the calling thread is one of the workers. The program is stopped while this
+// runs, the workers only read the heap and set mark bits
+void mark_parallel(vm_t *vm) {
+  size_t count = vm->mark_threads;
+  mark_worker_t *workers = calloc(count, sizeof(mark_worker_t));
+  if (workers == NULL) {
+    mark(vm);
+    trace(vm);
+    return;
+  }
+
+  parallel_mark_t mark = {.workers = workers, .count = count, .busy = 0};
+  for (size_t i = 0; i < count; i++) {
+    workers[i].mark = &mark;
+    workers[i].local_capacity = 64;
+    workers[i].local = malloc(64 * sizeof(mark_task_t));
+    workers[i].deque.capacity = 64;
+    workers[i].deque.tasks = malloc(64 * sizeof(mark_task_t));
+    if (workers[i].local == NULL || workers[i].deque.tasks == NULL) {
+      exit(1); // see mark_local_push()
+    }
+    pthread_mutex_init(&workers[i].deque.lock, NULL);
+  }
+
+  // deal the roots out to the workers' deques, the first steals balance it
+  gc_visit_roots(vm, mark_deal_root, &mark);
+
+  // worker 0 is the calling thread, if a thread can't be started its deque is
+  // simply drained by the others
+  mark.busy = (int)count;
+  for (size_t i = 1; i < count; i++) {
+    workers[i].running = pthread_create(&workers[i].thread, NULL,
+                                        mark_worker_run, &workers[i]) == 0;
+    if (!workers[i].running) {
+      __atomic_fetch_sub(&mark.busy, 1, __ATOMIC_ACQ_REL);
+    }
+  }
+  mark_worker_run(&workers[0]);
+  for (size_t i = 1; i < count; i++) {
+    if (workers[i].running) {
+      pthread_join(workers[i].thread, NULL);
+    }
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    // there is no gray stack, the biggest private stack is the closest thing
+    if (workers[i].local_high_water > vm->gc_cycle.gray_high_water) {
+      vm->gc_cycle.gray_high_water = workers[i].local_high_water;
+    }
+    pthread_mutex_destroy(&workers[i].deque.lock);
+    free(workers[i].deque.tasks);
+    free(workers[i].local);
+  }
+  free(workers);
+}
+
+// choose how vm_collect_garbage() sweeps:
+// - SWEEP_EAGER: all at once before it returns (the default)
+// - SWEEP_LAZY: the collection only marks, every allocation after it sweeps a
+//   few slots (LAZY_SWEEP_BUDGET) until the whole heap is swept. The pause is
+//   shorter and the pages are swept right before they are allocated from, but
+//   heap.object_count includes the garbage until the sweep is over
+// - SWEEP_PARALLEL: the pages are split between 'threads' threads
+// the next collection (of any kind) finishes a lazy sweep that is still going
+void vm_set_sweep_mode(vm_t *vm, sweep_mode_t mode, size_t threads) {
+  if (vm == NULL) {
+    return;
+  }
+  vm_collect_garbage_finish(vm);
+
+  vm->sweep_mode = mode;
+  vm->sweep_threads = threads > 0 ? threads : 1;
+}
+
+void *sweep_worker_run(void *arg) {
+  sweep_worker_t *worker = arg;
+  slab_page_t *page = worker->first;
+  for (size_t p = 0; p < worker->count; p++, page = page->next) {
+    for (size_t i = 0; i < page->bump; i++) {
+      object_t *obj = &page->slots[i];
+      if (!slab_slot_is_allocated(page, i)) {
+        continue;
+      }
+      if (sweep_survivor(worker->vm, obj)) {
+        worker->live_bytes += snek_object_size(obj);
+      } else {
+        // no dead string is in the intern table anymore and the heap counter
+        // is fixed up afterwards, so only this page is written to
+        size_t size = snek_object_size(obj);
+        worker->objects_freed++;
+        worker->bytes_freed += size;
+        worker->freed.objects[obj->kind]++;
+        worker->freed.bytes[obj->kind] += size;
+        snek_object_free_buffers(worker->vm, obj);
+        slab_page_release(page, obj);
+      }
+    }
+    memset(page->marked, 0, sizeof(page->marked));
+    page->swept = true;
+  }
+  return NULL;
+}
+
+// sweep every page with vm->sweep_threads threads, the calling thread is one of
+// them. Each thread gets a run of pages of its own and frees slots only into
+// the free lists of those pages. What the threads would otherwise share is done
+// around them: the dead strings leave the intern table before and the live
+// object count is added up from the pages after
+void sweep_parallel(vm_t *vm) {
+  size_t count = vm->sweep_threads;
+  if (count > vm->heap.page_count) {
+    count = vm->heap.page_count;
+  }
+  sweep_worker_t *workers = NULL;
+  if (count > 1 && vm->heap.page_count >= PARALLEL_SWEEP_MIN_PAGES) {
+    workers = calloc(count, sizeof(sweep_worker_t));
+  }
+  if (workers == NULL) {
+    sweep(vm);
+    return;
+  }
+
+  sweep_begin(vm);
+  intern_table_remove_unmarked(&vm->strings);
+
+  // deal the pages out in runs that differ by at most one page
+  slab_page_t *page = vm->heap.pages;
+  for (size_t i = 0; i < count; i++) {
+    workers[i].vm = vm;
+    workers[i].first = page;
+    workers[i].count = vm->heap.page_count / count +
+                       (i < vm->heap.page_count % count ? 1 : 0);
+    for (size_t p = 0; p < workers[i].count; p++) {
+      page = page->next;
+    }
+  }
+
+  // worker 0 is the calling thread, the pages of a thread that can't be
+  // started are swept by the calling thread afterwards
+  for (size_t i = 1; i < count; i++) {
+    workers[i].running = pthread_create(&workers[i].thread, NULL,
+                                        sweep_worker_run, &workers[i]) == 0;
+  }
+  sweep_worker_run(&workers[0]);
+  for (size_t i = 1; i < count; i++) {
+    if (workers[i].running) {
+      pthread_join(workers[i].thread, NULL);
+    } else {
+      sweep_worker_run(&workers[i]);
+    }
+  }
+  for (size_t i = 0; i < count; i++) {
+    vm->gc_live_bytes += workers[i].live_bytes;
+    vm->gc_cycle.objects_freed += workers[i].objects_freed;
+    vm->gc_cycle.bytes_freed += workers[i].bytes_freed;
+    for (size_t kind = 0; kind < SNEK_KINDS; kind++) {
+      vm->heap_stats.objects[kind] -= workers[i].freed.objects[kind];
+      vm->heap_stats.bytes[kind] -= workers[i].freed.bytes[kind];
+    }
+    vm->heap_stats.live_bytes -= workers[i].bytes_freed;
+  }
+  free(workers);
+
+  vm->heap.object_count = 0;
+  for (page = vm->heap.pages; page != NULL; page = page->next) {
+    vm->heap.object_count += page->live;
+  }
+  vm->sweep_page = NULL;
+  vm->heap.current = vm->heap.pages;
+  gc_cycle_end(vm);
+}
+
+// bytes an object takes up, its slot plus the buffers it owns
+size_t snek_object_size(object_t *obj) {
+  size_t size = sizeof(object_t);
+  switch (obj->kind) {
+  case STRING:
+    if (!snek_string_is_inline(obj)) {
+      size += obj->data.v_string.length + 1;
+    }
+    break;
+  case ARRAY:
+    size += obj->data.v_array.capacity * sizeof(object_t *);
+    break;
+  case INT_ARRAY:
+  case FLOAT_ARRAY:
+    size += obj->data.v_typed_array.size * sizeof(int32_t);
+    break;
+  case EPHEMERON_TABLE:
+    size += obj->data.v_ephemerons.capacity * sizeof(ephemeron_entry_t);
+    break;
+  default:
+    break;
+  }
+  return size;
+}
+
+// automatic collection (off by default)
+// the VM collects by itself once the program allocated 'percent'% of what
+// survived the last full collection, e.g. 100 lets the heap double, the same
+// idea as GOGC. It never collects before 'min_bytes' were allocated (0 keeps
+// the default of GC_DEFAULT_MIN_TRIGGER), so a small heap isn't collected over
+// and over. 'percent' 0 turns it off again. While it is on any allocation can
+// collect, so every object the program still needs must be reachable from a
+// frame (the same goes for the emergency collection when memory runs out)
+void vm_set_gc_pacing(vm_t *vm, size_t percent, size_t min_bytes) {
+  if (vm == NULL) {
+    return;
+  }
+
+  vm->gc_percent = percent;
+  vm->gc_min_trigger = min_bytes > 0 ? min_bytes : GC_DEFAULT_MIN_TRIGGER;
+  vm->gc_trigger = vm->gc_live_bytes * percent / 100;
+  if (vm->gc_trigger < vm->gc_min_trigger) {
+    vm->gc_trigger = vm->gc_min_trigger;
+  }
+}
+
+// a full collection is over: start counting the allocations towards the next
+// one from 0 and move the trigger with the size of what survived
+void gc_cycle_end(vm_t *vm) {
+  vm->gc_phase = GC_IDLE;
+  vm->gc_allocated_bytes = 0;
+  vm->gc_allocated_objects = 0;
+  vm_set_gc_pacing(vm, vm->gc_percent, vm->gc_min_trigger);
+}
+
+// memory ran out: collect right away so the caller can try once more, returns
+// false when nothing was collected. 'keep' is the object the memory is for, it
+// is kept alive even though nothing references it yet (NULL if there is none)
+bool gc_emergency_collect(vm_t *vm, object_t *keep) {
+  if (vm->gc_percent == 0) {
+    return false; // the program may hold objects that no frame references
+  }
+
+  frame_t *frame = NULL;
+  if (keep != NULL) {
+    frame = vm_new_frame(vm);
+    if (frame == NULL) {
+      return false;
+    }
+    frame_reference_object(frame, keep);
+  }
+
+  gc_collect(vm, false);
+  // a lazy sweep would only give the memory back later
+  vm_collect_garbage_finish(vm);
+
+  if (frame != NULL) {
+    vm_frame_pop(vm);
+  }
+  return true;
+}
+
+// realloc() for the buffers of the objects, the bytes the buffer grows by
+// ('old_size' is what it had) count towards the next automatic collection. If
+// there is no memory left the VM collects garbage and tries once more, 'owner'
+// is the object the buffer belongs to
+void *gc_realloc(vm_t *vm, object_t *owner, void *ptr, size_t old_size,
+                 size_t size) {
+  gc_count_allocation(vm, size > old_size ? size - old_size : 0);
+  void *result = realloc(ptr, size);
+  if (result == NULL && size > 0 && gc_emergency_collect(vm, owner)) {
+    result = realloc(ptr, size);
+  }
+  return result;
+}
+
+// same as gc_realloc() but for a new zeroed buffer, like calloc()
+void *gc_calloc(vm_t *vm, object_t *owner, size_t count, size_t size) {
+  gc_count_allocation(vm, count * size);
+  void *result = calloc(count, size);
+  if (result == NULL && count > 0 && size > 0 &&
+      gc_emergency_collect(vm, owner)) {
+    result = calloc(count, size);
+  }
+  return result;
+}
+
+// telemetry
+
+uint64_t gc_clock_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+// start recording a new cycle
+void gc_cycle_begin(vm_t *vm, gc_cycle_kind_t kind) {
+  vm->gc_cycle = (gc_cycle_stats_t){.kind = kind, .start_ns = gc_clock_ns()};
+  vm->gc_cycle_open = true;
+}
+
+// the program was stopped since 'start_ns' for the cycle in progress, the
+// cycle is published if that was its last pause
+void gc_pause_end(vm_t *vm, uint64_t start_ns) {
+  uint64_t pause = gc_clock_ns() - start_ns;
+  vm->gc_cycle.pause_ns += pause;
+  vm->gc_cycle.pauses++;
+  if (pause > vm->gc_cycle.max_pause_ns) {
+    vm->gc_cycle.max_pause_ns = pause;
+  }
+
+  gc_telemetry_t *telemetry = &vm->gc_telemetry;
+  telemetry->pauses++;
+  telemetry->total_pause_ns += pause;
+  if (pause > telemetry->max_pause_ns) {
+    telemetry->max_pause_ns = pause;
+  }
+  size_t bucket = 0;
+  for (uint64_t us = pause / 1000; us > 0 && bucket + 1 < GC_PAUSE_BUCKETS;
+       us >>= 1) {
+    bucket++;
+  }
+  telemetry->pause_histogram[bucket]++;
+
+  if (vm->gc_phase == GC_IDLE) {
+    gc_cycle_publish(vm);
+  }
+}
+
+// the cycle in progress is over, make it the last one (and log it)
+void gc_cycle_publish(vm_t *vm) {
+  if (!vm->gc_cycle_open) {
+    return;
+  }
+  vm->gc_cycle_open = false;
+
+  gc_cycle_stats_t *cycle = &vm->gc_cycle;
+  cycle->survivors = vm->heap.object_count;
+  cycle->survivor_bytes = cycle->kind == GC_CYCLE_YOUNG ? 0 : vm->gc_live_bytes;
+  cycle->heap_pages = vm->heap.page_count;
+  vm->gc_telemetry.last = *cycle;
+  vm->gc_telemetry.cycles++;
+
+  if (vm->gc_log != NULL) {
+    static const char *kinds[] = {"full", "young", "compact"};
+    fprintf(vm->gc_log,
+            "gc %zu %s: pause %.3fms (max %.3fms in %zu) mark %.3fms "
+            "trace %.3fms sweep %.3fms, freed %zu objects %zu bytes, "
+            "survivors %zu objects %zu bytes, %zu pages, gray %zu\n",
+            vm->gc_telemetry.cycles, kinds[cycle->kind],
+            (double)cycle->pause_ns / 1e6, (double)cycle->max_pause_ns / 1e6,
+            cycle->pauses, (double)cycle->mark_ns / 1e6,
+            (double)cycle->trace_ns / 1e6, (double)cycle->sweep_ns / 1e6,
+            cycle->objects_freed, cycle->bytes_freed, cycle->survivors,
+            cycle->survivor_bytes, cycle->heap_pages, cycle->gray_high_water);
+  }
+}
+
+// called for every object a collection frees
+void gc_count_freed(vm_t *vm, object_t *obj) {
+  size_t size = snek_object_size(obj);
+  vm->gc_cycle.objects_freed++;
+  vm->gc_cycle.bytes_freed += size;
+  vm->heap_stats.objects[obj->kind]--;
+  vm->heap_stats.bytes[obj->kind] -= size;
+  vm->heap_stats.live_bytes -= size;
+}
+
+void heap_stats_add(heap_stats_t *stats, object_kind_t kind, size_t objects,
+                    size_t bytes) {
+  stats->objects[kind] += objects;
+  stats->bytes[kind] += bytes;
+  stats->live_bytes += bytes;
+  if (stats->live_bytes > stats->peak_bytes) {
+    stats->peak_bytes = stats->live_bytes;
+  }
+}
+
+// add what a mutator counted to the VM and start over
+void heap_stats_merge(heap_stats_t *stats, heap_stats_t *added) {
+  for (size_t kind = 0; kind < SNEK_KINDS; kind++) {
+    heap_stats_add(stats, kind, added->objects[kind], added->bytes[kind]);
+  }
+  *added = (heap_stats_t){.live_bytes = 0, .peak_bytes = 0};
+}
 
-  // mark objects that have no references for garbage collection
-  mark(vm);
+// count a new object ('old_size' 0) or one whose buffer grew from 'old_size'
+// bytes, a mutator counts it on its own until the next merge
+void gc_account(vm_t *vm, object_t *obj, size_t old_size) {
+  mutator_t *mutator = vm->threaded ? mutator_of(vm) : NULL;
+  heap_stats_t *stats =
+      mutator != NULL ? &mutator->heap_stats : &vm->heap_stats;
+  heap_stats_add(stats, obj->kind, old_size == 0 ? 1 : 0,
+                 snek_object_size(obj) - old_size);
+}
+
+// the live and peak bytes of the heap of the VM, per kind and in total. With
+// several mutators it is up to date after each collection. The pointer stays
+// valid as long as the VM
+const heap_stats_t *vm_heap_stats(vm_t *vm) {
+  return vm != NULL ? &vm->heap_stats : NULL;
+}
+
+void gc_note_gray(vm_t *vm, stack_t *gray_objects) {
+  if (gray_objects->count > vm->gc_cycle.gray_high_water) {
+    vm->gc_cycle.gray_high_water = gray_objects->count;
+  }
+}
+
+// what the collections of the VM did so far, 'last' is the last cycle that
+// ended. The pointer stays valid as long as the VM
+const gc_telemetry_t *vm_gc_telemetry(vm_t *vm) {
+  return vm != NULL ? &vm->gc_telemetry : NULL;
+}
+
+// a pause length (in ns) that 'percentile' percent (0-100) of the pauses so
+// far didn't exceed, e.g. 99 for the p99 pause. It is the upper end of a
+// histogram bucket, so it is an overestimate of up to 2 times. 0 if there were
+// no pauses yet
+uint64_t vm_gc_pause_percentile(vm_t *vm, double percentile) {
+  if (vm == NULL || vm->gc_telemetry.pauses == 0) {
+    return 0;
+  }
+
+  gc_telemetry_t *telemetry = &vm->gc_telemetry;
+  size_t rank = (size_t)(percentile / 100 * (double)telemetry->pauses);
+  if (rank < 1) {
+    rank = 1;
+  } else if (rank > telemetry->pauses) {
+    rank = telemetry->pauses;
+  }
+  size_t seen = 0;
+  for (size_t bucket = 0; bucket + 1 < GC_PAUSE_BUCKETS; bucket++) {
+    seen += telemetry->pause_histogram[bucket];
+    if (seen >= rank) {
+      uint64_t limit = ((uint64_t)1 << bucket) * 1000;
+      return limit < telemetry->max_pause_ns ? limit : telemetry->max_pause_ns;
+    }
+  }
+  return telemetry->max_pause_ns;
+}
+
+// log one line per collection cycle to 'out', NULL stops logging. The default
+// is stderr if SNEK_GC_LOG is set in the environment, no log otherwise
+void vm_set_gc_log(vm_t *vm, FILE *out) {
+  if (vm == NULL) {
+    return;
+  }
+  vm->gc_log = out;
+}
+
+// weak references
+
+// a reference to 'referent' that doesn't keep it alive, snek_weakref_get()
+// returns NULL once the collector found it dead
+object_t *new_snek_weakref(vm_t *vm, object_t *referent) {
+  object_t *obj = _new_snek_object(vm);
+  if (obj == NULL) {
+    return NULL;
+  }
+
+  obj->kind = WEAKREF;
+  obj->data.v_weakref = referent;
+  gc_account(vm, obj, 0);
+  vm_lock(vm);
+  stack_push(vm->weak_objects, obj);
+  vm_unlock(vm);
+  return obj;
+}
+
+object_t *snek_weakref_get(object_t *obj) {
+  if (obj == NULL || snek_kind(obj) != WEAKREF) {
+    return NULL;
+  }
+  return obj->data.v_weakref;
+}
+
+// an empty table of ephemerons: an entry keeps its value alive only while its
+// key is alive (and the table is), once the key dies the entry is removed.
+// A cache can hand out its memoized results without keeping them around
+// forever. Neither the keys nor the values need to be reachable from the table
+// for the program to use it
+object_t *new_snek_ephemeron_table(vm_t *vm) {
+  object_t *obj = _new_snek_object(vm);
+  if (obj == NULL) {
+    return NULL;
+  }
+
+  obj->kind = EPHEMERON_TABLE;
+  obj->data.v_ephemerons = (ephemeron_table_t){
+      .count = 0, .capacity = 0, .entries = NULL, .needs_rehash = false};
+  gc_account(vm, obj, 0);
+  vm_lock(vm);
+  stack_push(vm->weak_objects, obj);
+  vm_unlock(vm);
+  return obj;
+}
+
+// objects are sizeof(object_t) apart, mix the bits of the address so that
+// neighbours don't end up in neighbouring slots (the finalizer of splitmix64)
+uint64_t ephemeron_hash(object_t *key) {
+  uint64_t x = (uint64_t)(uintptr_t)key;
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+// the entry of 'key', NULL if there is none
+ephemeron_entry_t *ephemeron_table_find(ephemeron_table_t *table,
+                                        object_t *key) {
+  if (table->count == 0) {
+    return NULL;
+  }
+
+  if (table->needs_rehash) {
+    for (size_t i = 0; i < table->capacity; i++) {
+      if (table->entries[i].key == key) {
+        return &table->entries[i];
+      }
+    }
+    return NULL;
+  }
+
+  size_t mask = table->capacity - 1;
+  for (size_t i = ephemeron_hash(key) & mask;; i = (i + 1) & mask) {
+    ephemeron_entry_t *entry = &table->entries[i];
+    if (entry->key == key) {
+      return entry;
+    }
+    if (entry->key == NULL) {
+      return NULL;
+    }
+  }
+}
+
+// put the entries of the table of 'obj' in a new buffer of 'capacity' slots.
+// The program's calls pass their VM (the bytes count towards the next
+// collection, see gc_calloc()), a collection passes NULL
+bool ephemeron_table_rehash(vm_t *vm, object_t *obj, size_t capacity) {
+  ephemeron_entry_t *entries =
+      vm != NULL ? gc_calloc(vm, obj, capacity, sizeof(ephemeron_entry_t))
+                 : calloc(capacity, sizeof(ephemeron_entry_t));
+  if (entries == NULL) {
+    return false;
+  }
+
+  // read the table only now, gc_calloc() may have collected
+  ephemeron_table_t *table = &obj->data.v_ephemerons;
+  size_t old_size = snek_object_size(obj);
+  size_t mask = capacity - 1;
+  for (size_t i = 0; i < table->capacity; i++) {
+    ephemeron_entry_t entry = table->entries[i];
+    if (entry.key == NULL) {
+      continue;
+    }
+    size_t slot = ephemeron_hash(entry.key) & mask;
+    while (entries[slot].key != NULL) {
+      slot = (slot + 1) & mask;
+    }
+    entries[slot] = entry;
+  }
+
+  free(table->entries);
+  table->entries = entries;
+  table->capacity = capacity;
+  table->needs_rehash = false;
+  if (vm != NULL) {
+    gc_account(vm, obj, old_size); // a collection keeps the capacity
+  }
+  return true;
+}
+
+// backward shift deletion, see intern_table_remove()
+void ephemeron_table_remove_slot(ephemeron_table_t *table, size_t slot) {
+  table->count--;
+  if (table->needs_rehash) {
+    // lookups walk every slot anyway, a hole doesn't hide anything
+    table->entries[slot] = (ephemeron_entry_t){.key = NULL, .value = NULL};
+    return;
+  }
+
+  size_t mask = table->capacity - 1;
+  size_t hole = slot;
+  for (size_t next = (hole + 1) & mask; table->entries[next].key != NULL;
+       next = (next + 1) & mask) {
+    size_t home = ephemeron_hash(table->entries[next].key) & mask;
+    if (((next - home) & mask) >= ((next - hole) & mask)) {
+      table->entries[hole] = table->entries[next];
+      hole = next;
+    }
+  }
+  table->entries[hole] = (ephemeron_entry_t){.key = NULL, .value = NULL};
+}
+
+// map 'key' to 'value' (both can be any object), returns false if there was
+// no memory for a bigger table. There is no write barrier, the collector
+// looks at every entry of the live tables once marking is done
+bool snek_ephemeron_set(object_t *obj, object_t *key, object_t *value) {
+  if (obj == NULL || snek_kind(obj) != EPHEMERON_TABLE || key == NULL) {
+    return false;
+  }
+
+  ephemeron_table_t *table = &obj->data.v_ephemerons;
+  ephemeron_entry_t *entry = ephemeron_table_find(table, key);
+  if (entry != NULL) {
+    entry->value = value;
+    return true;
+  }
+
+  // keep the table at most 3/4 full like the intern table
+  vm_t *vm = slab_page_of(obj)->vm;
+  if ((table->count + 1) * 4 > table->capacity * 3) {
+    size_t capacity = table->capacity == 0 ? 16 : table->capacity * 2;
+    if (!ephemeron_table_rehash(vm, obj, capacity)) {
+      return false;
+    }
+  } else if (table->needs_rehash &&
+             !ephemeron_table_rehash(vm, obj, table->capacity)) {
+    return false;
+  }
+
+  size_t mask = table->capacity - 1;
+  size_t slot = ephemeron_hash(key) & mask;
+  while (table->entries[slot].key != NULL) {
+    slot = (slot + 1) & mask;
+  }
+  table->entries[slot] = (ephemeron_entry_t){.key = key, .value = value};
+  table->count++;
+  return true;
+}
+
+// the value of 'key', NULL if the table has none (any more)
+object_t *snek_ephemeron_get(object_t *obj, object_t *key) {
+  if (obj == NULL || snek_kind(obj) != EPHEMERON_TABLE || key == NULL) {
+    return NULL;
+  }
+  ephemeron_entry_t *entry = ephemeron_table_find(&obj->data.v_ephemerons, key);
+  return entry != NULL ? entry->value : NULL;
+}
+
+bool snek_ephemeron_remove(object_t *obj, object_t *key) {
+  if (obj == NULL || snek_kind(obj) != EPHEMERON_TABLE || key == NULL) {
+    return false;
+  }
+  ephemeron_table_t *table = &obj->data.v_ephemerons;
+  ephemeron_entry_t *entry = ephemeron_table_find(table, key);
+  if (entry == NULL) {
+    return false;
+  }
+  ephemeron_table_remove_slot(table, (size_t)(entry - table->entries));
+  return true;
+}
+
+// call 'finalize' once the collector finds 'obj' dead. The object is kept
+// alive (with everything it references) until the finalizer ran, see
+// vm_run_finalizers(), weak references to it are cleared before that. The
+// finalizer runs once, it can register itself again to run at the next death
+bool vm_register_finalizer(vm_t *vm, object_t *obj, snek_finalizer_t finalize,
+                           void *ctx) {
+  if (vm == NULL || obj == NULL || snek_is_immediate(obj) ||
+      finalize == NULL) {
+    return false; // immediates never die
+  }
+
+  finalizer_t *finalizer = malloc(sizeof(finalizer_t));
+  if (finalizer == NULL) {
+    return false;
+  }
+  *finalizer = (finalizer_t){.obj = obj, .finalize = finalize, .ctx = ctx};
+  vm_lock(vm);
+  stack_push(vm->finalizers, finalizer);
+  vm_unlock(vm);
+  return true;
+}
+
+// run the finalizers the collections queued, returns how many ran. They are
+// not run by the collection itself, which may happen in the middle of any
+// allocation, the program calls this where running code is safe
+size_t vm_run_finalizers(vm_t *vm) {
+  if (vm == NULL) {
+    return 0;
+  }
+
+  size_t ran = 0;
+  for (;;) {
+    vm_lock(vm);
+    finalizer_t *finalizer = vm->pending_finalizers->count > 0
+                                 ? stack_pop(vm->pending_finalizers)
+                                 : NULL;
+    vm_unlock(vm);
+    if (finalizer == NULL) {
+      return ran;
+    }
+
+    // a frame keeps the object alive while the finalizer runs, a collection
+    // may happen inside it
+    frame_t *frame = vm_new_frame(vm);
+    frame_reference_object(frame, finalizer->obj);
+    finalizer->finalize(vm, finalizer->obj, finalizer->ctx);
+    if (frame != NULL) {
+      vm_frame_pop(vm);
+    }
+    free(finalizer);
+    ran++;
+  }
+}
+
+// whether 'obj' survives the collection of the given kind, as far as marking
+// (or evacuating) found out so far
+bool gc_weak_is_live(gc_cycle_kind_t kind, object_t *obj) {
+  if (obj == NULL || snek_is_immediate(obj)) {
+    return true;
+  }
+  switch (kind) {
+  case GC_CYCLE_YOUNG:
+    return obj->is_old || gc_is_marked(obj);
+  case GC_CYCLE_COMPACT:
+    return obj->is_forwarded || gc_is_marked(obj);
+  default:
+    return gc_is_marked(obj);
+  }
+}
+
+// the address of a live object after the collection
+object_t *gc_weak_forward(gc_cycle_kind_t kind, object_t *obj) {
+  if (kind == GC_CYCLE_COMPACT && obj != NULL && !snek_is_immediate(obj) &&
+      obj->is_forwarded) {
+    return obj->data.forward;
+  }
+  return obj;
+}
+
+// keep 'obj' and everything it references alive after all, returns its
+// address after the collection
+object_t *gc_weak_keep(vm_t *vm, gc_cycle_kind_t kind, object_t *obj) {
+  switch (kind) {
+  case GC_CYCLE_YOUNG:
+    trace_mark_young_object(vm->gray, obj);
+    while (vm->gray->count > 0) {
+      trace_blacken_young_object(vm->gray, stack_pop(vm->gray));
+    }
+    return obj;
+  case GC_CYCLE_COMPACT:
+    obj = compact_evacuate(vm, obj);
+    compact_drain(vm);
+    return obj;
+  default:
+    trace_mark_object(vm->gray, obj);
+    while (vm->gray->count > 0) {
+      trace_blacken_object(vm->gray, stack_pop(vm->gray));
+    }
+    return obj;
+  }
+}
+
+// keep the values of the live keys of the live tables, returns false once
+// there was nothing left to keep. A kept value can be (or reach) the key of
+// another entry, so the caller repeats it until then
+bool gc_weak_keep_values(vm_t *vm, gc_cycle_kind_t kind) {
+  bool kept = false;
+  for (size_t i = 0; i < vm->weak_objects->count; i++) {
+    object_t *obj = vm->weak_objects->data[i];
+    if (!gc_weak_is_live(kind, obj)) {
+      continue;
+    }
+    obj = gc_weak_forward(kind, obj);
+    if (obj->kind != EPHEMERON_TABLE) {
+      continue;
+    }
+
+    ephemeron_table_t *table = &obj->data.v_ephemerons;
+    for (size_t slot = 0; slot < table->capacity; slot++) {
+      ephemeron_entry_t *entry = &table->entries[slot];
+      if (entry->key != NULL && gc_weak_is_live(kind, entry->key) &&
+          !gc_weak_is_live(kind, entry->value)) {
+        entry->value = gc_weak_keep(vm, kind, entry->value);
+        kept = true;
+      }
+    }
+  }
+  return kept;
+}
+
+// drop what a weak object pointed to and didn't survive, the rest gets its
+// address after the collection
+void gc_weak_clear(vm_t *vm, gc_cycle_kind_t kind, object_t *obj) {
+  (void)vm;
+  if (obj->kind == WEAKREF) {
+    object_t *referent = obj->data.v_weakref;
+    obj->data.v_weakref = gc_weak_is_live(kind, referent)
+                              ? gc_weak_forward(kind, referent)
+                              : NULL;
+    return;
+  }
+
+  ephemeron_table_t *table = &obj->data.v_ephemerons;
+  if (kind != GC_CYCLE_COMPACT) {
+    for (size_t slot = 0; slot < table->capacity; slot++) {
+      // the backward shift can move the next entry into this slot
+      while (table->entries[slot].key != NULL &&
+             !gc_weak_is_live(kind, table->entries[slot].key)) {
+        ephemeron_table_remove_slot(table, slot);
+      }
+    }
+    return;
+  }
+
+  // keys that moved are in the wrong slots now, so the dead entries are simply
+  // emptied and the table is rebuilt once
+  bool changed = false;
+  for (size_t slot = 0; slot < table->capacity; slot++) {
+    ephemeron_entry_t *entry = &table->entries[slot];
+    if (entry->key == NULL) {
+      continue;
+    }
+    if (!gc_weak_is_live(kind, entry->key)) {
+      *entry = (ephemeron_entry_t){.key = NULL, .value = NULL};
+      table->count--;
+      changed = true;
+      continue;
+    }
+    object_t *key = gc_weak_forward(kind, entry->key);
+    changed |= key != entry->key;
+    entry->key = key;
+    // the value of a dead table may be dead, it is kept if the table is found
+    // alive again (by a finalizer)
+    if (gc_weak_is_live(kind, entry->value)) {
+      entry->value = gc_weak_forward(kind, entry->value);
+    }
+  }
+  if (changed) {
+    table->needs_rehash = true;
+    ephemeron_table_rehash(NULL, obj, table->capacity);
+  }
+}
+
+// the weak pass of a collection of the given kind, run when marking (or
+// evacuating) is done and before anything is freed:
+// 1. the values of the ephemerons with live keys are kept alive
+// 2. weak references and ephemerons drop what is dead
+// 3. dead objects with a finalizer are kept alive for it and queued
+// 4. weak objects that died themselves are forgotten
+void gc_process_weak(vm_t *vm, gc_cycle_kind_t kind) {
+  while (gc_weak_keep_values(vm, kind)) {
+  }
+
+  for (size_t i = 0; i < vm->weak_objects->count; i++) {
+    gc_weak_clear(vm, kind, gc_weak_forward(kind, vm->weak_objects->data[i]));
+  }
+
+  size_t registered = 0;
+  bool resurrected = false;
+  for (size_t i = 0; i < vm->finalizers->count; i++) {
+    finalizer_t *finalizer = vm->finalizers->data[i];
+    if (gc_weak_is_live(kind, finalizer->obj)) {
+      finalizer->obj = gc_weak_forward(kind, finalizer->obj);
+      vm->finalizers->data[registered++] = finalizer;
+      continue;
+    }
+    finalizer->obj = gc_weak_keep(vm, kind, finalizer->obj);
+    stack_push(vm->pending_finalizers, finalizer);
+    resurrected = true;
+  }
+  vm->finalizers->count = registered;
+  // tables that were dead may be alive again, what is left in them has live
+  // keys
+  while (resurrected && gc_weak_keep_values(vm, kind)) {
+  }
+
+  size_t alive = 0;
+  for (size_t i = 0; i < vm->weak_objects->count; i++) {
+    object_t *obj = vm->weak_objects->data[i];
+    if (gc_weak_is_live(kind, obj)) {
+      vm->weak_objects->data[alive++] = gc_weak_forward(kind, obj);
+    }
+  }
+  vm->weak_objects->count = alive;
+}
+
+// compaction
+// after many cycles the survivors are spread thinly over many pages, and the
+// elements of an array end up far away from each other. vm_compact() copies
+// every reachable object into new pages in the order it finds them (the
+// elements of an array right after each other), points every reference to the
+// copies and frees the old pages. References the VM can't change stay valid:
+// - pinned objects (vm_pin()) are never moved, their page is kept
+// - the objects reported by root sources (vm_add_roots()) are only seen through
+//   gc_visit_t, so they are treated as pinned
+// references from frames, globals, handles, arrays and the intern table are
+// updated. Vectors hold their numbers inline and have nothing to update
+
+// keep 'obj' at its address, e.g. because C code holds on to it. Pinning does
+// not keep it alive, it has to be reachable as usual
+void vm_pin(vm_t *vm, object_t *obj) {
+  (void)vm;
+  if (obj != NULL && !snek_is_immediate(obj)) {
+    obj->is_pinned = true;
+  }
+}
+
+void vm_unpin(vm_t *vm, object_t *obj) {
+  (void)vm;
+  if (obj != NULL && !snek_is_immediate(obj)) {
+    obj->is_pinned = false;
+  }
+}
+
+// make every 'every'th full collection a vm_compact(), e.g. to keep an
+// automatically collected (see vm_set_gc_pacing()) long running program from
+// fragmenting. Automatic collections never move objects, the compaction one
+// of them was due for is done by the next vm_collect_garbage(). 0 never
+// compacts, which is the default
+void vm_set_compaction(vm_t *vm, size_t every) {
+  if (vm == NULL) {
+    return;
+  }
+  vm->compact_every = every;
+}
+
+// a full collection that also moves the survivors next to each other
+void vm_compact(vm_t *vm) {
+  if (vm == NULL) {
+    return;
+  }
+  vm_collect_garbage_finish(vm);
+  gc_stop_world(vm);
+
+  // a parked mutator may be inside an allocation with pointers to the
+  // operands of its call, nothing can move before it has returned
+  pthread_mutex_lock(&vm->safepoint_lock);
+  bool parked = vm->mutators_parked > 0;
+  pthread_mutex_unlock(&vm->safepoint_lock);
+  if (parked) {
+    vm->compact_pending = true;
+    gc_collect(vm, false);
+    gc_start_world(vm);
+    return;
+  }
+  vm->compact_pending = false;
+
+  gc_cycle_begin(vm, GC_CYCLE_COMPACT);
+  uint64_t start = gc_clock_ns();
+
+  // the copies are bump allocated from new pages, the old ones are detached
+  // and released at the end
+  slab_page_t *old_pages = vm->heap.pages;
+  vm->heap = (heap_t){.vm = vm,
+                      .pages = NULL,
+                      .current = NULL,
+                      .page_count = 0,
+                      .object_count = 0};
+
+  // an object that stays where it is (pinned) or was copied is marked, so the
+  // mark means "has its final address" during the compaction. Root sources
+  // go first, their objects must not be moved by another root before
+  for (size_t i = 0; i < vm->root_sources->count; i++) {
+    root_source_t *source = vm->root_sources->data[i];
+    source->enumerate(source->ctx, compact_keep_root, vm);
+  }
+  compact_frames(vm, vm->frames);
+  for (size_t i = 0; i < vm->mutators->count; i++) {
+    mutator_t *mutator = vm->mutators->data[i];
+    compact_frames(vm, mutator->frames);
+  }
+  for (size_t i = 0; i < vm->globals->count; i++) {
+    object_t **global = vm->globals->data[i];
+    *global = compact_evacuate(vm, *global);
+  }
+  for (size_t i = 0; i < vm->handles->count; i++) {
+    snek_handle_t *handle = vm->handles->data[i];
+    handle->obj = compact_evacuate(vm, handle->obj);
+  }
+  for (size_t i = 0; i < vm->pending_finalizers->count; i++) {
+    finalizer_t *finalizer = vm->pending_finalizers->data[i];
+    finalizer->obj = compact_evacuate(vm, finalizer->obj);
+  }
+  uint64_t marked = gc_clock_ns();
+  vm->gc_cycle.mark_ns += marked - start;
+
+  compact_drain(vm);
+  gc_process_weak(vm, GC_CYCLE_COMPACT);
+
+  // the table is weak, it follows the strings that moved, the dead ones are
+  // removed when they are freed below
+  for (size_t i = 0; i < vm->strings.capacity; i++) {
+    object_t *string = vm->strings.entries[i].string;
+    if (string != NULL && string->is_forwarded) {
+      vm->strings.entries[i].string = string->data.forward;
+    }
+  }
+
+  uint64_t traced = gc_clock_ns();
+  vm->gc_cycle.trace_ns += traced - marked;
+
+  vm->gc_live_bytes = 0;
+  for (slab_page_t *page = vm->heap.pages; page != NULL; page = page->next) {
+    for (size_t i = 0; i < page->bump; i++) {
+      vm->gc_live_bytes += snek_object_size(&page->slots[i]);
+    }
+    memset(page->marked, 0, sizeof(page->marked));
+  }
+  compact_release_pages(vm, old_pages);
+
+  // every survivor was promoted, like after any other full collection
+  vm->young->count = 0;
+  vm->remembered->count = 0;
+  vm->heap.current = vm->heap.pages;
+  gc_cycle_end(vm);
+  vm->gc_cycle.sweep_ns += gc_clock_ns() - traced;
+  gc_pause_end(vm, start);
+  gc_start_world(vm);
+}
+
+void compact_frames(vm_t *vm, stack_t *frames) {
+  for (size_t f = 0; f < frames->count; f++) {
+    frame_t *frame = frames->data[f];
+    if (frame == NULL) {
+      continue;
+    }
+    for (size_t r = 0; r < frame->count; r++) {
+      frame->references[r] = compact_evacuate(vm, frame->references[r]);
+    }
+  }
+}
+
+// the gray stack holds the objects at their final address whose elements
+// still point to the old ones. All the elements of an array are copied
+// together, so they end up next to each other
+void compact_drain(vm_t *vm) {
+  while (vm->gray->count > 0) {
+    gc_note_gray(vm, vm->gray);
+    object_t *obj = stack_pop(vm->gray);
+    if (snek_kind(obj) != ARRAY) {
+      continue; // nothing else holds strong references
+    }
+    for (size_t i = 0; i < obj->data.v_array.size; i++) {
+      obj->data.v_array.elements[i] =
+          compact_evacuate(vm, obj->data.v_array.elements[i]);
+    }
+  }
+}
+
+// 'obj' stays at its address, its elements still have to be evacuated
+void compact_keep(vm_t *vm, object_t *obj) {
+  gc_set_marked(obj, true);
+  obj->is_old = vm->generational;
+  obj->is_remembered = false;
+  stack_push(vm->gray, obj);
+}
+
+// gc_visit_t for the root sources, their objects can't be moved
+void compact_keep_root(void *vm, object_t *obj) {
+  if (obj != NULL && !snek_is_immediate(obj) && !gc_is_marked(obj)) {
+    compact_keep(vm, obj);
+  }
+}
+
+// copy a reachable object to the new pages (once) and return its new address
+object_t *compact_evacuate(vm_t *vm, object_t *obj) {
+  if (obj == NULL || snek_is_immediate(obj)) {
+    return obj;
+  }
+  if (obj->is_forwarded) {
+    return obj->data.forward;
+  }
+  if (gc_is_marked(obj)) {
+    return obj; // a copy already, or an object that is kept in place
+  }
+
+  object_t *copy = obj->is_pinned ? NULL : slab_alloc(&vm->heap);
+  if (copy == NULL) {
+    // pinned, or there is no memory for a new page: it simply doesn't move
+    compact_keep(vm, obj);
+    return obj;
+  }
+
+  // the buffers of the object (characters, elements, numbers) now belong to
+  // the copy, the old slot only remembers where the copy is
+  *copy = *obj;
+  vm_track_object(vm, copy);
+  gc_set_marked(copy, true);
+  copy->is_old = vm->generational;
+  copy->is_remembered = false;
+  obj->is_forwarded = true;
+  obj->data.forward = copy;
+  stack_push(vm->gray, copy);
+  return copy;
+}
+
+// after the evacuation: free what is dead in the old pages, give the pages
+// with objects that were kept in place back to the heap and free the rest
+void compact_release_pages(vm_t *vm, slab_page_t *pages) {
+  while (pages != NULL) {
+    slab_page_t *page = pages;
+    pages = page->next;
+
+    for (size_t i = 0; i < page->bump; i++) {
+      object_t *obj = &page->slots[i];
+      if (!slab_slot_is_allocated(page, i)) {
+        continue;
+      }
+      if (gc_is_marked(obj)) {
+        vm->gc_live_bytes += snek_object_size(obj);
+        continue; // kept in place
+      }
+      if (!obj->is_forwarded) {
+        gc_count_freed(vm, obj); // garbage
+        snek_object_free_buffers(vm, obj);
+      }
+      slab_page_release(page, obj);
+    }
+
+    if (page->live == 0) {
+      free(page);
+      continue;
+    }
+    memset(page->marked, 0, sizeof(page->marked));
+    page->swept = true;
+    page->next = vm->heap.pages;
+    vm->heap.pages = page;
+    vm->heap.page_count++;
+    vm->heap.object_count += page->live;
+  }
+}
+
+void heap_dump_u64(FILE *out, uint64_t value) {
+  fwrite(&value, sizeof(value), 1, out);
+}
+
+// gc_visit_t of the roots, an object is written (and its references followed)
+// the first time it is reached, the mark bit says that it was
+void heap_dump_root(void *visit_ctx, object_t *obj) {
+  heap_dump_t *dump = visit_ctx;
+  if (obj == NULL || snek_is_immediate(obj)) {
+    return;
+  }
+  fputc(SNEK_HEAP_DUMP_ROOT, dump->out);
+  heap_dump_u64(dump->out, (uint64_t)(uintptr_t)obj);
+  trace_mark_object(dump->gray, obj);
+}
+
+void heap_dump_object(heap_dump_t *dump, object_t *obj) {
+  size_t references = 0;
+  if (obj->kind == ARRAY) {
+    for (size_t i = 0; i < obj->data.v_array.size; i++) {
+      object_t *elem = obj->data.v_array.elements[i];
+      references += elem != NULL && !snek_is_immediate(elem);
+    }
+  }
+
+  fputc(SNEK_HEAP_DUMP_OBJECT, dump->out);
+  heap_dump_u64(dump->out, (uint64_t)(uintptr_t)obj);
+  fputc((uint8_t)obj->kind, dump->out);
+  heap_dump_u64(dump->out, snek_object_size(obj));
+  heap_dump_u64(dump->out, references);
+  dump->objects++;
+  if (references == 0) {
+    return; // the components of a vector are numbers, not objects
+  }
+  for (size_t i = 0; i < obj->data.v_array.size; i++) {
+    object_t *elem = obj->data.v_array.elements[i];
+    if (elem != NULL && !snek_is_immediate(elem)) {
+      heap_dump_u64(dump->out, (uint64_t)(uintptr_t)elem);
+      trace_mark_object(dump->gray, elem);
+    }
+  }
+}
+
+// write the objects reachable from the roots to 'path', see
+// SNEK_HEAP_DUMP_MAGIC for the format and heap-analyzer.c for what to do with
+// it. The program is stopped while the heap is walked, the walk needs the
+// gray stack and the mark bits like a collection. Returns false if the file
+// couldn't be written
+bool vm_heap_dump(vm_t *vm, const char *path) {
+  if (vm == NULL || path == NULL) {
+    return false;
+  }
+  FILE *out = fopen(path, "wb");
+  if (out == NULL) {
+    return false;
+  }
 
-  // trace all the objects (and their nested objects) for garbage collection
-  trace(vm);
+  // no cycle may be running, at the end of one every mark bit is clear
+  vm_collect_garbage_finish(vm);
+  gc_stop_world(vm);
+  fwrite(SNEK_HEAP_DUMP_MAGIC, 1, 8, out);
+  heap_dump_u64(out, SNEK_HEAP_DUMP_VERSION);
+
+  heap_dump_t dump = {.out = out, .gray = vm->gray, .objects = 0};
+  gc_visit_roots(vm, heap_dump_root, &dump);
+  while (vm->gray->count > 0) {
+    heap_dump_object(&dump, stack_pop(vm->gray));
+  }
+  fputc(SNEK_HEAP_DUMP_END, out);
+  heap_dump_u64(out, dump.objects);
+
+  for (slab_page_t *page = vm->heap.pages; page != NULL; page = page->next) {
+    memset(page->marked, 0, sizeof(page->marked));
+  }
+  gc_start_world(vm);
 
-  // sweep all of the objects that have no references
-  sweep(vm);
+  bool written = !ferror(out);
+  return fclose(out) == 0 && written;
 }
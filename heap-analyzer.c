@@ -0,0 +1,533 @@
+// offline analysis of the heap dumps written by vm_heap_dump(): totals per
+// kind, the objects that retain the most memory and the dominator tree
+//
+// build with: make heap-analyzer
+// usage: bin/heap-analyzer DUMP [--top N] [--tree MIN_BYTES]
+//
+// an object dominates another one if every path from the roots to the other
+// one goes through it. The retained size of an object is its own size plus the
+// size of everything it dominates, the memory a collection gives back once the
+// object is unreachable. The dominators are computed with the Lengauer-Tarjan
+// algorithm (the simple version, O(e log n)) without recursion, so a long
+// linked list doesn't overflow the stack
+//
+// the graph is kept in flat arrays, around 100 bytes per object and 12 per
+// reference at the most, nothing else is kept per object. The results are printed while
+// they are computed, --tree prints one line per object whose retained size is
+// at least MIN_BYTES while it walks the dominator tree (with the depth of the
+// object in the tree, the roots are at depth 0)
+
+#define SNEK_NO_MAIN
+#include "dynamic-values-tracing.c"
+
+#define NONE UINT32_MAX
+
+static const char *kind_names[] = {
+    [INTEGER] = "INTEGER",         [FLOAT] = "FLOAT",
+    [STRING] = "STRING",           [VECTOR3] = "VECTOR3",
+    [ARRAY] = "ARRAY",             [INT_ARRAY] = "INT_ARRAY",
+    [FLOAT_ARRAY] = "FLOAT_ARRAY", [WEAKREF] = "WEAKREF",
+    [EPHEMERON_TABLE] = "EPHEMERON_TABLE",
+};
+#define KINDS (sizeof(kind_names) / sizeof(kind_names[0]))
+
+typedef struct Node {
+  uint64_t id; // the address of the object in the dumped VM
+  uint64_t size;
+  size_t first_edge; // its references are edges[first_edge] up to the next's
+  uint8_t kind;
+} node_t;
+
+// node 0 stands for the roots, its references are the roots. The objects
+// follow in the order of the dump
+typedef struct Graph {
+  node_t *nodes;
+  size_t count;
+  size_t capacity;
+  // the ids of the objects while the dump is read, node numbers afterwards
+  uint64_t *edges;
+  size_t edge_count;
+  size_t edge_capacity;
+} graph_t;
+
+// grow '*array' of 'count' elements of 'size' bytes so one more fits
+static bool reserve(void **array, size_t *capacity, size_t count,
+                    size_t size) {
+  if (count < *capacity) {
+    return true;
+  }
+  size_t grown = *capacity > 0 ? *capacity * 2 : 1024;
+  void *bigger = realloc(*array, grown * size);
+  if (bigger == NULL) {
+    return false;
+  }
+  *array = bigger;
+  *capacity = grown;
+  return true;
+}
+
+static bool read_u64(FILE *in, uint64_t *value) {
+  return fread(value, sizeof(*value), 1, in) == 1;
+}
+
+static bool add_node(graph_t *graph, uint64_t id, uint8_t kind,
+                     uint64_t size) {
+  if (!reserve((void **)&graph->nodes, &graph->capacity, graph->count,
+               sizeof(node_t))) {
+    return false;
+  }
+  graph->nodes[graph->count++] = (node_t){
+      .id = id, .size = size, .first_edge = graph->edge_count, .kind = kind};
+  return true;
+}
+
+static bool add_edge(graph_t *graph, uint64_t id) {
+  if (!reserve((void **)&graph->edges, &graph->edge_capacity,
+               graph->edge_count, sizeof(uint64_t))) {
+    return false;
+  }
+  graph->edges[graph->edge_count++] = id;
+  return true;
+}
+
+// the references of 'node' are edges[edge_begin(node)] up to edge_end(node)
+static size_t edge_begin(graph_t *graph, size_t node) {
+  return graph->nodes[node].first_edge;
+}
+
+static size_t edge_end(graph_t *graph, size_t node) {
+  return node + 1 < graph->count ? graph->nodes[node + 1].first_edge
+                                 : graph->edge_count;
+}
+
+// read the dump, see SNEK_HEAP_DUMP_MAGIC for the format
+static bool load_dump(FILE *in, graph_t *graph) {
+  char magic[8];
+  uint64_t version;
+  if (fread(magic, 1, 8, in) != 8 ||
+      memcmp(magic, SNEK_HEAP_DUMP_MAGIC, 8) != 0 || !read_u64(in, &version) ||
+      version != SNEK_HEAP_DUMP_VERSION) {
+    fprintf(stderr, "not a heap dump of version %d\n", SNEK_HEAP_DUMP_VERSION);
+    return false;
+  }
+
+  if (!add_node(graph, 0, 0, 0)) {
+    return false;
+  }
+  for (;;) {
+    int tag = fgetc(in);
+    uint64_t id, size, references, objects;
+    int kind;
+    if (tag == SNEK_HEAP_DUMP_END) {
+      return read_u64(in, &objects) && objects == graph->count - 1;
+    }
+    if (tag == SNEK_HEAP_DUMP_ROOT && graph->count == 1) {
+      // vm_heap_dump() writes every root before the first object
+      if (!read_u64(in, &id) || !add_edge(graph, id)) {
+        return false;
+      }
+      continue;
+    }
+    if (tag != SNEK_HEAP_DUMP_OBJECT || !read_u64(in, &id) ||
+        (kind = fgetc(in)) == EOF || (size_t)kind >= KINDS ||
+        !read_u64(in, &size) || !read_u64(in, &references) ||
+        !add_node(graph, id, (uint8_t)kind, size)) {
+      return false;
+    }
+    for (uint64_t i = 0; i < references; i++) {
+      if (!read_u64(in, &id) || !add_edge(graph, id)) {
+        return false;
+      }
+    }
+  }
+}
+
+// the ids are addresses, hashed like the keys of an ephemeron table
+static uint64_t id_hash(uint64_t id) {
+  return ephemeron_hash((object_t *)(uintptr_t)id);
+}
+
+// turn the ids in the edges into node numbers with a hash table from ids to
+// nodes, an id that isn't in the dump (a broken dump) becomes NONE
+static bool resolve_edges(graph_t *graph) {
+  size_t capacity = 1;
+  while (capacity < graph->count * 2) {
+    capacity *= 2;
+  }
+  uint32_t *table = malloc(capacity * sizeof(uint32_t));
+  if (table == NULL) {
+    return false;
+  }
+  memset(table, 0xff, capacity * sizeof(uint32_t));
+
+  size_t mask = capacity - 1;
+  for (size_t node = 1; node < graph->count; node++) {
+    size_t slot = id_hash(graph->nodes[node].id) & mask;
+    while (table[slot] != NONE) {
+      slot = (slot + 1) & mask;
+    }
+    table[slot] = (uint32_t)node;
+  }
+  for (size_t e = 0; e < graph->edge_count; e++) {
+    uint64_t id = graph->edges[e];
+    size_t slot = id_hash(id) & mask;
+    while (table[slot] != NONE && graph->nodes[table[slot]].id != id) {
+      slot = (slot + 1) & mask;
+    }
+    graph->edges[e] = table[slot];
+  }
+
+  free(table);
+  return true;
+}
+
+// the state of Lengauer-Tarjan, every array has one element per node. 'semi'
+// is the number of a node in depth first order until it becomes the number of
+// its semidominator, 'vertex' is the reverse of that numbering
+typedef struct Dominators {
+  uint32_t *semi;
+  uint32_t *vertex;
+  uint32_t *parent;
+  uint32_t *ancestor;
+  uint32_t *label;
+  uint32_t *idom;
+  uint32_t *bucket; // the first node whose semidominator is this one
+  uint32_t *next;   // the next node in the same bucket
+  size_t reached;   // nodes reached from node 0, only they are numbered
+} dominators_t;
+
+// number the nodes in depth first order
+static bool number_nodes(graph_t *graph, dominators_t *dom) {
+  uint32_t *stack = malloc(graph->count * sizeof(uint32_t));
+  size_t *cursor = malloc(graph->count * sizeof(size_t));
+  if (stack == NULL || cursor == NULL) {
+    free(stack);
+    free(cursor);
+    return false;
+  }
+
+  size_t depth = 0;
+  stack[depth++] = 0;
+  dom->semi[0] = 0;
+  dom->vertex[0] = 0;
+  dom->parent[0] = NONE;
+  dom->reached = 1;
+  cursor[0] = edge_begin(graph, 0);
+  while (depth > 0) {
+    uint32_t node = stack[depth - 1];
+    if (cursor[node] == edge_end(graph, node)) {
+      depth--;
+      continue;
+    }
+    uint64_t child = graph->edges[cursor[node]++];
+    if (child == NONE || dom->semi[child] != NONE) {
+      continue;
+    }
+    dom->semi[child] = (uint32_t)dom->reached;
+    dom->vertex[dom->reached++] = (uint32_t)child;
+    dom->parent[child] = node;
+    cursor[child] = edge_begin(graph, child);
+    stack[depth++] = (uint32_t)child;
+  }
+
+  free(stack);
+  free(cursor);
+  return true;
+}
+
+// the node with the smallest semidominator on the path from 'node' up to the
+// root of its tree in the forest, the path is compressed on the way. 'path'
+// has room for every node
+static uint32_t eval(dominators_t *dom, uint32_t *path, uint32_t node) {
+  if (dom->ancestor[node] == NONE) {
+    return node;
+  }
+  size_t length = 0;
+  for (uint32_t at = node; dom->ancestor[dom->ancestor[at]] != NONE;
+       at = dom->ancestor[at]) {
+    path[length++] = at;
+  }
+  // from the top down, like the recursive version does it
+  while (length > 0) {
+    uint32_t at = path[--length];
+    uint32_t up = dom->ancestor[at];
+    if (dom->semi[dom->label[up]] < dom->semi[dom->label[at]]) {
+      dom->label[at] = dom->label[up];
+    }
+    dom->ancestor[at] = dom->ancestor[up];
+  }
+  return dom->label[node];
+}
+
+// the predecessors of node n are preds[start[n]] up to preds[start[n + 1]]
+static bool reverse_edges(graph_t *graph, size_t **start, uint32_t **preds) {
+  *start = calloc(graph->count + 1, sizeof(size_t));
+  *preds = malloc((graph->edge_count + 1) * sizeof(uint32_t));
+  if (*start == NULL || *preds == NULL) {
+    return false;
+  }
+  for (size_t e = 0; e < graph->edge_count; e++) {
+    if (graph->edges[e] != NONE) {
+      (*start)[graph->edges[e]]++;
+    }
+  }
+  // where the predecessors of each node end, they are filled in backwards
+  for (size_t node = 1; node < graph->count; node++) {
+    (*start)[node] += (*start)[node - 1];
+  }
+  (*start)[graph->count] = (*start)[graph->count - 1];
+  for (size_t node = 0; node < graph->count; node++) {
+    for (size_t e = edge_begin(graph, node); e < edge_end(graph, node); e++) {
+      if (graph->edges[e] != NONE) {
+        (*preds)[--(*start)[graph->edges[e]]] = (uint32_t)node;
+      }
+    }
+  }
+  return true;
+}
+
+// the immediate dominator of every node that is reachable from the roots in
+// dom->idom, the roots are dominated by node 0
+static bool compute_dominators(graph_t *graph, dominators_t *dom) {
+  size_t count = graph->count;
+  uint32_t **arrays[] = {&dom->semi,     &dom->vertex, &dom->parent,
+                         &dom->ancestor, &dom->label,  &dom->idom,
+                         &dom->bucket,   &dom->next};
+  for (size_t i = 0; i < sizeof(arrays) / sizeof(arrays[0]); i++) {
+    *arrays[i] = malloc(count * sizeof(uint32_t));
+    if (*arrays[i] == NULL) {
+      return false;
+    }
+  }
+  for (size_t node = 0; node < count; node++) {
+    dom->semi[node] = NONE;
+    dom->ancestor[node] = NONE;
+    dom->label[node] = (uint32_t)node;
+    dom->bucket[node] = NONE;
+    dom->idom[node] = NONE;
+  }
+  if (!number_nodes(graph, dom)) {
+    return false;
+  }
+
+  size_t *pred_start = NULL;
+  uint32_t *preds = NULL;
+  uint32_t *path = malloc(count * sizeof(uint32_t));
+  bool computed = path != NULL && reverse_edges(graph, &pred_start, &preds);
+  for (size_t i = dom->reached; computed && i-- > 1;) {
+    uint32_t node = dom->vertex[i];
+    for (size_t p = pred_start[node]; p < pred_start[node + 1]; p++) {
+      if (dom->semi[preds[p]] == NONE) {
+        continue; // not reachable itself
+      }
+      uint32_t smallest = eval(dom, path, preds[p]);
+      if (dom->semi[smallest] < dom->semi[node]) {
+        dom->semi[node] = dom->semi[smallest];
+      }
+    }
+    uint32_t semidominator = dom->vertex[dom->semi[node]];
+    dom->next[node] = dom->bucket[semidominator];
+    dom->bucket[semidominator] = node;
+
+    // link the node to its parent, then the nodes whose semidominator is the
+    // parent get their dominator (or the node to take it from below)
+    uint32_t parent = dom->parent[node];
+    dom->ancestor[node] = parent;
+    for (uint32_t in = dom->bucket[parent]; in != NONE; in = dom->next[in]) {
+      uint32_t smallest = eval(dom, path, in);
+      dom->idom[in] = dom->semi[smallest] < dom->semi[in] ? smallest : parent;
+    }
+    dom->bucket[parent] = NONE;
+  }
+  for (size_t i = 1; computed && i < dom->reached; i++) {
+    uint32_t node = dom->vertex[i];
+    if (dom->idom[node] != dom->vertex[dom->semi[node]]) {
+      dom->idom[node] = dom->idom[dom->idom[node]];
+    }
+  }
+  dom->idom[0] = 0;
+
+  free(path);
+  free(pred_start);
+  free(preds);
+  return computed;
+}
+
+static void print_node(graph_t *graph, uint32_t node, uint64_t retained) {
+  node_t *object = &graph->nodes[node];
+  printf("0x%012llx %-15s %12llu %14llu\n", (unsigned long long)object->id,
+         kind_names[object->kind], (unsigned long long)object->size,
+         (unsigned long long)retained);
+}
+
+// walk the dominator tree from node 0 and print every node that retains at
+// least 'min_retained' bytes, the children of a node are found through
+// 'bucket' and 'next' (the buckets are empty once the dominators are known)
+static bool print_tree(graph_t *graph, dominators_t *dom, uint64_t *retained,
+                       uint64_t min_retained) {
+  for (size_t i = dom->reached; i-- > 1;) {
+    uint32_t node = dom->vertex[i];
+    dom->next[node] = dom->bucket[dom->idom[node]];
+    dom->bucket[dom->idom[node]] = node;
+  }
+  uint32_t *stack = malloc(dom->reached * sizeof(uint32_t));
+  uint32_t *depths = dom->parent; // not needed anymore
+  if (stack == NULL) {
+    return false;
+  }
+
+  printf("\ndominator tree (retained >= %llu bytes)\n",
+         (unsigned long long)min_retained);
+  printf("%-6s %-14s %-15s %12s %14s\n", "depth", "object", "kind", "bytes",
+         "retained");
+  size_t top = 0;
+  depths[0] = 0;
+  for (uint32_t root = dom->bucket[0]; root != NONE; root = dom->next[root]) {
+    depths[root] = 0;
+    stack[top++] = root;
+  }
+  while (top > 0) {
+    uint32_t node = stack[--top];
+    if (retained[node] < min_retained) {
+      continue; // nothing below it retains more
+    }
+    printf("%-6u ", depths[node]);
+    print_node(graph, node, retained[node]);
+    for (uint32_t child = dom->bucket[node]; child != NONE;
+         child = dom->next[child]) {
+      depths[child] = depths[node] + 1;
+      stack[top++] = child;
+    }
+  }
+  free(stack);
+  return true;
+}
+
+static int usage(void) {
+  fprintf(stderr, "usage: heap-analyzer DUMP [--top N] [--tree MIN_BYTES]\n");
+  return 2;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    return usage();
+  }
+  size_t top_count = 10;
+  bool tree = false;
+  uint64_t min_retained = 0;
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+      top_count = (size_t)atol(argv[++i]);
+    } else if (strcmp(argv[i], "--tree") == 0 && i + 1 < argc) {
+      tree = true;
+      min_retained = (uint64_t)atoll(argv[++i]);
+    } else {
+      return usage();
+    }
+  }
+
+  FILE *in = fopen(argv[1], "rb");
+  if (in == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+  graph_t graph = {0};
+  bool loaded = load_dump(in, &graph);
+  fclose(in);
+  if (!loaded) {
+    fprintf(stderr, "%s: not a complete heap dump\n", argv[1]);
+    return 1;
+  }
+  if (graph.count - 1 > NONE - 1 || !resolve_edges(&graph)) {
+    fprintf(stderr, "%s: too many objects\n", argv[1]);
+    return 1;
+  }
+  dominators_t dom = {0};
+  if (!compute_dominators(&graph, &dom)) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  // the retained size of a node is summed up from its dominator tree, every
+  // node comes after its dominator in depth first order. A kind retains what
+  // its objects retain that aren't below another object of the same kind
+  uint64_t *retained = malloc(graph.count * sizeof(uint64_t));
+  uint16_t *kinds_above = malloc(graph.count * sizeof(uint16_t));
+  if (retained == NULL || kinds_above == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  for (size_t node = 0; node < graph.count; node++) {
+    retained[node] = graph.nodes[node].size;
+  }
+  for (size_t i = dom.reached; i-- > 1;) {
+    uint32_t node = dom.vertex[i];
+    retained[dom.idom[node]] += retained[node];
+  }
+  size_t kind_objects[KINDS] = {0};
+  uint64_t kind_bytes[KINDS] = {0};
+  uint64_t kind_retained[KINDS] = {0};
+  kinds_above[0] = 0;
+  for (size_t i = 1; i < dom.reached; i++) {
+    uint32_t node = dom.vertex[i];
+    uint32_t idom = dom.idom[node];
+    uint8_t kind = graph.nodes[node].kind;
+    kinds_above[node] = kinds_above[idom];
+    if (idom != 0) {
+      kinds_above[node] |= (uint16_t)(1 << graph.nodes[idom].kind);
+    }
+    kind_objects[kind]++;
+    kind_bytes[kind] += graph.nodes[node].size;
+    if (!(kinds_above[node] & (1 << kind))) {
+      kind_retained[kind] += retained[node];
+    }
+  }
+
+  printf("%zu objects, %llu bytes reachable from the roots\n\n",
+         graph.count - 1, (unsigned long long)retained[0]);
+  printf("%-15s %10s %14s %14s\n", "kind", "objects", "bytes", "retained");
+  for (size_t kind = 0; kind < KINDS; kind++) {
+    if (kind_objects[kind] > 0) {
+      printf("%-15s %10zu %14llu %14llu\n", kind_names[kind],
+             kind_objects[kind], (unsigned long long)kind_bytes[kind],
+             (unsigned long long)kind_retained[kind]);
+    }
+  }
+
+  // the largest retained sizes, kept sorted in a small array
+  uint32_t *top = malloc((top_count + 1) * sizeof(uint32_t));
+  size_t found = 0;
+  for (size_t i = 1; top != NULL && i < dom.reached; i++) {
+    uint32_t node = dom.vertex[i];
+    size_t at = found < top_count ? found++ : top_count;
+    while (at > 0 && retained[top[at - 1]] < retained[node]) {
+      top[at] = top[at - 1];
+      at--;
+    }
+    if (at < top_count) {
+      top[at] = node;
+    }
+  }
+  printf("\nlargest retained sizes\n");
+  printf("%-14s %-15s %12s %14s\n", "object", "kind", "bytes", "retained");
+  for (size_t i = 0; i < found; i++) {
+    print_node(&graph, top[i], retained[top[i]]);
+  }
+  free(top);
+
+  if (tree && !print_tree(&graph, &dom, retained, min_retained)) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  free(retained);
+  free(kinds_above);
+  uint32_t *arrays[] = {dom.semi, dom.vertex, dom.parent, dom.ancestor,
+                        dom.label, dom.idom, dom.bucket, dom.next};
+  for (size_t i = 0; i < sizeof(arrays) / sizeof(arrays[0]); i++) {
+    free(arrays[i]);
+  }
+  free(graph.nodes);
+  free(graph.edges);
+  return 0;
+}
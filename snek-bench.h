@@ -0,0 +1,111 @@
+// a tiny micro-benchmark harness for the object models, used by
+// bench-tracing.c and bench-refcounting.c
+//
+// every benchmark is run a few times without measuring (warmup) and then
+// 'reps' times with measuring, each result is printed as one JSON object per
+// line so it can be compared between runs/commits with any JSON tool:
+//
+// {"variant":"tracing","bench":"snek_add/int+int","ops":10000,"reps":30,
+//  "median_ns":1.52,"p99_ns":1.87,"min_ns":1.49}
+//
+// the times are per operation (the time of one repetition divided by 'ops')
+//
+// the environment can change a run:
+// - SNEK_BENCH_REPS: number of measured repetitions (default 30)
+// - SNEK_BENCH_FILTER: only run benchmarks whose name contains this text
+
+// include only once, see prototypes.h
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SNEK_BENCH_WARMUP 3
+#define SNEK_BENCH_DEFAULT_REPS 30
+
+typedef struct SnekBench {
+  const char *name;
+  size_t ops; // how many operations one call of run() does
+  // setup and teardown are optional (NULL) and not measured, they are called
+  // before/after every repetition, e.g. to create a fresh heap
+  void (*setup)(void *ctx);
+  void (*run)(void *ctx);
+  void (*teardown)(void *ctx);
+  void *ctx;
+  // overrides SNEK_BENCH_REPS when it is not 0, for benchmarks that are too
+  // slow to repeat 30 times (like collecting 10 million objects)
+  size_t reps;
+} snek_bench_t;
+
+static inline double snek_bench_now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec * 1e9 + (double)now.tv_nsec;
+}
+
+static inline int snek_bench_compare(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// should the benchmark called 'name' run at all (see SNEK_BENCH_FILTER)
+static inline bool snek_bench_enabled(const char *name) {
+  const char *filter = getenv("SNEK_BENCH_FILTER");
+  return filter == NULL || strstr(name, filter) != NULL;
+}
+
+static inline void snek_bench_run(const char *variant, snek_bench_t bench) {
+  if (!snek_bench_enabled(bench.name)) {
+    return;
+  }
+
+  size_t reps = SNEK_BENCH_DEFAULT_REPS;
+  const char *reps_env = getenv("SNEK_BENCH_REPS");
+  if (reps_env != NULL && atoi(reps_env) > 0) {
+    reps = (size_t)atoi(reps_env);
+  }
+  if (bench.reps > 0 && bench.reps < reps) {
+    reps = bench.reps;
+  }
+  size_t warmup = bench.reps > 0 ? 1 : SNEK_BENCH_WARMUP;
+
+  double *samples = malloc(reps * sizeof(double));
+  if (samples == NULL) {
+    return;
+  }
+
+  for (size_t i = 0; i < warmup + reps; i++) {
+    if (bench.setup != NULL) {
+      bench.setup(bench.ctx);
+    }
+    double start = snek_bench_now_ns();
+    bench.run(bench.ctx);
+    double elapsed = snek_bench_now_ns() - start;
+    if (bench.teardown != NULL) {
+      bench.teardown(bench.ctx);
+    }
+
+    if (i >= warmup) {
+      samples[i - warmup] = elapsed / (double)bench.ops;
+    }
+  }
+
+  // nearest rank percentiles, with few repetitions p99 is simply the slowest
+  qsort(samples, reps, sizeof(double), snek_bench_compare);
+  double median = samples[reps / 2];
+  if (reps % 2 == 0) {
+    median = (samples[reps / 2 - 1] + samples[reps / 2]) / 2;
+  }
+  size_t p99_rank = (reps * 99 + 99) / 100; // ceil(reps * 0.99)
+  double p99 = samples[p99_rank - 1];
+
+  printf("{\"variant\":\"%s\",\"bench\":\"%s\",\"ops\":%zu,\"reps\":%zu,"
+         "\"median_ns\":%.3f,\"p99_ns\":%.3f,\"min_ns\":%.3f}\n",
+         variant, bench.name, bench.ops, reps, median, p99, samples[0]);
+  fflush(stdout);
+  free(samples);
+}
@@ -0,0 +1,493 @@
+// vectorized kernels for the element wise math on typed arrays (INT_ARRAY and
+// FLOAT_ARRAY), shared by both object models (refcounting and tracing)
+//
+// every kernel exists 3 times:
+// - scalar: plain C loops, works everywhere and is the reference result
+// - sse2: 128 bit registers, 4 numbers per instruction, every x86-64 cpu has it
+// - avx2: 256 bit registers, 8 numbers per instruction, most cpus since 2013
+// the best set the cpu supports is picked once at runtime (through CPUID), so
+// the same binary runs everywhere without having to be built with -mavx2
+//
+// SNEK_SIMD=scalar|sse2|avx2 in the environment forces a (supported) set, e.g.
+// to compare against the scalar results or to benchmark the kernels
+
+// include only once, see prototypes.h
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SNEK_SIMD_X86 1
+#else
+#define SNEK_SIMD_X86 0
+#endif
+
+typedef enum SnekSimdOp {
+  SNEK_SIMD_ADD,
+  SNEK_SIMD_SUB,
+  SNEK_SIMD_MUL,
+} snek_simd_op_t;
+
+// one set of kernels, 'n' is always the number of elements, 'out' may be the
+// same buffer as one of the inputs
+typedef struct SnekKernels {
+  const char *name;
+  // out[i] = x[i] op y[i]
+  void (*i32_binary)(snek_simd_op_t op, const int32_t *x, const int32_t *y,
+                     int32_t *out, size_t n);
+  void (*f32_binary)(snek_simd_op_t op, const float *x, const float *y,
+                     float *out, size_t n);
+  // out[i] = x[i] * factor
+  void (*i32_scale)(const int32_t *x, int32_t factor, int32_t *out, size_t n);
+  void (*f32_scale)(const float *x, float factor, float *out, size_t n);
+  // out[i] = (float)x[i]
+  void (*i32_to_f32)(const int32_t *x, float *out, size_t n);
+  // sums wrap around like int arithmetic does, float sums are added in a
+  // different order by the simd kernels so the last bits may differ
+  int32_t (*i32_sum)(const int32_t *x, size_t n);
+  float (*f32_sum)(const float *x, size_t n);
+  int32_t (*i32_dot)(const int32_t *x, const int32_t *y, size_t n);
+  float (*f32_dot)(const float *x, const float *y, size_t n);
+} snek_kernels_t;
+
+// scalar kernels
+// ints are added as uint32_t so that overflow wraps around (like the simd
+// instructions do) instead of being undefined behaviour
+
+static void scalar_i32_binary(snek_simd_op_t op, const int32_t *x,
+                              const int32_t *y, int32_t *out, size_t n) {
+  switch (op) {
+  case SNEK_SIMD_ADD:
+    for (size_t i = 0; i < n; i++) {
+      out[i] = (int32_t)((uint32_t)x[i] + (uint32_t)y[i]);
+    }
+    break;
+  case SNEK_SIMD_SUB:
+    for (size_t i = 0; i < n; i++) {
+      out[i] = (int32_t)((uint32_t)x[i] - (uint32_t)y[i]);
+    }
+    break;
+  case SNEK_SIMD_MUL:
+    for (size_t i = 0; i < n; i++) {
+      out[i] = (int32_t)((uint32_t)x[i] * (uint32_t)y[i]);
+    }
+    break;
+  }
+}
+
+static void scalar_f32_binary(snek_simd_op_t op, const float *x,
+                              const float *y, float *out, size_t n) {
+  switch (op) {
+  case SNEK_SIMD_ADD:
+    for (size_t i = 0; i < n; i++) {
+      out[i] = x[i] + y[i];
+    }
+    break;
+  case SNEK_SIMD_SUB:
+    for (size_t i = 0; i < n; i++) {
+      out[i] = x[i] - y[i];
+    }
+    break;
+  case SNEK_SIMD_MUL:
+    for (size_t i = 0; i < n; i++) {
+      out[i] = x[i] * y[i];
+    }
+    break;
+  }
+}
+
+static void scalar_i32_scale(const int32_t *x, int32_t factor, int32_t *out,
+                             size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = (int32_t)((uint32_t)x[i] * (uint32_t)factor);
+  }
+}
+
+static void scalar_f32_scale(const float *x, float factor, float *out,
+                             size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = x[i] * factor;
+  }
+}
+
+static void scalar_i32_to_f32(const int32_t *x, float *out, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = (float)x[i];
+  }
+}
+
+static int32_t scalar_i32_sum(const int32_t *x, size_t n) {
+  uint32_t sum = 0;
+  for (size_t i = 0; i < n; i++) {
+    sum += (uint32_t)x[i];
+  }
+  return (int32_t)sum;
+}
+
+static float scalar_f32_sum(const float *x, size_t n) {
+  float sum = 0.0f;
+  for (size_t i = 0; i < n; i++) {
+    sum += x[i];
+  }
+  return sum;
+}
+
+static int32_t scalar_i32_dot(const int32_t *x, const int32_t *y, size_t n) {
+  uint32_t sum = 0;
+  for (size_t i = 0; i < n; i++) {
+    sum += (uint32_t)x[i] * (uint32_t)y[i];
+  }
+  return (int32_t)sum;
+}
+
+static float scalar_f32_dot(const float *x, const float *y, size_t n) {
+  float sum = 0.0f;
+  for (size_t i = 0; i < n; i++) {
+    sum += x[i] * y[i];
+  }
+  return sum;
+}
+
+static const snek_kernels_t snek_scalar_kernels = {
+    .name = "scalar",
+    .i32_binary = scalar_i32_binary,
+    .f32_binary = scalar_f32_binary,
+    .i32_scale = scalar_i32_scale,
+    .f32_scale = scalar_f32_scale,
+    .i32_to_f32 = scalar_i32_to_f32,
+    .i32_sum = scalar_i32_sum,
+    .f32_sum = scalar_f32_sum,
+    .i32_dot = scalar_i32_dot,
+    .f32_dot = scalar_f32_dot,
+};
+
+#if SNEK_SIMD_X86
+
+// sse2 kernels
+// the loops handle 4 numbers at a time with unaligned loads/stores (malloc
+// only promises 16 byte alignment and the arrays can be any size), whatever is
+// left at the end (less than 4 numbers) goes through the scalar kernel.
+// sse2 has no 32 bit integer multiply (that came with sse4.1) so int
+// multiplication stays scalar here
+
+__attribute__((target("sse2"))) static void
+sse2_i32_binary(snek_simd_op_t op, const int32_t *x, const int32_t *y,
+                int32_t *out, size_t n) {
+  if (op == SNEK_SIMD_MUL) {
+    scalar_i32_binary(op, x, y, out, n);
+    return;
+  }
+
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(x + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(y + i));
+    __m128i r = op == SNEK_SIMD_ADD ? _mm_add_epi32(a, b) : _mm_sub_epi32(a, b);
+    _mm_storeu_si128((__m128i *)(out + i), r);
+  }
+  scalar_i32_binary(op, x + i, y + i, out + i, n - i);
+}
+
+__attribute__((target("sse2"))) static void
+sse2_f32_binary(snek_simd_op_t op, const float *x, const float *y, float *out,
+                size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128 a = _mm_loadu_ps(x + i);
+    __m128 b = _mm_loadu_ps(y + i);
+    __m128 r;
+    switch (op) {
+    case SNEK_SIMD_ADD:
+      r = _mm_add_ps(a, b);
+      break;
+    case SNEK_SIMD_SUB:
+      r = _mm_sub_ps(a, b);
+      break;
+    default:
+      r = _mm_mul_ps(a, b);
+      break;
+    }
+    _mm_storeu_ps(out + i, r);
+  }
+  scalar_f32_binary(op, x + i, y + i, out + i, n - i);
+}
+
+__attribute__((target("sse2"))) static void
+sse2_f32_scale(const float *x, float factor, float *out, size_t n) {
+  __m128 f = _mm_set1_ps(factor);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(x + i), f));
+  }
+  scalar_f32_scale(x + i, factor, out + i, n - i);
+}
+
+__attribute__((target("sse2"))) static void
+sse2_i32_to_f32(const int32_t *x, float *out, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(x + i));
+    _mm_storeu_ps(out + i, _mm_cvtepi32_ps(a));
+  }
+  scalar_i32_to_f32(x + i, out + i, n - i);
+}
+
+__attribute__((target("sse2"))) static int32_t sse2_i32_sum(const int32_t *x,
+                                                            size_t n) {
+  __m128i sums = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    sums = _mm_add_epi32(sums, _mm_loadu_si128((const __m128i *)(x + i)));
+  }
+
+  // add the 4 lanes together
+  int32_t lanes[4];
+  _mm_storeu_si128((__m128i *)lanes, sums);
+  uint32_t sum = (uint32_t)lanes[0] + (uint32_t)lanes[1] + (uint32_t)lanes[2] +
+                 (uint32_t)lanes[3];
+  return (int32_t)(sum + (uint32_t)scalar_i32_sum(x + i, n - i));
+}
+
+__attribute__((target("sse2"))) static float sse2_f32_sum(const float *x,
+                                                          size_t n) {
+  __m128 sums = _mm_setzero_ps();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    sums = _mm_add_ps(sums, _mm_loadu_ps(x + i));
+  }
+
+  float lanes[4];
+  _mm_storeu_ps(lanes, sums);
+  return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) +
+         scalar_f32_sum(x + i, n - i);
+}
+
+__attribute__((target("sse2"))) static float
+sse2_f32_dot(const float *x, const float *y, size_t n) {
+  __m128 sums = _mm_setzero_ps();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128 products = _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i));
+    sums = _mm_add_ps(sums, products);
+  }
+
+  float lanes[4];
+  _mm_storeu_ps(lanes, sums);
+  return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) +
+         scalar_f32_dot(x + i, y + i, n - i);
+}
+
+static const snek_kernels_t snek_sse2_kernels = {
+    .name = "sse2",
+    .i32_binary = sse2_i32_binary,
+    .f32_binary = sse2_f32_binary,
+    .i32_scale = scalar_i32_scale, // needs a 32 bit multiply, see above
+    .f32_scale = sse2_f32_scale,
+    .i32_to_f32 = sse2_i32_to_f32,
+    .i32_sum = sse2_i32_sum,
+    .f32_sum = sse2_f32_sum,
+    .i32_dot = scalar_i32_dot, // needs a 32 bit multiply, see above
+    .f32_dot = sse2_f32_dot,
+};
+
+// avx2 kernels
+// same as the sse2 ones with 8 numbers at a time, avx2 also has the 32 bit
+// integer multiply so every kernel is vectorized
+
+__attribute__((target("avx2"))) static void
+avx2_i32_binary(snek_simd_op_t op, const int32_t *x, const int32_t *y,
+                int32_t *out, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(x + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(y + i));
+    __m256i r;
+    switch (op) {
+    case SNEK_SIMD_ADD:
+      r = _mm256_add_epi32(a, b);
+      break;
+    case SNEK_SIMD_SUB:
+      r = _mm256_sub_epi32(a, b);
+      break;
+    default:
+      r = _mm256_mullo_epi32(a, b);
+      break;
+    }
+    _mm256_storeu_si256((__m256i *)(out + i), r);
+  }
+  scalar_i32_binary(op, x + i, y + i, out + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+avx2_f32_binary(snek_simd_op_t op, const float *x, const float *y, float *out,
+                size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 a = _mm256_loadu_ps(x + i);
+    __m256 b = _mm256_loadu_ps(y + i);
+    __m256 r;
+    switch (op) {
+    case SNEK_SIMD_ADD:
+      r = _mm256_add_ps(a, b);
+      break;
+    case SNEK_SIMD_SUB:
+      r = _mm256_sub_ps(a, b);
+      break;
+    default:
+      r = _mm256_mul_ps(a, b);
+      break;
+    }
+    _mm256_storeu_ps(out + i, r);
+  }
+  scalar_f32_binary(op, x + i, y + i, out + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+avx2_i32_scale(const int32_t *x, int32_t factor, int32_t *out, size_t n) {
+  __m256i f = _mm256_set1_epi32(factor);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(x + i));
+    _mm256_storeu_si256((__m256i *)(out + i), _mm256_mullo_epi32(a, f));
+  }
+  scalar_i32_scale(x + i, factor, out + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+avx2_f32_scale(const float *x, float factor, float *out, size_t n) {
+  __m256 f = _mm256_set1_ps(factor);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_loadu_ps(x + i), f));
+  }
+  scalar_f32_scale(x + i, factor, out + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+avx2_i32_to_f32(const int32_t *x, float *out, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(x + i));
+    _mm256_storeu_ps(out + i, _mm256_cvtepi32_ps(a));
+  }
+  scalar_i32_to_f32(x + i, out + i, n - i);
+}
+
+__attribute__((target("avx2"))) static int32_t avx2_i32_sum(const int32_t *x,
+                                                            size_t n) {
+  __m256i sums = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    sums =
+        _mm256_add_epi32(sums, _mm256_loadu_si256((const __m256i *)(x + i)));
+  }
+
+  int32_t lanes[8];
+  _mm256_storeu_si256((__m256i *)lanes, sums);
+  return (int32_t)((uint32_t)scalar_i32_sum(lanes, 8) +
+                   (uint32_t)scalar_i32_sum(x + i, n - i));
+}
+
+__attribute__((target("avx2"))) static float avx2_f32_sum(const float *x,
+                                                          size_t n) {
+  __m256 sums = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    sums = _mm256_add_ps(sums, _mm256_loadu_ps(x + i));
+  }
+
+  float lanes[8];
+  _mm256_storeu_ps(lanes, sums);
+  return scalar_f32_sum(lanes, 8) + scalar_f32_sum(x + i, n - i);
+}
+
+__attribute__((target("avx2"))) static int32_t
+avx2_i32_dot(const int32_t *x, const int32_t *y, size_t n) {
+  __m256i sums = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(x + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(y + i));
+    sums = _mm256_add_epi32(sums, _mm256_mullo_epi32(a, b));
+  }
+
+  int32_t lanes[8];
+  _mm256_storeu_si256((__m256i *)lanes, sums);
+  return (int32_t)((uint32_t)scalar_i32_sum(lanes, 8) +
+                   (uint32_t)scalar_i32_dot(x + i, y + i, n - i));
+}
+
+__attribute__((target("avx2"))) static float
+avx2_f32_dot(const float *x, const float *y, size_t n) {
+  __m256 sums = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 products =
+        _mm256_mul_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i));
+    sums = _mm256_add_ps(sums, products);
+  }
+
+  float lanes[8];
+  _mm256_storeu_ps(lanes, sums);
+  return scalar_f32_sum(lanes, 8) + scalar_f32_dot(x + i, y + i, n - i);
+}
+
+static const snek_kernels_t snek_avx2_kernels = {
+    .name = "avx2",
+    .i32_binary = avx2_i32_binary,
+    .f32_binary = avx2_f32_binary,
+    .i32_scale = avx2_i32_scale,
+    .f32_scale = avx2_f32_scale,
+    .i32_to_f32 = avx2_i32_to_f32,
+    .i32_sum = avx2_i32_sum,
+    .f32_sum = avx2_f32_sum,
+    .i32_dot = avx2_i32_dot,
+    .f32_dot = avx2_f32_dot,
+};
+
+#endif // SNEK_SIMD_X86
+
+// the kernels called 'name' if the cpu can run them, NULL otherwise
+static inline const snek_kernels_t *snek_kernels_by_name(const char *name) {
+  if (strcmp(name, "scalar") == 0) {
+    return &snek_scalar_kernels;
+  }
+#if SNEK_SIMD_X86
+  __builtin_cpu_init();
+  if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+    return &snek_sse2_kernels;
+  }
+  if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+    return &snek_avx2_kernels;
+  }
+#endif
+  return NULL;
+}
+
+// the best kernels for this cpu, the choice is made on the first call
+static inline const snek_kernels_t *snek_kernels(void) {
+  static const snek_kernels_t *selected = NULL;
+  if (selected != NULL) {
+    return selected;
+  }
+
+  const char *forced = getenv("SNEK_SIMD");
+  const snek_kernels_t *kernels =
+      forced != NULL ? snek_kernels_by_name(forced) : NULL;
+  if (kernels == NULL) {
+    kernels = snek_kernels_by_name("avx2");
+  }
+  if (kernels == NULL) {
+    kernels = snek_kernels_by_name("sse2");
+  }
+  if (kernels == NULL) {
+    kernels = &snek_scalar_kernels;
+  }
+
+  selected = kernels;
+  return selected;
+}